@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "search.h"
+#include "database.h"
+#include "batch.h"
+
+/* 延迟直方图的桶数。第i个桶统计延迟不超过2^i微秒的查询 */
+#define LATENCY_HISTOGRAM_SIZE 32
+
+/* 1个查询及其检索结果 */
+typedef struct {
+  char *query;          /* 查询 */
+  char *output;         /* 检索结果的输出 */
+  size_t output_size;   /* 检索结果的输出的字节数 */
+  double latency;       /* 检索所花费的时间（秒） */
+} batch_query;
+
+/* 批量检索的任务 */
+typedef struct {
+  batch_query *queries;   /* 查询的数组 */
+  int n_queries;          /* 查询数 */
+  int next;               /* 下一个要处理的查询的下标 */
+  pthread_mutex_t mutex;  /* 保护next的互斥锁 */
+} batch_job;
+
+/* 执行批量检索的线程 */
+typedef struct {
+  pthread_t thread;       /* 线程 */
+  wiser_env *env;         /* 该线程专用的运行环境 */
+  batch_job *job;         /* 批量检索的任务 */
+} batch_worker;
+
+/**
+ * 从文件中逐行读取查询。忽略空行
+ * @param[in] path 查询文件的路径
+ * @param[out] queries 查询的数组
+ * @return 查询数。失败时为-1
+ */
+static int
+read_queries(const char *path, batch_query **queries)
+{
+  FILE *fp;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  ssize_t line_len;
+  int n = 0, capacity = 0;
+
+  *queries = NULL;
+  if (!(fp = fopen(path, "r"))) {
+    print_error("cannot open %s.", path);
+    return -1;
+  }
+  while ((line_len = getline(&line, &line_capacity, fp)) >= 0) {
+    /* 去掉行尾的换行符 */
+    while (line_len && (line[line_len - 1] == '\n' ||
+                        line[line_len - 1] == '\r')) {
+      line[--line_len] = '\0';
+    }
+    if (!line_len) { continue; }
+    if (n == capacity) {
+      batch_query *q;
+      capacity = capacity ? capacity * 2 : 64;
+      if (!(q = realloc(*queries, sizeof(batch_query) * capacity))) {
+        print_error("cannot allocate memory for queries.");
+        break;
+      }
+      *queries = q;
+    }
+    memset(&(*queries)[n], 0, sizeof(batch_query));
+    if (!((*queries)[n].query = strdup(line))) {
+      print_error("cannot allocate memory for queries.");
+      break;
+    }
+    n++;
+  }
+  free(line);
+  fclose(fp);
+  return n;
+}
+
+/**
+ * 执行1个查询，并将检索结果输出到内存中
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in,out] q 查询
+ */
+static void
+run_batch_query(wiser_env *env, batch_query *q)
+{
+  FILE *out;
+  double start;
+
+  if (!(out = open_memstream(&q->output, &q->output_size))) {
+    print_error("cannot allocate memory for search results.");
+    return;
+  }
+  start = get_monotonic_time();
+  search(env, q->query, out);
+  db_reset_statements(env);
+  q->latency = get_monotonic_time() - start;
+  fclose(out);
+}
+
+/**
+ * 执行批量检索的线程的主函数。不断取出下一个查询并进行检索
+ * @param[in] arg 执行批量检索的线程
+ * @return NULL
+ */
+static void *
+batch_worker_main(void *arg)
+{
+  batch_worker *w = (batch_worker *)arg;
+  batch_job *job = w->job;
+
+  while (1) {
+    int i;
+    pthread_mutex_lock(&job->mutex);
+    i = job->next < job->n_queries ? job->next++ : -1;
+    pthread_mutex_unlock(&job->mutex);
+    if (i < 0) { break; }
+    run_batch_query(w->env, &job->queries[i]);
+  }
+  return NULL;
+}
+
+/**
+ * 用于将延迟按升序排列的比较函数。用于qsort
+ * @param[in] a 延迟a
+ * @param[in] b 延迟b
+ * @return 比较结果
+ */
+static int
+latency_asc_sort(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * 获取已排序的延迟中的百分位数（nearest-rank法）
+ * @param[in] latencies 按升序排列的延迟
+ * @param[in] n 延迟的个数
+ * @param[in] p 百分位（0至100）
+ * @return 百分位数
+ */
+static double
+latency_percentile(const double *latencies, int n, double p)
+{
+  int rank = (int)(p / 100 * n + 0.999999);
+  if (rank < 1) { rank = 1; }
+  if (rank > n) { rank = n; }
+  return latencies[rank - 1];
+}
+
+/**
+ * 将吞吐量、延迟的百分位数和直方图输出到标准错误输出
+ * @param[in] queries 查询的数组
+ * @param[in] n 查询数
+ * @param[in] elapsed 全部查询所花费的时间（秒）
+ * @param[in] n_threads 执行查询的线程数
+ */
+static void
+print_batch_stats(const batch_query *queries, int n, double elapsed,
+                  int n_threads)
+{
+  int i, histogram[LATENCY_HISTOGRAM_SIZE] = {0};
+  double *latencies, sum = 0;
+
+  if (!n || !(latencies = malloc(sizeof(double) * n))) { return; }
+  for (i = 0; i < n; i++) {
+    int bucket = 0;
+    latencies[i] = queries[i].latency;
+    sum += latencies[i];
+    while (bucket < LATENCY_HISTOGRAM_SIZE - 1 &&
+           latencies[i] * 1e6 > (double)(1LL << bucket)) {
+      bucket++;
+    }
+    histogram[bucket]++;
+  }
+  qsort(latencies, n, sizeof(double), latency_asc_sort);
+
+  print_error("queries: %d threads: %d elapsed: %.3f s "
+              "throughput: %.1f queries/s",
+              n, n_threads, elapsed, elapsed > 0 ? n / elapsed : 0.0);
+  print_error("latency(ms): mean: %.3f p50: %.3f p95: %.3f p99: %.3f "
+              "max: %.3f",
+              sum / n * 1e3,
+              latency_percentile(latencies, n, 50) * 1e3,
+              latency_percentile(latencies, n, 95) * 1e3,
+              latency_percentile(latencies, n, 99) * 1e3,
+              latencies[n - 1] * 1e3);
+  print_error("latency histogram:");
+  for (i = 0; i < LATENCY_HISTOGRAM_SIZE; i++) {
+    if (histogram[i]) {
+      print_error("  <= %10lld us: %d", 1LL << i, histogram[i]);
+    }
+  }
+  free(latencies);
+}
+
+/**
+ * 批量检索。从文件中逐行读取查询，用多个线程进行检索，
+ * 然后按查询的顺序将检索结果输出到标准输出，并将延迟的统计信息输出到标准错误输出
+ * 与服务器模式一样，每个查询的检索结果以1个空行结尾
+ * @param[in] envs 各线程专用的运行环境的数组。运行环境的个数即为线程数
+ * @param[in] n_envs 运行环境的个数
+ * @param[in] path 查询文件的路径
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+run_batch(wiser_env **envs, int n_envs, const char *path)
+{
+  int i, n_started = 0;
+  double start, elapsed;
+  batch_job job;
+  batch_worker *workers;
+
+  if ((job.n_queries = read_queries(path, &job.queries)) < 0) {
+    return -1;
+  }
+  if (!(workers = calloc(n_envs, sizeof(batch_worker)))) {
+    print_error("cannot allocate memory for batch search.");
+    free(job.queries);
+    return -1;
+  }
+  job.next = 0;
+  pthread_mutex_init(&job.mutex, NULL);
+
+  start = get_monotonic_time();
+  /* 第0个运行环境在当前线程中使用 */
+  for (i = 1; i < n_envs; i++) {
+    workers[i].env = envs[i];
+    workers[i].job = &job;
+    if (pthread_create(&workers[i].thread, NULL, batch_worker_main,
+                       &workers[i])) {
+      print_error("cannot create a search thread.");
+      break;
+    }
+    n_started++;
+  }
+  workers[0].env = envs[0];
+  workers[0].job = &job;
+  batch_worker_main(&workers[0]);
+  for (i = 1; i <= n_started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  elapsed = get_monotonic_time() - start;
+
+  for (i = 0; i < job.n_queries; i++) {
+    batch_query *q = &job.queries[i];
+    if (q->output) { fwrite(q->output, 1, q->output_size, stdout); }
+    putchar('\n');
+    free(q->output);
+    free(q->query);
+  }
+  fflush(stdout);
+  print_batch_stats(job.queries, job.n_queries, elapsed, n_started + 1);
+
+  pthread_mutex_destroy(&job.mutex);
+  free(job.queries);
+  free(workers);
+  return 0;
+}
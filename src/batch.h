@@ -0,0 +1,8 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "wiser.h"
+
+int run_batch(wiser_env **envs, int n_envs, const char *path);
+
+#endif /* __BATCH_H__ */
@@ -0,0 +1,577 @@
+#include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "token.h"
+#include "search.h"
+#include "segment.h"
+#include "indexer.h"
+#include "postings.h"
+#include "database.h"
+
+/*
+ * wiser的基准测试程序（make bench）
+ * 用固定的随机数种子生成人工语料库，对分词、倒排列表的编码与解码、倒排列表的合并、
+ * 构建索引和检索分别进行测量。每项结果以1行JSON的形式输出到标准输出
+ */
+
+/* 生成文本时使用的字符的种类数。从U+4E00开始的汉字 */
+#define BENCH_ALPHABET_SIZE 3000
+/* 文档的最小长度（字符数） */
+#define BENCH_MIN_DOCUMENT_LEN 500
+/* 文档的最大长度与最小长度之差（字符数） */
+#define BENCH_DOCUMENT_LEN_RANGE 3000
+/* 检索的基准测试所使用的查询数 */
+#define BENCH_QUERIES 200
+/* 每项微基准测试至少要测量的秒数 */
+#define BENCH_MIN_SECONDS 0.5
+/* 默认的文档数 */
+#define BENCH_DEFAULT_DOCUMENTS 2000
+
+/* 人工语料库 */
+typedef struct {
+  int n;                /* 文档数 */
+  UTF32Char **texts;    /* 各文档的正文（UTF-32） */
+  int *text_lens;       /* 各文档的正文的长度 */
+  char **bodies;        /* 各文档的正文（UTF-8） */
+  int *body_sizes;      /* 各文档的正文的字节数 */
+  long long size;       /* 所有文档的正文的字节数之和（UTF-8） */
+} bench_corpus;
+
+/* 随机数生成器的状态（xorshift64*） */
+static uint64_t bench_random_state = 88172645463325252ULL;
+
+/**
+ * 生成伪随机数
+ * @return 64比特的伪随机数
+ */
+static uint64_t
+bench_random(void)
+{
+  bench_random_state ^= bench_random_state >> 12;
+  bench_random_state ^= bench_random_state << 25;
+  bench_random_state ^= bench_random_state >> 27;
+  return bench_random_state * 2685821657736338717ULL;
+}
+
+/**
+ * 生成[0, 1)的伪随机数
+ * @return 伪随机数
+ */
+static double
+bench_random_double(void)
+{
+  return (bench_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * 生成1个文档的正文。字符的出现频率近似于齐普夫分布，并且每隔若干个字符插入1个句号
+ * @param[out] text 生成的正文（UTF-32）
+ * @param[in] len 正文的长度
+ */
+static void
+generate_text(UTF32Char *text, int len)
+{
+  int i;
+  for (i = 0; i < len; i++) {
+    if (bench_random() % 16 == 0) {
+      text[i] = 0x3002; /* 。 */
+    } else {
+      double u = bench_random_double();
+      text[i] = 0x4E00 + (UTF32Char)(BENCH_ALPHABET_SIZE * u * u * u);
+    }
+  }
+}
+
+/**
+ * 生成人工语料库
+ * @param[out] corpus 语料库
+ * @param[in] n 文档数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+generate_corpus(bench_corpus *corpus, int n)
+{
+  int i;
+
+  memset(corpus, 0, sizeof(bench_corpus));
+  if (!(corpus->texts = calloc(n, sizeof(UTF32Char *))) ||
+      !(corpus->text_lens = calloc(n, sizeof(int))) ||
+      !(corpus->bodies = calloc(n, sizeof(char *))) ||
+      !(corpus->body_sizes = calloc(n, sizeof(int)))) {
+    print_error("cannot allocate memory for a corpus.");
+    return -1;
+  }
+  corpus->n = n;
+  for (i = 0; i < n; i++) {
+    int len = BENCH_MIN_DOCUMENT_LEN +
+              bench_random() % BENCH_DOCUMENT_LEN_RANGE;
+    if (!(corpus->texts[i] = malloc(sizeof(UTF32Char) * len)) ||
+        !(corpus->bodies[i] = malloc(len * MAX_UTF8_SIZE + 1))) {
+      print_error("cannot allocate memory for a corpus.");
+      return -1;
+    }
+    generate_text(corpus->texts[i], len);
+    corpus->text_lens[i] = len;
+    utf32toutf8(corpus->texts[i], len, corpus->bodies[i],
+                &corpus->body_sizes[i]);
+    corpus->bodies[i][corpus->body_sizes[i]] = '\0';
+    corpus->size += corpus->body_sizes[i];
+  }
+  return 0;
+}
+
+/**
+ * 释放人工语料库
+ * @param[in] corpus 语料库
+ */
+static void
+free_corpus(bench_corpus *corpus)
+{
+  int i;
+  for (i = 0; i < corpus->n; i++) {
+    if (corpus->texts) { free(corpus->texts[i]); }
+    if (corpus->bodies) { free(corpus->bodies[i]); }
+  }
+  free(corpus->texts);
+  free(corpus->text_lens);
+  free(corpus->bodies);
+  free(corpus->body_sizes);
+}
+
+/**
+ * 以1行JSON的形式输出1项基准测试的结果
+ * @param[in] name 基准测试的名称
+ * @param[in] unit 操作的单位
+ * @param[in] ops 操作的次数
+ * @param[in] bytes 处理的字节数。不适用时为0
+ * @param[in] seconds 所花费的秒数
+ */
+static void
+print_bench_result(const char *name, const char *unit, long long ops,
+                   long long bytes, double seconds)
+{
+  printf("{\"benchmark\": \"%s\", \"unit\": \"%s\", \"ops\": %lld, "
+         "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"ns_per_op\": %.1f",
+         name, unit, ops, seconds, seconds > 0 ? ops / seconds : 0.0,
+         ops ? seconds * 1e9 / ops : 0.0);
+  if (bytes) {
+    printf(", \"bytes\": %lld, \"mb_per_sec\": %.2f",
+           bytes, seconds > 0 ? bytes / seconds / (1 << 20) : 0.0);
+  }
+  printf("}\n");
+  fflush(stdout);
+}
+
+/**
+ * 为语料库中的部分文档构建内存上的倒排索引
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] corpus 语料库
+ * @param[in] from 第一个文档的下标
+ * @param[in] to 最后一个文档的下标 + 1
+ * @param[in] step 文档下标的间隔
+ * @param[in,out] a 内存池
+ * @return 倒排索引
+ */
+static inverted_index_hash *
+build_inverted_index(wiser_env *env, const bench_corpus *corpus,
+                     int from, int to, int step, arena *a)
+{
+  int i;
+  inverted_index_hash *ii = NULL;
+  for (i = from; i < to; i += step) {
+    text_to_postings_lists(env, i + 1, corpus->texts[i], corpus->text_lens[i],
+                           env->token_len, &ii, a);
+  }
+  return ii;
+}
+
+/**
+ * 统计倒排索引中的倒排列表的文档数之和
+ * @param[in] ii 倒排索引
+ * @return 文档数之和
+ */
+static long long
+count_postings(const inverted_index_hash *ii)
+{
+  long long n = 0;
+  const inverted_index_value *p;
+  for (p = ii; p; p = p->hh.next) { n += p->postings_list->len; }
+  return n;
+}
+
+/**
+ * 测量分词（ngram_next和text_to_postings_lists）的速度
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] corpus 语料库
+ */
+static void
+bench_tokenize(wiser_env *env, const bench_corpus *corpus)
+{
+  long long docs = 0, bytes = 0;
+  double seconds = 0;
+
+  while (seconds < BENCH_MIN_SECONDS) {
+    double start = get_monotonic_time();
+    inverted_index_hash *ii = build_inverted_index(env, corpus, 0, corpus->n,
+                                                   1, env->ii_buffer_arena);
+    seconds += get_monotonic_time() - start;
+    docs += corpus->n;
+    bytes += corpus->size;
+    free_inverted_index(ii);
+    reset_arena(env->ii_buffer_arena);
+  }
+  print_bench_result("tokenize", "documents", docs, bytes, seconds);
+}
+
+/**
+ * 测量合并倒排索引（merge_postings）的速度
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] corpus 语料库
+ * @param[in] interleave 为真时两个倒排索引的文档编号交错，否则一方全部小于另一方
+ */
+static void
+bench_merge(wiser_env *env, const bench_corpus *corpus, int interleave)
+{
+  long long postings = 0;
+  double seconds = 0;
+  arena *a, *b;
+
+  if (!(a = alloc_arena(II_BUFFER_ARENA_BLOCK_SIZE)) ||
+      !(b = alloc_arena(II_BUFFER_ARENA_BLOCK_SIZE))) {
+    return;
+  }
+  while (seconds < BENCH_MIN_SECONDS) {
+    double start;
+    inverted_index_hash *base, *added;
+    if (interleave) {
+      base = build_inverted_index(env, corpus, 0, corpus->n, 2, a);
+      added = build_inverted_index(env, corpus, 1, corpus->n, 2, b);
+    } else {
+      base = build_inverted_index(env, corpus, 0, corpus->n / 2, 1, a);
+      added = build_inverted_index(env, corpus, corpus->n / 2, corpus->n, 1, b);
+    }
+    postings += count_postings(base) + count_postings(added);
+    start = get_monotonic_time();
+    merge_inverted_index(base, added);
+    seconds += get_monotonic_time() - start;
+    free_inverted_index(base);
+    reset_arena(a);
+    reset_arena(b);
+  }
+  print_bench_result(interleave ? "merge/interleaved" : "merge/append",
+                     "postings", postings, 0, seconds);
+  free_arena(a);
+  free_arena(b);
+}
+
+/**
+ * 测量解码编码后的倒排列表的速度
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] encoded 编码后的倒排列表的数组
+ * @param[in] n 倒排列表的个数
+ * @param[in] postings 所有倒排列表的文档数之和
+ * @param[in] encoded_size 所有编码后的倒排列表的字节数之和
+ * @param[in] with_positions 是否解码位置信息
+ * @param[in] name 基准测试的名称
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+bench_decode(wiser_env *env, buffer *const *encoded, int n,
+             long long postings, long long encoded_size, int with_positions,
+             const char *name)
+{
+  int i;
+  long long ops;
+  double seconds;
+
+  for (ops = 0, seconds = 0; seconds < BENCH_MIN_SECONDS;
+       ops += postings) {
+    double start = get_monotonic_time();
+    for (i = 0; i < n; i++) {
+      int decoded_len;
+      postings_list *decoded;
+      if (decode_postings(env, BUFFER_PTR(encoded[i]),
+                          BUFFER_SIZE(encoded[i]), with_positions,
+                          &decoded, &decoded_len)) {
+        print_error("postings list decode error");
+        return -1;
+      }
+      if (decoded) { free_postings_list(decoded); }
+    }
+    seconds += get_monotonic_time() - start;
+  }
+  print_bench_result(name, "postings", ops, encoded_size * (ops / postings),
+                     seconds);
+  return 0;
+}
+
+/**
+ * 测量倒排列表的编码与解码的速度
+ * 对整个语料库的倒排索引中的所有倒排列表进行编码，然后再全部解码
+ * @param[in] env 存储着应用程序运行环境的结构体。须已将语料库存储到数据库中
+ * @param[in] corpus 语料库
+ * @param[in] method 压缩方法
+ * @param[in] method_name 压缩方法的名称
+ */
+static void
+bench_codec(wiser_env *env, const bench_corpus *corpus,
+            compress_method method, const char *method_name)
+{
+  int i, n;
+  long long postings, encoded_size = 0, ops;
+  double seconds;
+  char name[64];
+  buffer **encoded;
+  inverted_index_value *p;
+  inverted_index_hash *ii;
+  compress_method saved = env->compress;
+
+  ii = build_inverted_index(env, corpus, 0, corpus->n, 1,
+                            env->ii_buffer_arena);
+  n = HASH_COUNT(ii);
+  postings = count_postings(ii);
+  if (!(encoded = calloc(n, sizeof(buffer *)))) {
+    free_inverted_index(ii);
+    reset_arena(env->ii_buffer_arena);
+    return;
+  }
+  env->compress = method;
+
+  for (ops = 0, seconds = 0; seconds < BENCH_MIN_SECONDS;
+       ops += postings) {
+    double start = get_monotonic_time();
+    for (i = 0, p = ii; p; i++, p = p->hh.next) {
+      if (!encoded[i] && !(encoded[i] = alloc_buffer())) { goto exit; }
+      encoded[i]->curr = encoded[i]->head;
+      encoded[i]->bit = 0;
+      encode_postings(env, p->postings_list, p->docs_count, encoded[i]);
+    }
+    seconds += get_monotonic_time() - start;
+  }
+  for (i = 0; i < n; i++) { encoded_size += BUFFER_SIZE(encoded[i]); }
+  snprintf(name, sizeof(name), "encode/%s", method_name);
+  print_bench_result(name, "postings", ops, encoded_size * (ops / postings),
+                     seconds);
+
+  snprintf(name, sizeof(name), "decode/%s", method_name);
+  if (bench_decode(env, encoded, n, postings, encoded_size, TRUE, name)) {
+    goto exit;
+  }
+  snprintf(name, sizeof(name), "decode/%s/docs", method_name);
+  bench_decode(env, encoded, n, postings, encoded_size, FALSE, name);
+exit:
+  env->compress = saved;
+  for (i = 0; i < n; i++) {
+    if (encoded[i]) { free_buffer(encoded[i]); }
+  }
+  free(encoded);
+  free_inverted_index(ii);
+  reset_arena(env->ii_buffer_arena);
+}
+
+/**
+ * 测量从存储文档到写出段文件为止的整个构建索引过程的速度
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] corpus 语料库
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+bench_index(wiser_env *env, const bench_corpus *corpus)
+{
+  int i, rc = 0;
+  double start = get_monotonic_time();
+
+  begin(env);
+  for (i = 0; i < corpus->n && !rc; i++) {
+    char title[32];
+    int title_size, document_id, body32_len, inserted;
+    UTF32Char *body32;
+
+    title_size = snprintf(title, sizeof(title), "Doc%d", i);
+    db_add_document(env, title, title_size, corpus->bodies[i],
+                    corpus->body_sizes[i], &inserted);
+    document_id = db_get_document_id(env, title, title_size);
+    if (utf8toutf32(corpus->bodies[i], corpus->body_sizes[i],
+                    &body32, &body32_len)) {
+      rc = -1;
+      break;
+    }
+    text_to_postings_lists(env, document_id, body32, body32_len,
+                           env->token_len, &env->ii_buffer,
+                           env->ii_buffer_arena);
+    free(body32);
+    if (inserted) { env->stats.documents_count++; }
+    env->indexed_count++;
+    if (++env->ii_buffer_count > env->ii_buffer_update_threshold) {
+      rc = flush_ii_buffer(env);
+    }
+  }
+  if (!rc) { rc = flush_ii_buffer(env); }
+  if (!rc) { rc = db_replace_corpus_stats(env, &env->stats); }
+  if (rc) {
+    rollback(env);
+    return -1;
+  }
+  commit(env);
+  print_bench_result("index", "documents", corpus->n, corpus->size,
+                     get_monotonic_time() - start);
+  return 0;
+}
+
+/**
+ * 测量检索的速度。查询是从语料库中随机截取的3至8个字符
+ * @param[in] env 存储着应用程序运行环境的结构体。须已构建了语料库的索引
+ * @param[in] corpus 语料库
+ * @param[in] enable_phrase_search 是否进行短语检索
+ */
+static void
+bench_search(wiser_env *env, const bench_corpus *corpus,
+             int enable_phrase_search)
+{
+  int i;
+  long long ops = 0;
+  double seconds = 0;
+  char queries[BENCH_QUERIES][8 * MAX_UTF8_SIZE + 1];
+  FILE *out;
+
+  if (!(out = fopen("/dev/null", "w"))) { return; }
+  for (i = 0; i < BENCH_QUERIES; i++) {
+    int j, doc, len, offset, size;
+    const UTF32Char *t;
+    do {
+      doc = bench_random() % corpus->n;
+      len = 3 + bench_random() % 6;
+      offset = bench_random() % (corpus->text_lens[doc] - len);
+      t = corpus->texts[doc] + offset;
+      /* 不使用含有句号的片段 */
+      for (j = 0; j < len && t[j] != 0x3002; j++) {}
+    } while (j < len);
+    utf32toutf8(t, len, queries[i], &size);
+    queries[i][size] = '\0';
+  }
+
+  env->enable_phrase_search = enable_phrase_search;
+  while (seconds < BENCH_MIN_SECONDS) {
+    double start = get_monotonic_time();
+    for (i = 0; i < BENCH_QUERIES; i++) {
+      search(env, queries[i], out);
+      db_reset_statements(env);
+    }
+    seconds += get_monotonic_time() - start;
+    ops += BENCH_QUERIES;
+  }
+  print_bench_result(enable_phrase_search ? "search/phrase" : "search/and",
+                     "queries", ops, 0, seconds);
+  fclose(out);
+}
+
+/**
+ * 删除基准测试用的数据库和段文件
+ * @param[in] dir 临时目录
+ * @param[in] db_path 数据库的路径
+ */
+static void
+remove_bench_files(const char *dir, const char *db_path)
+{
+  char path[PATH_MAX];
+  DIR *d;
+  struct dirent *e;
+
+  snprintf(path, sizeof(path), "%s.segments", db_path);
+  if ((d = opendir(path))) {
+    while ((e = readdir(d))) {
+      char file[PATH_MAX + 256];
+      if (e->d_name[0] == '.') { continue; }
+      snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+      unlink(file);
+    }
+    closedir(d);
+    rmdir(path);
+  }
+  unlink(db_path);
+  rmdir(dir);
+}
+
+/**
+ * 入口
+ * @param[in] argc 参数的个数
+ * @param[in] argv 参数指针的数组
+ */
+int
+main(int argc, char *argv[])
+{
+  int ch, rc = 0, n_documents = BENCH_DEFAULT_DOCUMENTS;
+  char dir[] = "/tmp/wiser-bench-XXXXXX", db_path[sizeof(dir) + 16];
+  bench_corpus corpus;
+  wiser_env env;
+  extern char *optarg;
+
+  while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+    switch (ch) {
+    case 'n':
+      n_documents = atoi(optarg);
+      break;
+    case 's':
+      bench_random_state = strtoull(optarg, NULL, 10) | 1;
+      break;
+    default:
+      printf("usage: %s [-n documents] [-s seed]\n", argv[0]);
+      return -1;
+    }
+  }
+  if (n_documents < 2) { n_documents = 2; }
+  if (generate_corpus(&corpus, n_documents)) {
+    free_corpus(&corpus);
+    return -1;
+  }
+  if (!mkdtemp(dir)) {
+    print_error("cannot create a directory: %s", strerror(errno));
+    free_corpus(&corpus);
+    return -1;
+  }
+  snprintf(db_path, sizeof(db_path), "%s/bench.db", dir);
+
+  /* 与构建索引时的默认设置相同 */
+  memset(&env, 0, sizeof(wiser_env));
+  if (init_database(&env, db_path, DEFAULT_INDEX_PRAGMAS_STR) ||
+      !(env.ii_buffer_arena = alloc_arena(II_BUFFER_ARENA_BLOCK_SIZE)) ||
+      !(env.query_arena = alloc_arena(QUERY_ARENA_BLOCK_SIZE))) {
+    rc = -1;
+    goto exit;
+  }
+  env.db_path = db_path;
+  env.token_len = N_GRAM;
+  env.compress = compress_golomb;
+  env.skip_interval = atoi(DEFAULT_SKIP_INTERVAL_STR);
+  env.format = index_format_segment;
+  env.search_threads = 1;
+  env.top_k = 10;
+  env.ii_buffer_update_threshold = DEFAULT_II_BUFFER_UPDATE_THRESHOLD;
+
+  bench_tokenize(&env, &corpus);
+  bench_merge(&env, &corpus, FALSE);
+  bench_merge(&env, &corpus, TRUE);
+  if ((rc = bench_index(&env, &corpus))) { goto exit; }
+  bench_codec(&env, &corpus, compress_none, "none");
+  bench_codec(&env, &corpus, compress_golomb, "golomb");
+  bench_codec(&env, &corpus, compress_streamvbyte, "streamvbyte");
+  bench_search(&env, &corpus, FALSE);
+  bench_search(&env, &corpus, TRUE);
+
+exit:
+  free_token_dictionary(&env);
+  free_segments(&env);
+  if (env.ii_buffer_arena) { free_arena(env.ii_buffer_arena); }
+  if (env.query_arena) { free_arena(env.query_arena); }
+  if (env.db) { fin_database(&env); }
+  remove_bench_files(dir, db_path);
+  free_corpus(&corpus);
+  return rc;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+
+#include "util.h"
+#include "cache.h"
+#include "postings.h"
+
+/**
+ * 分配解码后的倒排列表的LRU缓存
+ * @param[in] capacity 缓存可以使用的字节数
+ * @return 分配好的缓存。失败时为NULL
+ */
+postings_cache *
+alloc_postings_cache(size_t capacity)
+{
+  postings_cache *cache;
+
+  if (!(cache = calloc(1, sizeof(postings_cache)))) {
+    print_error("cannot allocate memory for a postings cache.");
+    return NULL;
+  }
+  cache->capacity = capacity;
+  pthread_mutex_init(&cache->mutex, NULL);
+  return cache;
+}
+
+/**
+ * 从缓存中删除1项，并释放其倒排列表
+ * @param[in,out] cache 缓存
+ * @param[in] e 要删除的项
+ */
+static void
+remove_postings_cache_entry(postings_cache *cache, postings_cache_entry *e)
+{
+  HASH_DEL(cache->entries, e);
+  DL_DELETE(cache->lru, e);
+  cache->size -= e->size;
+  free_postings_list(e->postings);
+  free(e);
+}
+
+/**
+ * 从最久未使用的项开始删除，直到缓存的使用量不超过容量为止
+ * 正在被游标使用的项不会被删除
+ * @param[in,out] cache 缓存
+ */
+static void
+evict_postings_cache(postings_cache *cache)
+{
+  postings_cache_entry *e, *tmp;
+
+  DL_FOREACH_SAFE(cache->lru, e, tmp) {
+    if (cache->size <= cache->capacity) { break; }
+    if (!e->refs) { remove_postings_cache_entry(cache, e); }
+  }
+}
+
+/**
+ * 从缓存中获取解码后的倒排列表
+ * 获取成功后，在调用函数postings_cache_release之前该倒排列表不会被释放
+ * @param[in,out] cache 缓存
+ * @param[in] token_id 词元编号
+ * @param[out] max_positions_count 各文档的出现次数的最大值
+ * @return 倒排列表。未命中时为NULL
+ */
+const postings_list *
+postings_cache_get(postings_cache *cache, int token_id,
+                   int *max_positions_count)
+{
+  postings_cache_entry *e;
+
+  pthread_mutex_lock(&cache->mutex);
+  HASH_FIND_INT(cache->entries, &token_id, e);
+  if (e) {
+    /* 移动到LRU链表的末尾 */
+    DL_DELETE(cache->lru, e);
+    DL_APPEND(cache->lru, e);
+    e->refs++;
+    *max_positions_count = e->max_positions_count;
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+  return e ? e->postings : NULL;
+}
+
+/**
+ * 将解码后的倒排列表添加到缓存中
+ * 添加成功后，倒排列表由缓存负责释放，并且与调用函数postings_cache_get一样处于使用中的状态
+ * @param[in,out] cache 缓存
+ * @param[in] token_id 词元编号
+ * @param[in] postings 倒排列表
+ * @param[in] max_positions_count 各文档的出现次数的最大值
+ * @retval 0 成功
+ * @retval -1 倒排列表比缓存的容量还大，或者该词元已在缓存中
+ */
+int
+postings_cache_put(postings_cache *cache, int token_id,
+                   postings_list *postings, int max_positions_count)
+{
+  postings_cache_entry *e;
+  size_t size = postings_list_size(postings);
+
+  if (size > cache->capacity) { return -1; }
+  if (!(e = malloc(sizeof(postings_cache_entry)))) {
+    print_error("cannot allocate memory for a postings cache.");
+    return -1;
+  }
+  e->token_id = token_id;
+  e->postings = postings;
+  e->max_positions_count = max_positions_count;
+  e->size = size;
+  e->refs = 1;
+
+  pthread_mutex_lock(&cache->mutex);
+  {
+    postings_cache_entry *found;
+    HASH_FIND_INT(cache->entries, &token_id, found);
+    if (found) {
+      /* 其他线程已经添加了同一个词元 */
+      pthread_mutex_unlock(&cache->mutex);
+      free(e);
+      return -1;
+    }
+  }
+  HASH_ADD_INT(cache->entries, token_id, e);
+  DL_APPEND(cache->lru, e);
+  cache->size += size;
+  evict_postings_cache(cache);
+  pthread_mutex_unlock(&cache->mutex);
+  return 0;
+}
+
+/**
+ * 通知缓存已不再使用通过函数postings_cache_get或postings_cache_put取得的倒排列表
+ * @param[in,out] cache 缓存
+ * @param[in] token_id 词元编号
+ */
+void
+postings_cache_release(postings_cache *cache, int token_id)
+{
+  postings_cache_entry *e;
+
+  pthread_mutex_lock(&cache->mutex);
+  HASH_FIND_INT(cache->entries, &token_id, e);
+  if (e && !--e->refs) {
+    /* 使用中的项可能使缓存超出了容量 */
+    evict_postings_cache(cache);
+  }
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * 将缓存的统计信息输出到标准错误输出
+ * @param[in] cache 缓存
+ */
+void
+print_postings_cache_stats(const postings_cache *cache)
+{
+  unsigned long total = cache->hits + cache->misses;
+  print_error("postings cache: hits: %lu misses: %lu hit ratio: %.1f%% "
+              "entries: %u size: %zu / %zu bytes",
+              cache->hits, cache->misses,
+              total ? 100.0 * cache->hits / total : 0.0,
+              HASH_COUNT(cache->entries), cache->size, cache->capacity);
+}
+
+/**
+ * 释放缓存及其中的所有倒排列表
+ * @param[in] cache 缓存
+ */
+void
+free_postings_cache(postings_cache *cache)
+{
+  postings_cache_entry *e, *tmp;
+
+  HASH_ITER(hh, cache->entries, e, tmp) {
+    remove_postings_cache_entry(cache, e);
+  }
+  pthread_mutex_destroy(&cache->mutex);
+  free(cache);
+}
@@ -0,0 +1,39 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <pthread.h>
+
+#include "wiser.h"
+
+/* 缓存中的1个倒排列表 */
+typedef struct _postings_cache_entry {
+  int token_id;                /* 词元编号 */
+  postings_list *postings;     /* 解码后的倒排列表 */
+  int max_positions_count;     /* 各文档的出现次数的最大值 */
+  size_t size;                 /* 倒排列表所占的字节数 */
+  int refs;                    /* 正在使用该倒排列表的游标数 */
+  UT_hash_handle hh;           /* 用于将该结构体转化为哈希表 */
+  struct _postings_cache_entry *prev, *next; /* LRU链表 */
+} postings_cache_entry;
+
+/* 解码后的倒排列表的LRU缓存 */
+typedef struct _postings_cache {
+  postings_cache_entry *entries; /* 以词元编号为键的哈希表 */
+  postings_cache_entry *lru;     /* 按最近使用时间排列的链表。开头为最久未使用的项 */
+  size_t capacity;               /* 缓存可以使用的字节数 */
+  size_t size;                   /* 缓存已使用的字节数 */
+  unsigned long hits;            /* 命中次数 */
+  unsigned long misses;          /* 未命中次数 */
+  pthread_mutex_t mutex;         /* 保护缓存的互斥锁 */
+} postings_cache;
+
+postings_cache *alloc_postings_cache(size_t capacity);
+const postings_list *postings_cache_get(postings_cache *cache, int token_id,
+                                        int *max_positions_count);
+int postings_cache_put(postings_cache *cache, int token_id,
+                       postings_list *postings, int max_positions_count);
+void postings_cache_release(postings_cache *cache, int token_id);
+void print_postings_cache_stats(const postings_cache *cache);
+void free_postings_cache(postings_cache *cache);
+
+#endif /* __CACHE_H__ */
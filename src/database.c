@@ -1,21 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
 #include "util.h"
 #include "database.h"
 
+/*
+ * 可以通过选项设置的sqlite3的PRAGMA。按此顺序执行
+ * page_size只有在建表之前、且尚未切换到WAL模式时才有效，所以放在最前面
+ */
+static const char *const db_pragma_names[] = {
+  "page_size", "journal_mode", "synchronous", "cache_size", "mmap_size", NULL
+};
+
+/**
+ * 在用逗号分隔的“名称=值”的列表中查找指定的PRAGMA的值
+ * 同一名称出现多次时，以最后一次为准
+ * @param[in] pragmas PRAGMA的列表
+ * @param[in] name PRAGMA的名称
+ * @param[out] value 值的起始位置
+ * @return 值的字节数。没有找到时为-1
+ */
+static int
+find_pragma(const char *pragmas, const char *name, const char **value)
+{
+  int value_size = -1;
+  size_t name_size = strlen(name);
+  const char *p = pragmas;
+
+  while (*p) {
+    const char *end = strchr(p, ',');
+    if (!end) { end = p + strlen(p); }
+    if ((size_t)(end - p) > name_size && p[name_size] == '=' &&
+        !memcmp(p, name, name_size)) {
+      *value = p + name_size + 1;
+      value_size = end - *value;
+    }
+    p = *end ? end + 1 : end;
+  }
+  return value_size;
+}
+
+/**
+ * 检查用逗号分隔的“名称=值”的列表中是否只含有可以设置的PRAGMA
+ * @param[in] pragmas PRAGMA的列表
+ * @retval 0 合法
+ * @retval -1 含有未知的名称或不合法的值
+ */
+static int
+check_pragmas(const char *pragmas)
+{
+  const char *p = pragmas;
+
+  while (*p) {
+    int i;
+    const char *eq, *end = strchr(p, ',');
+    if (!end) { end = p + strlen(p); }
+    if (!(eq = memchr(p, '=', end - p))) {
+      print_error("invalid pragma(%.*s).", (int)(end - p), p);
+      return -1;
+    }
+    for (i = 0; db_pragma_names[i]; i++) {
+      if (strlen(db_pragma_names[i]) == (size_t)(eq - p) &&
+          !memcmp(db_pragma_names[i], p, eq - p)) {
+        break;
+      }
+    }
+    if (!db_pragma_names[i]) {
+      print_error("unknown pragma(%.*s).", (int)(eq - p), p);
+      return -1;
+    }
+    /* 值只允许是关键字或整数，以免拼接出其他SQL语句 */
+    if (eq + 1 == end) {
+      print_error("empty value for pragma(%.*s).", (int)(eq - p), p);
+      return -1;
+    }
+    for (eq++; eq < end; eq++) {
+      if (!isalnum((unsigned char)*eq) && *eq != '-') {
+        print_error("invalid value for pragma(%.*s).", (int)(end - p), p);
+        return -1;
+      }
+    }
+    p = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+/**
+ * 设置sqlite3的PRAGMA
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] pragmas 用逗号分隔的“名称=值”的列表（如"journal_mode=wal,synchronous=normal"）
+ *                    可以设置的名称参见db_pragma_names
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+db_set_pragmas(const wiser_env *env, const char *pragmas)
+{
+  int i;
+
+  if (check_pragmas(pragmas)) { return -1; }
+  for (i = 0; db_pragma_names[i]; i++) {
+    int value_size;
+    const char *value;
+    char sql[64];
+
+    if ((value_size = find_pragma(pragmas, db_pragma_names[i], &value)) < 0) {
+      continue;
+    }
+    snprintf(sql, sizeof(sql), "PRAGMA %s = %.*s;",
+             db_pragma_names[i], value_size, value);
+    if (sqlite3_exec(env->db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+      print_error("cannot set pragma(%s): %s", sql, sqlite3_errmsg(env->db));
+      return -1;
+    }
+  }
+  return 0;
+}
+
 /**
  * 初始化数据库
  * @param[in] env 存储着应用程序运行环境的结构体
  * @param[in] db_path 待初始化的数据库文件的名字
+ * @param[in] pragmas 建表之前设置的sqlite3的PRAGMA的列表（参见db_set_pragmas）。为NULL时不设置
  * @return sqlite3的错误代码
  * @retval 0 成功
  */
 int
-init_database(wiser_env *env, const char *db_path)
+init_database(wiser_env *env, const char *db_path, const char *pragmas)
 {
   int rc;
   if ((rc = sqlite3_open(db_path, &env->db))) {
     print_error("cannot open databases.");
     return rc;
   }
+  if (pragmas && db_set_pragmas(env, pragmas)) {
+    sqlite3_close(env->db);
+    return SQLITE_ERROR;
+  }
 
   sqlite3_exec(env->db,
                "CREATE TABLE settings (" \
@@ -41,6 +163,15 @@ init_database(wiser_env *env, const char *db_path)
                ");",
                NULL, NULL, NULL);
 
+  sqlite3_exec(env->db,
+               "CREATE TABLE segments (" \
+               "  id              INTEGER PRIMARY KEY," \
+               "  min_document_id INT NOT NULL," \
+               "  max_document_id INT NOT NULL," \
+               "  size            INT NOT NULL" \
+               ");",
+               NULL, NULL, NULL);
+
   sqlite3_exec(env->db,
                "CREATE UNIQUE INDEX token_index ON tokens(token);",
                NULL, NULL, NULL);
@@ -71,6 +202,10 @@ init_database(wiser_env *env, const char *db_path)
                   "INSERT OR IGNORE INTO tokens (token, docs_count, postings)"
                   " VALUES (?, 0, ?);",
                   -1, &env->store_token_st, NULL);
+  sqlite3_prepare(env->db,
+                  "INSERT INTO tokens (id, token, docs_count, postings)"
+                  " VALUES (?, ?, 0, ?);",
+                  -1, &env->insert_token_st, NULL);
   sqlite3_prepare(env->db,
                   "SELECT docs_count, postings FROM tokens WHERE id = ?;",
                   -1, &env->get_postings_st, NULL);
@@ -86,6 +221,13 @@ init_database(wiser_env *env, const char *db_path)
   sqlite3_prepare(env->db,
                   "SELECT COUNT(*) FROM documents;",
                   -1, &env->get_document_count_st, NULL);
+  sqlite3_prepare(env->db,
+                  "INSERT INTO segments (id, min_document_id, max_document_id,"
+                  " size) VALUES (?, ?, ?, ?);",
+                  -1, &env->insert_segment_st, NULL);
+  sqlite3_prepare(env->db,
+                  "DELETE FROM segments WHERE id = ?;",
+                  -1, &env->delete_segment_st, NULL);
   sqlite3_prepare(env->db,
                   "BEGIN;",
                   -1, &env->begin_st, NULL);
@@ -112,17 +254,35 @@ fin_database(wiser_env *env)
   sqlite3_finalize(env->get_token_id_st);
   sqlite3_finalize(env->get_token_st);
   sqlite3_finalize(env->store_token_st);
+  sqlite3_finalize(env->insert_token_st);
   sqlite3_finalize(env->get_postings_st);
   sqlite3_finalize(env->update_postings_st);
   sqlite3_finalize(env->get_settings_st);
   sqlite3_finalize(env->replace_settings_st);
   sqlite3_finalize(env->get_document_count_st);
+  sqlite3_finalize(env->insert_segment_st);
+  sqlite3_finalize(env->delete_segment_st);
   sqlite3_finalize(env->begin_st);
   sqlite3_finalize(env->commit_st);
   sqlite3_finalize(env->rollback_st);
   sqlite3_close(env->db);
 }
 
+/**
+ * 重置所有的准备语句
+ * 执行过的SELECT语句在被重置之前会一直持有数据库的共享锁，
+ * 所以长时间运行的进程在处理完每个请求后都要调用该函数，以免阻塞其他进程的写入
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+db_reset_statements(const wiser_env *env)
+{
+  sqlite3_stmt *st = NULL;
+  while ((st = sqlite3_next_stmt(env->db, st))) {
+    sqlite3_reset(st);
+  }
+}
+
 /**
  * 根据指定的文档标题获取文档编号
  * @param[in] env 存储着应用程序运行环境的结构体
@@ -183,16 +343,20 @@ db_get_document_title(const wiser_env *env, int document_id,
  * @param[in] title_size 文档标题的字节数
  * @param[in] body 文档正文
  * @param[in] body_size 文档正文的字节数
+ * @param[out] inserted 是否新增了文档。为FALSE时表示更新了同一标题的文档。为NULL时不输出
  */
 int
 db_add_document(const wiser_env *env,
                 const char *title, unsigned int title_size,
-                const char *body, unsigned int body_size)
+                const char *body, unsigned int body_size,
+                int *inserted)
 {
   sqlite3_stmt *st;
   int rc, document_id;
 
-  if ((document_id = db_get_document_id(env, title, title_size))) {
+  document_id = db_get_document_id(env, title, title_size);
+  if (inserted) { *inserted = !document_id; }
+  if (document_id) {
     st = env->update_document_st;
     sqlite3_reset(st);
     sqlite3_bind_text(st, 1, body, body_size, SQLITE_STATIC);
@@ -256,6 +420,66 @@ db_get_token_id(const wiser_env *env,
   }
 }
 
+/**
+ * 将分配好编号的词元添加到tokens表中
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] token_id 词元编号
+ * @param[in] token 词元（UTF-8）
+ * @param[in] token_size 词元的字节数
+ */
+int
+db_store_token(const wiser_env *env, int token_id,
+               const char *token, int token_size)
+{
+  int rc;
+  sqlite3_reset(env->insert_token_st);
+  sqlite3_bind_int(env->insert_token_st, 1, token_id);
+  sqlite3_bind_text(env->insert_token_st, 2, token, token_size,
+                    SQLITE_STATIC);
+  sqlite3_bind_blob(env->insert_token_st, 3, "", 0, SQLITE_STATIC);
+query:
+  rc = sqlite3_step(env->insert_token_st);
+
+  switch (rc) {
+  case SQLITE_BUSY:
+    goto query;
+  case SQLITE_ERROR:
+    print_error("ERROR: %s", sqlite3_errmsg(env->db));
+    break;
+  case SQLITE_MISUSE:
+    print_error("MISUSE: %s", sqlite3_errmsg(env->db));
+    break;
+  }
+  return rc;
+}
+
+/**
+ * 将tokens表中的所有词元及其编号逐一传递给指定的函数
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] func 接收arg，词元编号，词元，词元的字节数4个参数的回调函数
+ * @param[in] arg 传递给回调函数的参数
+ * @retval 0 成功
+ */
+int
+db_scan_tokens(const wiser_env *env, db_token_callback func, void *arg)
+{
+  int rc;
+  sqlite3_stmt *st;
+
+  if ((rc = sqlite3_prepare(env->db, "SELECT id, token FROM tokens;",
+                            -1, &st, NULL))) {
+    print_error("ERROR: %s", sqlite3_errmsg(env->db));
+    return rc;
+  }
+  while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+    func(arg, sqlite3_column_int(st, 0),
+         (const char *)sqlite3_column_text(st, 1),
+         sqlite3_column_bytes(st, 1));
+  }
+  sqlite3_finalize(st);
+  return rc == SQLITE_DONE ? 0 : rc;
+}
+
 /**
  * 根据词元编号从tokens表获取词元
  * @param[in] env 存储着应用程序运行环境的结构体
@@ -435,6 +659,147 @@ db_get_document_count(const wiser_env *env)
   }
 }
 
+/**
+ * 从settings表中读取语料库的统计信息
+ * 没有保存统计信息的旧数据库只统计1次documents表中的文档数，词元总数视为0
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[out] stats 语料库的统计信息
+ */
+void
+db_get_corpus_stats(const wiser_env *env, corpus_stats *stats)
+{
+  const char *dc = NULL, *tc = NULL;
+
+  db_get_settings(env,
+                  "documents_count", sizeof("documents_count") - 1,
+                  &dc, NULL);
+  stats->documents_count = dc ? atoi(dc) : db_get_document_count(env);
+  if (stats->documents_count < 0) { stats->documents_count = 0; }
+  db_get_settings(env,
+                  "tokens_count", sizeof("tokens_count") - 1,
+                  &tc, NULL);
+  stats->tokens_count = tc ? atoll(tc) : 0;
+}
+
+/**
+ * 将语料库的统计信息保存到settings表中
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] stats 语料库的统计信息
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+db_replace_corpus_stats(const wiser_env *env, const corpus_stats *stats)
+{
+  char dc[16], tc[32];
+  int dc_size, tc_size;
+
+  dc_size = snprintf(dc, sizeof(dc), "%d", stats->documents_count);
+  tc_size = snprintf(tc, sizeof(tc), "%lld", stats->tokens_count);
+  if (db_replace_settings(env,
+                          "documents_count", sizeof("documents_count") - 1,
+                          dc, dc_size) != SQLITE_DONE ||
+      db_replace_settings(env,
+                          "tokens_count", sizeof("tokens_count") - 1,
+                          tc, tc_size) != SQLITE_DONE) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * 将新写入的段记录到segments表中
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] id 段的编号
+ * @param[in] min_document_id 段中最小的文档编号
+ * @param[in] max_document_id 段中最大的文档编号
+ * @param[in] size 段文件的字节数
+ * @retval 0 成功
+ */
+int
+db_add_segment(const wiser_env *env, int id, int min_document_id,
+               int max_document_id, long long size)
+{
+  int rc;
+  sqlite3_reset(env->insert_segment_st);
+  sqlite3_bind_int(env->insert_segment_st, 1, id);
+  sqlite3_bind_int(env->insert_segment_st, 2, min_document_id);
+  sqlite3_bind_int(env->insert_segment_st, 3, max_document_id);
+  sqlite3_bind_int64(env->insert_segment_st, 4, size);
+query:
+  rc = sqlite3_step(env->insert_segment_st);
+
+  switch (rc) {
+  case SQLITE_BUSY:
+    goto query;
+  case SQLITE_ERROR:
+    print_error("ERROR: %s", sqlite3_errmsg(env->db));
+    break;
+  case SQLITE_MISUSE:
+    print_error("MISUSE: %s", sqlite3_errmsg(env->db));
+    break;
+  }
+  return rc == SQLITE_DONE ? 0 : rc;
+}
+
+/**
+ * 从segments表中删除已被合并的段
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] id 段的编号
+ * @retval 0 成功
+ */
+int
+db_delete_segment(const wiser_env *env, int id)
+{
+  int rc;
+  sqlite3_reset(env->delete_segment_st);
+  sqlite3_bind_int(env->delete_segment_st, 1, id);
+query:
+  rc = sqlite3_step(env->delete_segment_st);
+
+  switch (rc) {
+  case SQLITE_BUSY:
+    goto query;
+  case SQLITE_ERROR:
+    print_error("ERROR: %s", sqlite3_errmsg(env->db));
+    break;
+  case SQLITE_MISUSE:
+    print_error("MISUSE: %s", sqlite3_errmsg(env->db));
+    break;
+  }
+  return rc == SQLITE_DONE ? 0 : rc;
+}
+
+/**
+ * 按文档编号的升序遍历segments表中记录的所有段
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] func 对每个段调用的函数。返回非0值时停止遍历
+ * @param[in] arg 传给func的参数
+ * @retval 0 成功
+ */
+int
+db_scan_segments(const wiser_env *env, db_segment_callback func, void *arg)
+{
+  int rc;
+  sqlite3_stmt *st;
+
+  if ((rc = sqlite3_prepare(env->db,
+                            "SELECT id, min_document_id, max_document_id"
+                            " FROM segments ORDER BY min_document_id;",
+                            -1, &st, NULL))) {
+    print_error("ERROR: %s", sqlite3_errmsg(env->db));
+    return rc;
+  }
+  while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+    if ((rc = func(arg, sqlite3_column_int(st, 0),
+                   sqlite3_column_int(st, 1), sqlite3_column_int(st, 2)))) {
+      break;
+    }
+  }
+  sqlite3_finalize(st);
+  return rc == SQLITE_DONE ? 0 : rc;
+}
+
 /**
  * 开启事务
  * @param[in] env 存储着应用程序运行环境的结构体
@@ -5,18 +5,30 @@
 
 #include "wiser.h"
 
-int init_database(wiser_env *env, const char *db_path);
+typedef void (*db_token_callback)(void *arg, int token_id,
+                                  const char *token, int token_size);
+typedef int (*db_segment_callback)(void *arg, int id, int min_document_id,
+                                   int max_document_id);
+
+int init_database(wiser_env *env, const char *db_path,
+                  const char *pragmas);
 void fin_database(wiser_env *env);
+void db_reset_statements(const wiser_env *env);
 int db_get_document_id(const wiser_env *env,
                        const char *title, unsigned int title_size);
 int db_get_document_title(const wiser_env *env, int document_id,
                           const char **const title, int *title_size);
 int db_add_document(const wiser_env *env,
                     const char *title, unsigned int title_size,
-                    const char *body, unsigned int body_size);
+                    const char *body, unsigned int body_size,
+                    int *inserted);
 int db_get_token_id(const wiser_env *env,
                     const char *str, unsigned int str_size, int insert,
                     int *docs_count);
+int db_store_token(const wiser_env *env, int token_id,
+                   const char *token, int token_size);
+int db_scan_tokens(const wiser_env *env, db_token_callback func,
+                   void *arg);
 int db_get_token(const wiser_env *env,
                  const int token_id,
                  const char **const token, int *token_size);
@@ -32,6 +44,14 @@ int db_replace_settings(const wiser_env *env, const char *key,
                         int key_size,
                         const char *value, int value_size);
 int db_get_document_count(const wiser_env *env);
+void db_get_corpus_stats(const wiser_env *env, corpus_stats *stats);
+int db_replace_corpus_stats(const wiser_env *env,
+                            const corpus_stats *stats);
+int db_add_segment(const wiser_env *env, int id, int min_document_id,
+                   int max_document_id, long long size);
+int db_delete_segment(const wiser_env *env, int id);
+int db_scan_segments(const wiser_env *env, db_segment_callback func,
+                     void *arg);
 int begin(const wiser_env *env);
 int commit(const wiser_env *env);
 int rollback(const wiser_env *env);
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "token.h"
+#include "indexer.h"
+#include "segment.h"
+#include "postings.h"
+
+/* 每个分词线程在队列中最多可以积压的文档数 */
+#define INDEX_QUEUE_SIZE_PER_THREAD 4
+
+/* 等待分词的文档 */
+typedef struct {
+  int document_id;        /* 文档编号 */
+  char *body;             /* 文档正文（UTF-8）。由分词线程释放 */
+  unsigned int body_size; /* 文档正文的字节数 */
+} index_job;
+
+/* 分词线程 */
+typedef struct {
+  pthread_t thread;                 /* 线程 */
+  struct _index_pipeline *pipeline; /* 该线程所属的流水线 */
+  inverted_index_hash *ii_buffer;   /* 该线程私有的小倒排索引 */
+  arena *arena;                     /* 分配该线程的小倒排索引的内存池 */
+} index_worker;
+
+/* 多线程构建索引用的流水线（解析线程 -> 有界队列 -> 分词线程 -> 合并与写入） */
+typedef struct _index_pipeline {
+  wiser_env *env;           /* 存储着应用程序运行环境的结构体 */
+  index_job *jobs;          /* 有界队列（环形缓冲区） */
+  int jobs_capacity;        /* 队列的容量 */
+  int jobs_head;            /* 队列中第一个文档的下标 */
+  int jobs_count;           /* 队列中的文档数 */
+  int running_count;        /* 正在被分词线程处理的文档数 */
+  int stopping;             /* 是否要结束分词线程 */
+  size_t ii_buffer_size;    /* 各分词线程的内存池中分配出去的字节数之和 */
+  pthread_mutex_t mutex;    /* 保护队列的互斥锁 */
+  pthread_cond_t not_empty; /* 队列变为非空时发出通知 */
+  pthread_cond_t not_full;  /* 队列变为非满时发出通知 */
+  pthread_cond_t idle;      /* 所有文档都处理完毕时发出通知 */
+  pthread_mutex_t db_mutex; /* 保护sqlite3实例的互斥锁 */
+  index_worker *workers;    /* 分词线程的数组 */
+  int n_workers;            /* 分词线程的数量 */
+} index_pipeline;
+
+/**
+ * 分词线程的主函数。不断从队列中取出文档，将其添加到私有的小倒排索引中
+ * @param[in] arg 分词线程
+ * @return NULL
+ */
+static void *
+index_worker_main(void *arg)
+{
+  index_worker *w = (index_worker *)arg;
+  index_pipeline *pl = w->pipeline;
+  wiser_env *env = pl->env;
+
+  while (1) {
+    index_job job;
+    UTF32Char *body32;
+    int body32_len;
+    size_t ii_buffer_size;
+
+    pthread_mutex_lock(&pl->mutex);
+    while (!pl->jobs_count && !pl->stopping) {
+      pthread_cond_wait(&pl->not_empty, &pl->mutex);
+    }
+    if (!pl->jobs_count) {
+      /* 队列已空且收到了结束通知 */
+      pthread_mutex_unlock(&pl->mutex);
+      break;
+    }
+    job = pl->jobs[pl->jobs_head];
+    pl->jobs_head = (pl->jobs_head + 1) % pl->jobs_capacity;
+    pl->jobs_count--;
+    pl->running_count++;
+    pthread_cond_signal(&pl->not_full);
+    pthread_mutex_unlock(&pl->mutex);
+
+    /* 正在处理文档时内存池不会被重置，所以可以在这里记录处理前的字节数 */
+    ii_buffer_size = arena_size(w->arena);
+    /* 转换文档正文的字符编码，并为文档创建倒排列表 */
+    if (!utf8toutf32(job.body, job.body_size, &body32, &body32_len)) {
+      text_to_postings_lists(env, job.document_id, body32, body32_len,
+                             env->token_len, &w->ii_buffer, w->arena);
+      free(body32);
+    }
+    free(job.body);
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->ii_buffer_size += arena_size(w->arena) - ii_buffer_size;
+    if (!--pl->running_count && !pl->jobs_count) {
+      pthread_cond_broadcast(&pl->idle);
+    }
+    pthread_mutex_unlock(&pl->mutex);
+  }
+  return NULL;
+}
+
+/**
+ * 启动多线程构建索引用的流水线
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] n_threads 分词线程的数量
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+start_indexer(wiser_env *env, int n_threads)
+{
+  int i;
+  index_pipeline *pl;
+
+  if (!(pl = calloc(1, sizeof(index_pipeline)))) {
+    print_error("cannot allocate memory for an index pipeline.");
+    return -1;
+  }
+  pl->env = env;
+  pl->jobs_capacity = n_threads * INDEX_QUEUE_SIZE_PER_THREAD;
+  if (!(pl->jobs = malloc(sizeof(index_job) * pl->jobs_capacity)) ||
+      !(pl->workers = calloc(n_threads, sizeof(index_worker)))) {
+    print_error("cannot allocate memory for an index pipeline.");
+    free(pl->jobs);
+    free(pl);
+    return -1;
+  }
+  pthread_mutex_init(&pl->mutex, NULL);
+  pthread_mutex_init(&pl->db_mutex, NULL);
+  pthread_cond_init(&pl->not_empty, NULL);
+  pthread_cond_init(&pl->not_full, NULL);
+  pthread_cond_init(&pl->idle, NULL);
+  env->pipeline = pl;
+
+  for (i = 0; i < n_threads; i++) {
+    index_worker *w = &pl->workers[i];
+    w->pipeline = pl;
+    if (!(w->arena = alloc_arena(II_BUFFER_ARENA_BLOCK_SIZE))) {
+      stop_indexer(env);
+      return -1;
+    }
+    if (pthread_create(&w->thread, NULL, index_worker_main, w)) {
+      print_error("cannot create an indexing thread.");
+      free_arena(w->arena);
+      stop_indexer(env);
+      return -1;
+    }
+    pl->n_workers++;
+  }
+  return 0;
+}
+
+/**
+ * 将文档放入流水线的队列中。队列已满时等待分词线程取出文档
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] document_id 文档编号
+ * @param[in] body 文档正文
+ * @param[in] body_size 文档正文的字节数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+indexer_add_document(wiser_env *env, int document_id,
+                     const char *body, unsigned int body_size)
+{
+  index_job *job;
+  index_pipeline *pl = env->pipeline;
+  char *body_copy;
+
+  /* 解析器会复用正文的缓冲区，所以要复制一份交给分词线程 */
+  if (!(body_copy = malloc(body_size))) {
+    print_error("cannot allocate memory for a document body.");
+    return -1;
+  }
+  memcpy(body_copy, body, body_size);
+
+  pthread_mutex_lock(&pl->mutex);
+  while (pl->jobs_count == pl->jobs_capacity) {
+    pthread_cond_wait(&pl->not_full, &pl->mutex);
+  }
+  job = &pl->jobs[(pl->jobs_head + pl->jobs_count) % pl->jobs_capacity];
+  job->document_id = document_id;
+  job->body = body_copy;
+  job->body_size = body_size;
+  pl->jobs_count++;
+  pthread_cond_signal(&pl->not_empty);
+  pthread_mutex_unlock(&pl->mutex);
+  return 0;
+}
+
+/**
+ * 等待分词线程处理完队列中的所有文档，
+ * 然后将各个分词线程的小倒排索引合并到env->ii_buffer中
+ * 合并后的索引项和倒排列表仍在各分词线程的内存池中，在调用reset_indexer_arenas之前不会被释放
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+drain_indexer(wiser_env *env)
+{
+  int i;
+  index_pipeline *pl = env->pipeline;
+
+  pthread_mutex_lock(&pl->mutex);
+  while (pl->jobs_count || pl->running_count) {
+    pthread_cond_wait(&pl->idle, &pl->mutex);
+  }
+  pthread_mutex_unlock(&pl->mutex);
+
+  /* 各个分词线程处理的文档互不重复，所以可以直接合并倒排列表 */
+  for (i = 0; i < pl->n_workers; i++) {
+    index_worker *w = &pl->workers[i];
+    if (!w->ii_buffer) { continue; }
+    if (env->ii_buffer) {
+      merge_inverted_index(env->ii_buffer, w->ii_buffer);
+    } else {
+      env->ii_buffer = w->ii_buffer;
+    }
+    w->ii_buffer = NULL;
+  }
+  /* 合并时可能从内存池中分配了新的倒排列表 */
+  pl->ii_buffer_size = 0;
+  for (i = 0; i < pl->n_workers; i++) {
+    pl->ii_buffer_size += arena_size(pl->workers[i].arena);
+  }
+}
+
+/**
+ * 用于将倒排索引按词元编号的升序排列的比较函数
+ * @param[in] a 倒排索引中的项a
+ * @param[in] b 倒排索引中的项b
+ * @return 比较结果
+ */
+static int
+inverted_index_token_id_sort(inverted_index_value *a, inverted_index_value *b)
+{
+  return a->token_id < b->token_id ? -1 : a->token_id > b->token_id;
+}
+
+/**
+ * 将缓冲区中的倒排索引写入存储器，并清空缓冲区
+ * 使用流水线时，先收集各分词线程的小倒排索引
+ * 失败时设置env->index_failed，此后的调用也都会失败，应回滚事务
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+flush_ii_buffer(wiser_env *env)
+{
+  inverted_index_hash *p;
+  size_t size;
+
+  if (env->index_failed) { return -1; }
+
+  /* 多线程构建索引时，先等待分词线程处理完队列中的文档，再收集它们的小倒排索引 */
+  if (env->pipeline) { drain_indexer(env); }
+  if (!env->ii_buffer) { return 0; }
+
+  size = arena_size(env->ii_buffer_arena) + indexer_buffer_size(env);
+  print_time_diff();
+
+  /* 为按词元编码构建的词元分配编号，并将新出现的词元写入tokens表 */
+  if (resolve_token_codes(env, env->ii_buffer)) {
+    print_error("cannot assign token ids. indexing aborted.");
+    env->index_failed = TRUE;
+  }
+  flush_token_dictionary(env);
+  env->stats.tokens_count += inverted_index_positions_count(env->ii_buffer);
+
+  if (env->index_failed) {
+    /* 部分词元没有编号时不能写出缓冲区。事务将被回滚，直接丢弃缓冲区 */
+  } else if (env->format == index_format_segment) {
+    /* 将缓冲区原样写成新的段，不需要读出已有的倒排列表 */
+    if (flush_segment(env, env->ii_buffer)) {
+      print_error("cannot write a segment. indexing aborted.");
+      env->index_failed = TRUE;
+    }
+  } else {
+    /* 按词元编号的顺序更新所有词元对应的倒排项，使对tokens表的访问集中在相邻的页上 */
+    HASH_SORT(env->ii_buffer, inverted_index_token_id_sort);
+    for (p = env->ii_buffer; p != NULL; p = p->hh.next) {
+      update_postings(env, p);  //合并倒排索引,并将合并后的结果写入数据库(存储器)中
+    }
+  }
+  /* 索引项和倒排列表都在内存池中，重置内存池即可一次性释放 */
+  free_inverted_index(env->ii_buffer);
+  reset_arena(env->ii_buffer_arena);
+  if (env->pipeline) { reset_indexer_arenas(env); }
+  if (!env->index_failed) {
+    print_error("index flushed. (%d documents, %zu bytes)",
+                env->ii_buffer_count, size);
+  }
+  env->ii_buffer = NULL;
+  env->ii_buffer_count = 0;
+  env->ii_buffer_min_document_id = 0;
+
+  print_time_diff();
+  return env->index_failed ? -1 : 0;
+}
+
+/**
+ * 重置各分词线程的内存池。须在释放由drain_indexer收集的倒排索引之后调用
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+reset_indexer_arenas(wiser_env *env)
+{
+  int i;
+  index_pipeline *pl = env->pipeline;
+
+  for (i = 0; i < pl->n_workers; i++) {
+    reset_arena(pl->workers[i].arena);
+  }
+  pl->ii_buffer_size = 0;
+}
+
+/**
+ * 获取各分词线程的小倒排索引所占的字节数之和
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @return 字节数。没有使用流水线时为0
+ */
+size_t
+indexer_buffer_size(const wiser_env *env)
+{
+  size_t size;
+  index_pipeline *pl = env->pipeline;
+
+  if (!pl) { return 0; }
+  pthread_mutex_lock(&pl->mutex);
+  size = pl->ii_buffer_size;
+  pthread_mutex_unlock(&pl->mutex);
+  return size;
+}
+
+/**
+ * 结束所有分词线程并释放流水线
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+stop_indexer(wiser_env *env)
+{
+  int i;
+  index_pipeline *pl = env->pipeline;
+
+  if (!pl) { return; }
+  pthread_mutex_lock(&pl->mutex);
+  pl->stopping = TRUE;
+  pthread_cond_broadcast(&pl->not_empty);
+  pthread_mutex_unlock(&pl->mutex);
+
+  for (i = 0; i < pl->n_workers; i++) {
+    pthread_join(pl->workers[i].thread, NULL);
+    if (pl->workers[i].ii_buffer) {
+      free_inverted_index(pl->workers[i].ii_buffer);
+    }
+  }
+  for (i = 0; i < pl->n_workers; i++) {
+    free_arena(pl->workers[i].arena);
+  }
+  pthread_mutex_destroy(&pl->mutex);
+  pthread_mutex_destroy(&pl->db_mutex);
+  pthread_cond_destroy(&pl->not_empty);
+  pthread_cond_destroy(&pl->not_full);
+  pthread_cond_destroy(&pl->idle);
+  free(pl->workers);
+  free(pl->jobs);
+  free(pl);
+  env->pipeline = NULL;
+}
+
+/**
+ * 在多线程构建索引时，获取保护sqlite3实例的互斥锁
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+lock_indexer_db(const wiser_env *env)
+{
+  if (env->pipeline) { pthread_mutex_lock(&env->pipeline->db_mutex); }
+}
+
+/**
+ * 在多线程构建索引时，释放保护sqlite3实例的互斥锁
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+unlock_indexer_db(const wiser_env *env)
+{
+  if (env->pipeline) { pthread_mutex_unlock(&env->pipeline->db_mutex); }
+}
@@ -0,0 +1,17 @@
+#ifndef __INDEXER_H__
+#define __INDEXER_H__
+
+#include "wiser.h"
+
+int start_indexer(wiser_env *env, int n_threads);
+int indexer_add_document(wiser_env *env, int document_id,
+                         const char *body, unsigned int body_size);
+void drain_indexer(wiser_env *env);
+void reset_indexer_arenas(wiser_env *env);
+int flush_ii_buffer(wiser_env *env);
+size_t indexer_buffer_size(const wiser_env *env);
+void stop_indexer(wiser_env *env);
+void lock_indexer_db(const wiser_env *env);
+void unlock_indexer_db(const wiser_env *env);
+
+#endif /* __INDEXER_H__ */
@@ -1,7 +1,199 @@
 #include <stdio.h>
 
 #include "util.h"
+#include "cache.h"
+#include "postings.h"
 #include "database.h"
+#include "streamvbyte.h"
+#include "segment.h"
+
+/**
+ * 分配一个空的倒排列表
+ * @param[in] capacity 预先分配的可容纳的文档数
+ * @param[in] positions_capacity 预先分配的可容纳的位置信息数
+ * @return 分配好的倒排列表。失败时为NULL
+ */
+postings_list *
+alloc_postings_list(int capacity, int positions_capacity)
+{
+  return arena_alloc_postings_list(NULL, capacity, positions_capacity);
+}
+
+/**
+ * 从内存池中分配一个空的倒排列表
+ * 该倒排列表及其扩容时用到的内存都从内存池中分配，在重置内存池时一次性释放
+ * @param[in,out] a 内存池。为NULL时用malloc分配
+ * @param[in] capacity 预先分配的可容纳的文档数
+ * @param[in] positions_capacity 预先分配的可容纳的位置信息数
+ * @return 分配好的倒排列表。失败时为NULL
+ */
+postings_list *
+arena_alloc_postings_list(arena *a, int capacity, int positions_capacity)
+{
+  postings_list *pl;
+
+  if (capacity < 1) { capacity = 1; }
+  if (positions_capacity < 1) { positions_capacity = 1; }
+  if ((pl = arena_alloc(a, sizeof(postings_list)))) {
+    pl->arena = a;
+    pl->document_ids = arena_alloc(a, sizeof(int) * capacity);
+    pl->positions_offsets = arena_alloc(a, sizeof(int) * (capacity + 1));
+    pl->positions = arena_alloc(a, sizeof(int) * positions_capacity);
+    if (pl->document_ids && pl->positions_offsets && pl->positions) {
+      pl->len = 0;
+      pl->positions_len = 0;
+      pl->capacity = capacity;
+      pl->positions_capacity = positions_capacity;
+      pl->positions_offsets[0] = 0;
+      return pl;
+    }
+    free_postings_list(pl);
+  }
+  print_error("cannot allocate memory for a postings list.");
+  return NULL;
+}
+
+/**
+ * 计算倒排列表所占的字节数
+ * @param[in] pl 倒排列表
+ * @return 字节数
+ */
+size_t
+postings_list_size(const postings_list *pl)
+{
+  return sizeof(postings_list) +
+         sizeof(int) * ((size_t)pl->capacity * 2 + 1) +
+         sizeof(int) * (size_t)pl->positions_capacity;
+}
+
+/**
+ * 确保倒排列表中能容纳指定数量的文档和位置信息
+ * @param[in,out] pl 倒排列表
+ * @param[in] len 需要容纳的文档数
+ * @param[in] positions_len 需要容纳的位置信息数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+reserve_postings_list(postings_list *pl, int len, int positions_len)
+{
+  if (len > pl->capacity) {
+    int *document_ids, *positions_offsets, capacity = pl->capacity * 2;
+    if (capacity < len) { capacity = len; }
+    if (!(document_ids = arena_realloc(pl->arena, pl->document_ids,
+                                       sizeof(int) * pl->capacity,
+                                       sizeof(int) * capacity))) {
+      goto fail;
+    }
+    pl->document_ids = document_ids;
+    if (!(positions_offsets = arena_realloc(pl->arena,
+                                            pl->positions_offsets,
+                                            sizeof(int) * (pl->capacity + 1),
+                                            sizeof(int) * (capacity + 1)))) {
+      goto fail;
+    }
+    pl->positions_offsets = positions_offsets;
+    pl->capacity = capacity;
+  }
+  if (positions_len > pl->positions_capacity) {
+    int *positions, capacity = pl->positions_capacity * 2;
+    if (capacity < positions_len) { capacity = positions_len; }
+    if (!(positions = arena_realloc(pl->arena, pl->positions,
+                                    sizeof(int) * pl->positions_capacity,
+                                    sizeof(int) * capacity))) {
+      goto fail;
+    }
+    pl->positions = positions;
+    pl->positions_capacity = capacity;
+  }
+  return 0;
+fail:
+  print_error("cannot allocate memory for a postings list.");
+  return -1;
+}
+
+/**
+ * 在倒排列表的末尾添加1个文档及其位置信息
+ * @param[in,out] pl 倒排列表
+ * @param[in] document_id 文档编号。必须大于倒排列表中已有的文档编号
+ * @param[in] positions 位置信息的数组
+ * @param[in] positions_count 位置信息的条数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+append_postings_document(postings_list *pl, int document_id,
+                         const int *positions, int positions_count)
+{
+  if (reserve_postings_list(pl, pl->len + 1,
+                            pl->positions_len + positions_count)) {
+    return -1;
+  }
+  pl->document_ids[pl->len] = document_id;
+  memcpy(pl->positions + pl->positions_len, positions,
+         sizeof(int) * positions_count);
+  pl->positions_len += positions_count;
+  pl->positions_offsets[++pl->len] = pl->positions_len;
+  return 0;
+}
+
+/**
+ * 将词元的1个出现位置添加到倒排列表中
+ * 若倒排列表中的最后一个文档不是指定的文档，则先在末尾添加该文档
+ * @param[in,out] pl 倒排列表
+ * @param[in] document_id 文档编号
+ * @param[in] position 词元出现的位置
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+add_postings_position(postings_list *pl, int document_id, int position)
+{
+  if (!pl->len || pl->document_ids[pl->len - 1] != document_id) {
+    return append_postings_document(pl, document_id, &position, 1);
+  }
+  if (reserve_postings_list(pl, pl->len, pl->positions_len + 1)) {
+    return -1;
+  }
+  pl->positions[pl->positions_len++] = position;
+  pl->positions_offsets[pl->len] = pl->positions_len;
+  return 0;
+}
+
+/**
+ * 将倒排列表src中第from个至第to - 1个文档追加到倒排列表dst的末尾
+ * @param[in,out] dst 追加目标的倒排列表
+ * @param[in] src 追加源的倒排列表
+ * @param[in] from 追加源中第一个要追加的文档的下标
+ * @param[in] to 追加源中最后一个要追加的文档的下标 + 1
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+append_postings_documents(postings_list *dst, const postings_list *src,
+                          int from, int to)
+{
+  int i, positions_count, base;
+
+  /* 未解码位置信息的倒排列表中positions_len为0，此时只追加文档编号和出现次数 */
+  positions_count = src->positions_len ? src->positions_offsets[to] -
+                                         src->positions_offsets[from] : 0;
+  if (reserve_postings_list(dst, dst->len + (to - from),
+                            dst->positions_len + positions_count)) {
+    return -1;
+  }
+  memcpy(dst->document_ids + dst->len, src->document_ids + from,
+         sizeof(int) * (to - from));
+  memcpy(dst->positions + dst->positions_len,
+         src->positions + src->positions_offsets[from],
+         sizeof(int) * positions_count);
+  base = dst->positions_offsets[dst->len] - src->positions_offsets[from];
+  for (i = from; i < to; i++) {
+    dst->positions_offsets[++dst->len] = src->positions_offsets[i + 1] + base;
+  }
+  dst->positions_len += positions_count;
+  return 0;
+}
 
 /**
  * 从字节序列中还原出倒排列表
@@ -17,33 +209,28 @@ decode_postings_none(const char *postings_e, int postings_e_size,
                      postings_list **postings, int *postings_len)
 {
   const int *p, *pend;
+  postings_list *pl;
 
   *postings = NULL;
   *postings_len = 0;
+  if (!(pl = alloc_postings_list(0, postings_e_size / sizeof(int)))) {
+    return -1;
+  }
   for (p = (const int *)postings_e,
        pend = (const int *)(postings_e + postings_e_size); p < pend;) {
-    postings_list *pl;
     int document_id, positions_count;
 
     document_id = *(p++);
     positions_count = *(p++);
-    if ((pl = malloc(sizeof(postings_list)))) {
-      int i;
-      pl->document_id = document_id;
-      pl->positions_count = positions_count;
-      utarray_new(pl->positions, &ut_int_icd);
-      LL_APPEND(*postings, pl);
-      (*postings_len)++;
-
-      /* decode positions */
-      for (i = 0; i < positions_count; i++) {
-        utarray_push_back(pl->positions, p);
-        p++;
-      }
-    } else {
-      p += positions_count;
+    /* decode positions */
+    if (append_postings_document(pl, document_id, p, positions_count)) {
+      free_postings_list(pl);
+      return -1;
     }
+    p += positions_count;
   }
+  *postings = pl;
+  *postings_len = pl->len;
   return 0;
 }
 
@@ -59,37 +246,158 @@ encode_postings_none(const postings_list *postings,
                      const int postings_len,
                      buffer *postings_e)
 {
-  const postings_list *p;
-  LL_FOREACH(postings, p) {  //调用 utarray的宏 LL_FOREACH()， 从倒排列表中逐一取出各个文档编号的出现位置信息
-    int *pos = NULL;
-    append_buffer(postings_e, (void *)&p->document_id, sizeof(int));
-    append_buffer(postings_e, (void *)&p->positions_count, sizeof(int));  //将文档编号和存放出现位置信息的数组的大小（出现位置的数量） 分别添加到缓冲区中
-    while ((pos = (int *)utarray_next(p->positions, pos))) {  //将各个出现位置
-      append_buffer(postings_e, (void *)pos, sizeof(int));  //也添加到该缓冲区中
-    }
+  int i;
+  for (i = 0; postings && i < postings->len; i++) {  //从倒排列表中逐一取出各个文档编号的出现位置信息
+    int positions_count = POSTINGS_POSITIONS_COUNT(postings, i);
+    append_buffer(postings_e, &postings->document_ids[i], sizeof(int));
+    append_buffer(postings_e, &positions_count, sizeof(int));  //将文档编号和出现位置的数量分别添加到缓冲区中
+    append_buffer(postings_e, POSTINGS_POSITIONS(postings, i),
+                  sizeof(int) * positions_count);  //将各个出现位置也添加到该缓冲区中
   }
   return 0;
 }
 
+/* 以64比特为单位读取比特序列的读取器 */
+typedef struct {
+  const unsigned char *p;   /* 下一个要读入acc的字节 */
+  const unsigned char *end; /* 数据的结尾 */
+  uint64_t acc;             /* 已读入的比特。从最高位开始依次为下一个比特 */
+  int n_bits;               /* acc中有效的比特数 */
+} bit_reader;
+
 /**
- * 从数据中的指定位置读取1个比特
- * @param[in,out] buf 数据的开头
+ * 初始化比特序列的读取器
+ * @param[out] r 读取器
+ * @param[in] buf 数据的开头
  * @param[in] buf_end 数据的结尾
- * @param[in,out] bit 从变量buf的哪个位置读取1个比特
- * @return 读取出的比特值
  */
-static inline int
-read_bit(const char **buf, const char *buf_end, unsigned char *bit)
+static inline void
+init_bit_reader(bit_reader *r, const char *buf, const char *buf_end)
+{
+  r->p = (const unsigned char *)buf;
+  r->end = (const unsigned char *)buf_end;
+  r->acc = 0;
+  r->n_bits = 0;
+}
+
+/**
+ * 尽可能多地将字节读入读取器的acc中
+ * 剩余8字节以上时一次读取8字节。acc中有效比特以外的部分
+ * 也只会是0或者数据中紧接着的比特，所以多读入的比特没有影响
+ * @param[in,out] r 读取器
+ */
+static inline void
+refill_bit_reader(bit_reader *r)
+{
+  if (r->end - r->p >= 8) {
+    uint64_t w;
+    int n = (63 - r->n_bits) >> 3;
+    memcpy(&w, r->p, sizeof(w));
+    r->acc |= __builtin_bswap64(w) >> r->n_bits;
+    r->p += n;
+    r->n_bits += n * 8;
+  } else {
+    while (r->n_bits <= 56 && r->p < r->end) {
+      r->acc |= (uint64_t)*r->p++ << (56 - r->n_bits);
+      r->n_bits += 8;
+    }
+  }
+}
+
+/**
+ * 从读取器中取出指定数量的比特
+ * @param[in,out] r 读取器
+ * @param[in] n 要取出的比特数。1～32
+ * @return 取出的比特。数据不足时为-1
+ */
+static inline int64_t
+read_bits(bit_reader *r, int n)
+{
+  uint64_t v;
+  if (r->n_bits < n) {
+    refill_bit_reader(r);
+    if (r->n_bits < n) { return -1; }
+  }
+  v = r->acc >> (64 - n);
+  r->acc <<= n;
+  r->n_bits -= n;
+  return v;
+}
+
+/**
+ * 跳过当前字节中剩余的比特
+ * @param[in] r 读取器
+ * @return 下一个字节的位置
+ */
+static inline const char *
+align_bit_reader(const bit_reader *r)
+{
+  return (const char *)r->p - (r->n_bits >> 3);
+}
+
+/* 以64比特为单位写入比特序列的写入器 */
+typedef struct {
+  buffer *buf;  /* 写入目标的缓冲区 */
+  uint64_t acc; /* 尚未写入缓冲区的比特。最低位为最后一个比特 */
+  int n_bits;   /* acc中有效的比特数 */
+} bit_writer;
+
+/**
+ * 初始化比特序列的写入器
+ * @param[out] w 写入器
+ * @param[in] buf 写入目标的缓冲区
+ */
+static inline void
+init_bit_writer(bit_writer *w, buffer *buf)
+{
+  w->buf = buf;
+  w->acc = 0;
+  w->n_bits = 0;
+}
+
+/**
+ * 将写入器的acc中已凑满的字节写入缓冲区
+ * @param[in,out] w 写入器
+ */
+static inline void
+spill_bit_writer(bit_writer *w)
+{
+  unsigned char bytes[8];
+  int i, n = w->n_bits >> 3;
+  for (i = 0; i < n; i++) {
+    bytes[i] = (unsigned char)(w->acc >> (w->n_bits - (i + 1) * 8));
+  }
+  append_buffer(w->buf, bytes, n);
+  w->n_bits -= n * 8;
+}
+
+/**
+ * 向写入器中写入比特
+ * @param[in,out] w 写入器
+ * @param[in] v 要写入的比特。从高位开始写入
+ * @param[in] n 要写入的比特数。0～32
+ */
+static inline void
+write_bits(bit_writer *w, uint64_t v, int n)
+{
+  if (w->n_bits + n > 64) { spill_bit_writer(w); }
+  w->acc = (w->acc << n) | v;
+  w->n_bits += n;
+}
+
+/**
+ * 将写入器中剩余的比特写入缓冲区。不满1字节的部分用0补齐
+ * @param[in,out] w 写入器
+ */
+static inline void
+flush_bit_writer(bit_writer *w)
 {
-  int r;
-  if (*buf >= buf_end) { return -1; }
-  r = (**buf & *bit) ? 1 : 0;
-  *bit >>= 1;
-  if (!*bit) {
-    *bit = 0x80;
-    (*buf)++;
+  spill_bit_writer(w);
+  if (w->n_bits) {
+    unsigned char byte = (unsigned char)(w->acc << (8 - w->n_bits));
+    append_buffer(w->buf, &byte, 1);
+    w->n_bits = 0;
   }
-  return r;
 }
 
 /**
@@ -109,42 +417,66 @@ calc_golomb_params(int m, int *b, int *t)
 
 /**
  * 用Golomb编码对1个数值进行解码
+ * 用count-leading-zeros一次数出连续的1，以此对unary编码的部分进行解码
  * @param[in] m Golomb编码中的参数m
  * @param[in] b Golomb编码中的参数b。ceil(log2(m))
  * @param[in] t pow2(b) - m
- * @param[in,out] buf 待解码的数据
- * @param[in] buf_end 待解码数据的结尾
- * @param[in,out] bit 待解码数据的起始比特
+ * @param[in,out] r 待解码数据的读取器
  * @return 解码后的数值
  */
 static inline int
-golomb_decoding(int m, int b, int t,
-                const char **buf, const char *buf_end, unsigned char *bit)
+golomb_decoding(int m, int b, int t, bit_reader *r)
 {
   int n = 0;
 
   /* decode (n / m) with unary code */
-  while (read_bit(buf, buf_end, bit) == 1) {
-    n += m;  //通过 unary编码对二进制序列进行了解码
+  for (;;) {
+    int ones;
+    if (r->n_bits <= 32) { refill_bit_reader(r); }
+    if (!r->n_bits) { break; }
+    ones = ~r->acc ? __builtin_clzll(~r->acc) : 64;
+    if (ones < r->n_bits) {
+      n += m * ones;
+      r->acc <<= ones + 1;
+      r->n_bits -= ones + 1;
+      break;
+    }
+    n += m * r->n_bits;
+    r->acc = 0;
+    r->n_bits = 0;
   }
   /* decode (n % m) */
   if (m > 1) {
-    int i, r = 0;
-    for (i = 0; i < b - 1; i++) {
-      int z = read_bit(buf, buf_end, bit);
-      if (z == -1) { print_error("invalid golomb code"); break; }
-      r = (r << 1) | z;
-    }
-    if (r >= t) {
-      int z = read_bit(buf, buf_end, bit);
-      if (z == -1) {
-        print_error("invalid golomb code");
+    int64_t z, rem;
+    if (r->n_bits < b) { refill_bit_reader(r); }
+    if (r->n_bits >= b) {
+      /* 一次取出b个比特，根据前b - 1个比特的值决定实际使用的比特数 */
+      rem = r->acc >> (64 - b);
+      if ((rem >> 1) < t) {
+        rem >>= 1;
+        r->acc <<= b - 1;
+        r->n_bits -= b - 1;
       } else {
-        r = (r << 1) | z;
-        r -= t;
+        rem -= t;
+        r->acc <<= b;
+        r->n_bits -= b;
+      }
+      return n + rem;
+    }
+    /* 在数据的结尾处，剩余的比特可能不足b个 */
+    rem = b > 1 ? read_bits(r, b - 1) : 0;
+    if (rem == -1) {
+      print_error("invalid golomb code");
+    } else {
+      if (rem >= t) {
+        if ((z = read_bits(r, 1)) == -1) {
+          print_error("invalid golomb code");
+        } else {
+          rem = ((rem << 1) | z) - t;
+        }
       }
+      n += rem;
     }
-    n += r;
   }
   return n;
 }
@@ -155,27 +487,22 @@ golomb_decoding(int m, int b, int t,
  * @param[in] b Golomb编码中的参数b。ceil(log2(m))
  * @param[in] t pow2(b) - m
  * @param[in] n 待编码的数值
- * @param[in] buf 编码后的数据
+ * @param[in,out] w 编码后的数据的写入器
  */
 static inline void
-golomb_encoding(int m, int b, int t, int n, buffer *buf)
+golomb_encoding(int m, int b, int t, int n, bit_writer *w)
 {
-  int i;
+  int q;
   /* encode (n / m) with unary code */
-  for (i = n / m; i; i--) { append_buffer_bit(buf, 1); }  //通过 unary编码对 n / m 的结果进行编码
-  append_buffer_bit(buf, 0);  //将编码后的比特序列写入到缓冲区中
+  for (q = n / m; q >= 32; q -= 32) { write_bits(w, 0xffffffff, 32); }
+  write_bits(w, ((UINT64_C(1) << q) - 1) << 1, q + 1);
   /* encode (n % m) */
-  if (m > 1) {  //对由 n % m 计算出的数值 r 进行了编码， 并将结果也写入到了缓冲区中
+  if (m > 1) {
     int r = n % m;
     if (r < t) {
-      for (i = 1 << (b - 2); i; i >>= 1) {
-        append_buffer_bit(buf, r & i);
-      }
+      write_bits(w, r, b - 1);
     } else {
-      r += t;
-      for (i = 1 << (b - 1); i; i >>= 1) {
-        append_buffer_bit(buf, r & i);
-      }
+      write_bits(w, r + t, b);
     }
   }
 }
@@ -193,10 +520,9 @@ decode_postings_golomb(const char *postings_e, int postings_e_size,
                        postings_list **postings, int *postings_len)
 {
   const char *pend;
-  unsigned char bit;
+  bit_reader r;
 
   pend = postings_e + postings_e_size;
-  bit = 0x80;  //初始化表示当前正指向二进制序列中哪个比特的变量 bit
   *postings = NULL;
   *postings_len = 0;
   {
@@ -210,35 +536,42 @@ decode_postings_golomb(const char *postings_e, int postings_e_size,
       m = *((int *)postings_e);
       postings_e += sizeof(int);
       calc_golomb_params(m, &b, &t);
+      if (!(pl = alloc_postings_list(docs_count, docs_count))) {
+        return -1;
+      }
+      init_bit_reader(&r, postings_e, pend);
       for (i = 0; i < docs_count; i++) {
-        int gap = golomb_decoding(m, b, t, &postings_e, pend, &bit);
-        if ((pl = malloc(sizeof(postings_list)))) {
-          pl->document_id = pre_document_id + gap + 1;
-          utarray_new(pl->positions, &ut_int_icd);
-          LL_APPEND(*postings, pl);
-          (*postings_len)++;
-          pre_document_id = pl->document_id;
-        } else {
-          print_error("memory allocation failed.");
-        }
+        int gap = golomb_decoding(m, b, t, &r);
+        pl->document_ids[i] = pre_document_id + gap + 1;
+        pre_document_id = pl->document_ids[i];
       }
+      pl->len = docs_count;
     }
-    if (bit != 0x80) { postings_e++; bit = 0x80; }
-    for (i = 0, pl = *postings; i < docs_count; i++, pl = pl->next) {
-      int j, mp, bp, tp, position = -1;
+    postings_e = align_bit_reader(&r);
+    for (i = 0; i < docs_count; i++) {
+      int j, mp, bp, tp, positions_count, position = -1;
 
-      pl->positions_count = *((int *)postings_e);
+      positions_count = *((int *)postings_e);
       postings_e += sizeof(int);
       mp = *((int *)postings_e);
       postings_e += sizeof(int);
       calc_golomb_params(mp, &bp, &tp);
-      for (j = 0; j < pl->positions_count; j++) {
-        int gap = golomb_decoding(mp, bp, tp, &postings_e, pend, &bit);
+      if (reserve_postings_list(pl, docs_count,
+                                pl->positions_len + positions_count)) {
+        free_postings_list(pl);
+        return -1;
+      }
+      init_bit_reader(&r, postings_e, pend);
+      for (j = 0; j < positions_count; j++) {
+        int gap = golomb_decoding(mp, bp, tp, &r);
         position += gap + 1;
-        utarray_push_back(pl->positions, &position);
+        pl->positions[pl->positions_len++] = position;
       }
-      if (bit != 0x80) { postings_e++; bit = 0x80; }
+      pl->positions_offsets[i + 1] = pl->positions_len;
+      postings_e = align_bit_reader(&r);
     }
+    *postings = pl;
+    *postings_len = docs_count;
   }
   return 0;
 }
@@ -256,8 +589,10 @@ encode_postings_golomb(int documents_count,
                        const postings_list *postings, const int postings_len,
                        buffer *postings_e)
 {
-  const postings_list *p;
+  int i;
+  bit_writer w;
 
+  init_bit_writer(&w, postings_e);
   append_buffer(postings_e, &postings_len, sizeof(int));  //将倒排列表中包含的文档数存储起来
   if (postings && postings_len) {
     int m, b, t;
@@ -267,174 +602,1392 @@ encode_postings_golomb(int documents_count,
     {
       int pre_document_id = 0;
 
-      LL_FOREACH(postings, p) {  //逐一取出倒排列表中的文档编号
-        int gap = p->document_id - pre_document_id - 1;  //每取出一个文档编号， 就计算其与刚刚存储的文档编号的差值
-        golomb_encoding(m, b, t, gap, postings_e);  //对计算结果进行编码
-        pre_document_id = p->document_id;
+      for (i = 0; i < postings->len; i++) {  //逐一取出倒排列表中的文档编号
+        int gap = postings->document_ids[i] - pre_document_id - 1;  //每取出一个文档编号， 就计算其与刚刚存储的文档编号的差值
+        golomb_encoding(m, b, t, gap, &w);  //对计算结果进行编码
+        pre_document_id = postings->document_ids[i];
       }
     }
-    append_buffer(postings_e, NULL, 0);  //将以比特为单位的信息统一为以字节为最小单位的信息
+    flush_bit_writer(&w);  //将以比特为单位的信息统一为以字节为最小单位的信息
   }
-  LL_FOREACH(postings, p) {
-    append_buffer(postings_e, &p->positions_count, sizeof(int));
-    if (p->positions && p->positions_count) {
-      const int *pp;
+  for (i = 0; postings && i < postings->len; i++) {
+    int positions_count = POSTINGS_POSITIONS_COUNT(postings, i);
+    append_buffer(postings_e, &positions_count, sizeof(int));
+    if (positions_count) {
+      const int *pp, *pp_end;
       int mp, bp, tp, pre_position = -1;
 
-      pp = (const int *)utarray_back(p->positions);  //获取了词元在文档中最后一次出现的位置
-      mp = (*pp + 1) / p->positions_count;  //用词元在文档中最后一次出现的位置除以词元在文档中的出现次数， 计算出了对出现位置进行编码时需要用到的参数 m
+      pp = POSTINGS_POSITIONS(postings, i);
+      pp_end = pp + positions_count;
+      mp = (pp_end[-1] + 1) / positions_count;  //用词元在文档中最后一次出现的位置除以词元在文档中的出现次数， 计算出了对出现位置进行编码时需要用到的参数 m
       calc_golomb_params(mp, &bp, &tp);  //对出现位置数组中的整数进行了编码
       append_buffer(postings_e, &mp, sizeof(int));
-      pp = NULL;
-      while ((pp = (const int *)utarray_next(p->positions, pp))) {
+      for (; pp < pp_end; pp++) {
         int gap = *pp - pre_position - 1;
-        golomb_encoding(mp, bp, tp, gap, postings_e);
+        golomb_encoding(mp, bp, tp, gap, &w);
         pre_position = *pp;
       }
-      append_buffer(postings_e, NULL, 0);
+      flush_bit_writer(&w);
     }
   }
   return 0;
 }
 
+/* 带跳表的倒排列表的头部。其后依次为跳表、文档流和位置信息流 */
+typedef struct {
+  int docs_count;      /* 文档数 */
+  int block_size;      /* 每个块中的文档数（跳表项的间隔） */
+  int n_blocks;        /* 块数 */
+  int positions_start; /* 位置信息流相对于倒排列表开头的字节偏移量 */
+  int m;               /* 对文档编号的差值进行Golomb编码时的参数m */
+  int mt;              /* 对出现次数进行Golomb编码时的参数m */
+} blocked_postings_header;
+
+/* 跳表项。每个块对应一项 */
+typedef struct {
+  int last_document_id;    /* 块中最后一个文档的编号 */
+  int max_positions_count; /* 块中各文档的出现次数的最大值 */
+  int docs_offset;         /* 块在文档流中的字节偏移量 */
+  int positions_offset;    /* 块在位置信息流中的字节偏移量 */
+} skip_entry;
+
+/* 解析带跳表的倒排列表时用到的指针 */
+typedef struct {
+  const blocked_postings_header *header; /* 头部 */
+  const skip_entry *skips;               /* 跳表 */
+  const char *docs;                      /* 文档流的开头 */
+  const char *positions;                 /* 位置信息流的开头 */
+  const char *end;                       /* 倒排列表的结尾 */
+} blocked_postings;
+
 /**
- * 对倒排列表进行还原或解码
+ * 解析带跳表的倒排列表的头部
+ * @param[in] postings_e 带跳表的倒排列表
+ * @param[in] postings_e_size 带跳表的倒排列表的字节数
+ * @param[out] bp 指向各部分的指针
+ * @retval 0 成功
+ * @retval -1 数据已损坏
+ */
+static int
+parse_blocked_postings(const char *postings_e, int postings_e_size,
+                       blocked_postings *bp)
+{
+  const blocked_postings_header *h;
+
+  if (postings_e_size < (int)sizeof(blocked_postings_header)) { return -1; }
+  h = (const blocked_postings_header *)postings_e;
+  bp->header = h;
+  bp->skips = (const skip_entry *)(postings_e +
+                                   sizeof(blocked_postings_header));
+  bp->docs = (const char *)(bp->skips + h->n_blocks);
+  bp->positions = postings_e + h->positions_start;
+  bp->end = postings_e + postings_e_size;
+  if (bp->docs > bp->positions || bp->positions > bp->end) { return -1; }
+  return 0;
+}
+
+/**
+ * 获取带跳表的倒排列表中指定块的文档数
+ * @param[in] bp 带跳表的倒排列表
+ * @param[in] block 块的编号
+ * @return 文档数
+ */
+static inline int
+blocked_postings_block_len(const blocked_postings *bp, int block)
+{
+  int n = bp->header->docs_count - block * bp->header->block_size;
+  return n > bp->header->block_size ? bp->header->block_size : n;
+}
+
+/**
+ * 只对带跳表的倒排列表中的1个块的文档流进行解码，并将文档编号和出现次数追加到倒排列表的末尾
+ * 不解码位置信息流，所以倒排列表的positions_len不变。位置信息需要时再用
+ * 函数decode_postings_block_positions解码
  * @param[in] env 存储着应用程序运行环境的结构体
- * @param[in] postings_e 待还原或解码前的倒排列表
- * @param[in] postings_e_size 待还原或解码前的倒排列表中的元素数
- * @param[out] postings 还原或解码后的倒排列表
- * @param[out] postings_len 还原或解码后的倒排列表中的元素数
+ * @param[in] bp 带跳表的倒排列表
+ * @param[in] block 块的编号
+ * @param[in,out] pl 存储解码结果的倒排列表
  * @retval 0 成功
+ * @retval -1 失败
  */
 static int
-decode_postings(const wiser_env *env,
-                const char *postings_e, int postings_e_size,
-                postings_list **postings, int *postings_len)
+decode_postings_block_docs(const wiser_env *env, const blocked_postings *bp,
+                           int block, postings_list *pl)
 {
+  int i, n, pre_document_id;
+  const blocked_postings_header *h = bp->header;
+  const skip_entry *skip = &bp->skips[block];
+  const char *p;
+  int *document_ids, *offsets;
+
+  n = blocked_postings_block_len(bp, block);
+  pre_document_id = block ? bp->skips[block - 1].last_document_id : 0;
+  if (reserve_postings_list(pl, pl->len + n, pl->positions_len)) {
+    return -1;
+  }
+  document_ids = pl->document_ids + pl->len;
+  offsets = pl->positions_offsets + pl->len;
+
+  /* 解码文档编号和出现次数 */
+  p = bp->docs + skip->docs_offset;
   switch (env->compress) {
   case compress_none:
-    return decode_postings_none(postings_e, postings_e_size,
-                                postings, postings_len);
+    for (i = 0; i < n; i++) {
+      document_ids[i] = ((const int *)p)[i];
+      offsets[i + 1] = offsets[i] + ((const int *)p)[n + i];
+    }
+    break;
   case compress_golomb:
-    return decode_postings_golomb(postings_e, postings_e_size,
-                                  postings, postings_len);
+    {
+      int b, t;
+      bit_reader r;
+      init_bit_reader(&r, p, bp->positions);
+      calc_golomb_params(h->m, &b, &t);
+      for (i = 0; i < n; i++) {
+        pre_document_id += golomb_decoding(h->m, b, t, &r) + 1;
+        document_ids[i] = pre_document_id;
+      }
+      calc_golomb_params(h->mt, &b, &t);
+      for (i = 0; i < n; i++) {
+        offsets[i + 1] = offsets[i] + golomb_decoding(h->mt, b, t, &r) + 1;
+      }
+    }
+    break;
+  case compress_streamvbyte:
+    if (!(p = streamvbyte_decode(p, bp->positions, n,
+                                 (uint32_t *)document_ids)) ||
+        !streamvbyte_decode(p, bp->positions, n,
+                            (uint32_t *)offsets + 1)) {
+      print_error("invalid streamvbyte code");
+      return -1;
+    }
+    for (i = 0; i < n; i++) {
+      pre_document_id += document_ids[i] + 1;
+      document_ids[i] = pre_document_id;
+      offsets[i + 1] += offsets[i] + 1;
+    }
+    break;
   default:
     abort();
   }
+  pl->len += n;
+  return 0;
 }
 
 /**
- * 对倒排列表进行转换或编码
+ * 对带跳表的倒排列表中的1个块的位置信息流进行解码
+ * 该块的文档必须已由函数decode_postings_block_docs追加到倒排列表中下标为first开始的位置，
+ * 并且它们之前的文档的位置信息都已解码
  * @param[in] env 存储着应用程序运行环境的结构体
- * @param[in] postings 待转换或编码前的倒排列表
- * @param[in] postings_len 待转换或编码前的倒排列表中的元素数
- * @param[out] postings_e 转换或编码后的倒排列表
+ * @param[in] bp 带跳表的倒排列表
+ * @param[in] block 块的编号
+ * @param[in,out] pl 存储解码结果的倒排列表
+ * @param[in] first 该块的第一个文档在倒排列表中的下标
  * @retval 0 成功
+ * @retval -1 失败
  */
 static int
-encode_postings(const wiser_env *env,
-                const postings_list *postings, const int postings_len,
-                buffer *postings_e)
+decode_postings_block_positions(const wiser_env *env,
+                                const blocked_postings *bp, int block,
+                                postings_list *pl, int first)
 {
+  int i, n, positions_count;
+  const char *p;
+  const int *offsets = pl->positions_offsets + first;
+
+  n = blocked_postings_block_len(bp, block);
+  positions_count = offsets[n] - offsets[0];
+  if (reserve_postings_list(pl, pl->len, offsets[0] + positions_count)) {
+    return -1;
+  }
+  pl->positions_len = offsets[0];
+
+  /* 解码位置信息 */
+  p = bp->positions + bp->skips[block].positions_offset;
   switch (env->compress) {
   case compress_none:
-    return encode_postings_none(postings, postings_len, postings_e);
+    memcpy(pl->positions + pl->positions_len, p,
+           sizeof(int) * positions_count);
+    break;
   case compress_golomb:
-    return encode_postings_golomb(db_get_document_count(env),
-                                  postings, postings_len, postings_e);
+    {
+      int mp, b, t, *pp = pl->positions + pl->positions_len;
+      bit_reader r;
+      mp = *((const int *)p);
+      p += sizeof(int);
+      init_bit_reader(&r, p, bp->end);
+      calc_golomb_params(mp, &b, &t);
+      for (i = 0; i < n; i++) {
+        int j, position = -1;
+        for (j = offsets[i]; j < offsets[i + 1]; j++) {
+          position += golomb_decoding(mp, b, t, &r) + 1;
+          *pp++ = position;
+        }
+      }
+    }
+    break;
+  case compress_streamvbyte:
+    {
+      int *pp = pl->positions + pl->positions_len;
+      if (!streamvbyte_decode(p, bp->end, positions_count, (uint32_t *)pp)) {
+        print_error("invalid streamvbyte code");
+        return -1;
+      }
+      for (i = 0; i < n; i++) {
+        int j, position = -1;
+        for (j = offsets[i]; j < offsets[i + 1]; j++, pp++) {
+          position += *pp + 1;
+          *pp = position;
+        }
+      }
+    }
+    break;
   default:
     abort();
   }
+  pl->positions_len += positions_count;
+  return 0;
 }
 
 /**
- * 从数据库中获取关联到指定词元上的倒排列表
+ * 对带跳表的倒排列表进行解码
  * @param[in] env 存储着应用程序运行环境的结构体
- * @param[in] token_id 词元编号
- * @param[out] postings 获取到的倒排列表
- * @param[out] postings_len 获取到的倒排列表中的元素数
+ * @param[in] postings_e 带跳表的倒排列表
+ * @param[in] postings_e_size 带跳表的倒排列表的字节数
+ * @param[in] with_positions 是否解码位置信息。为假时只解码文档编号和出现次数
+ * @param[out] postings 解码后的倒排列表
+ * @param[out] postings_len 解码后的倒排列表中的元素数
  * @retval 0 成功
  * @retval -1 失败
  */
-int
-fetch_postings(const wiser_env *env, const int token_id,
-               postings_list **postings, int *postings_len)
+static int
+decode_postings_blocked(const wiser_env *env,
+                        const char *postings_e, int postings_e_size,
+                        int with_positions,
+                        postings_list **postings, int *postings_len)
 {
-  char *postings_e;
-  int postings_e_size, docs_count, rc;
+  int i;
+  blocked_postings bp;
+  postings_list *pl;
 
-  rc = db_get_postings(env, token_id, &docs_count, (void **)&postings_e,
-                       &postings_e_size);
-  if (!rc && postings_e_size) {
-    /* 只有当倒排列表非空时，才进行解码 */
-    int decoded_len;
-    if (decode_postings(env, postings_e, postings_e_size, postings,
-                        &decoded_len)) {
-      print_error("postings list decode error");
-      rc = -1;
-    } else if (docs_count != decoded_len) {
-      print_error("postings list decode error: stored:%d decoded:%d.\n",
-                  *postings_len, decoded_len);
-      rc = -1;
-    }
-    if (postings_len) { *postings_len = decoded_len; }
-  } else {
-    *postings = NULL;
-    if (postings_len) { *postings_len = 0; }
+  *postings = NULL;
+  *postings_len = 0;
+  if (parse_blocked_postings(postings_e, postings_e_size, &bp) ||
+      !(pl = alloc_postings_list(bp.header->docs_count,
+                                 with_positions ? bp.header->docs_count : 0))) {
+    return -1;
   }
-  return rc;
-}
-
-/**
- * 获取将两个倒排列表合并后得到的倒排列表
- * @param[in] pa 要合并的倒排列表
- * @param[in] pb 要合并的倒排列表
- *
- * @return 合并后的倒排列表
- *
- * @attention 若base和to_be_added（参见函数merge_inverted_index）中的任意一个被破坏了，
- *            或者二者中含有相同的文档编号，则该函数的行为不可预知
- */
-static postings_list *
-merge_postings(postings_list *pa, postings_list *pb)  //接收两个内存上的倒排列表作为参数
-{
-  postings_list *ret = NULL, *p;  //返回将其合并后的倒排列表。我们使用变量 ret 来管理合并后的倒排列表
-  /* 用pa和pb分别遍历base和to_be_added（参见函数merge_inverted_index）中的倒排列表中的元素， */
-  /* 将二者连接成按文档编号升序排列的链表 */
-  while (pa || pb) {
-    postings_list *e;
-    if (!pb || (pa && pa->document_id <= pb->document_id)) {  //如果 pa 所指向的文档编号小于 pb 所指向的文档编号
-      e = pa;  //将 pa 所指向的元素添加到合并后的倒排列表中
-      pa = pa->next;  //并让 pa 指向下一个元素
-    } else if (!pa || pa->document_id >= pb->document_id) {  //如果 pb 所指向的文档编号小于 pa 所指向的文档编号
-      e = pb;  //将 pb 所指向的元素添加到合并后的倒排列表中
-      pb = pb->next;  //让 pb 指向下一个元素
-    } else {
-      abort();
-    }
-    e->next = NULL;  //将变量 e添加到合并后的倒排列表中
-    if (!ret) {
-      ret = e;
-    } else {
-      p->next = e;
+  for (i = 0; i < bp.header->n_blocks; i++) {
+    int first = pl->len;
+    if (decode_postings_block_docs(env, &bp, i, pl) ||
+        (with_positions &&
+         decode_postings_block_positions(env, &bp, i, pl, first))) {
+      free_postings_list(pl);
+      return -1;
     }
-    p = e;
   }
-  return ret;
+  *postings = pl;
+  *postings_len = pl->len;
+  return 0;
 }
 
 /**
- * 将内存上（小倒排索引中）的倒排列表与存储器上的倒排列表合并后存储到数据库中
+ * 将倒排列表中的1个块编码后分别追加到文档流和位置信息流中
  * @param[in] env 存储着应用程序运行环境的结构体
- * @param[in] p 含有倒排列表的倒排索引中的索引项
+ * @param[in] h 倒排列表的头部
+ * @param[in] postings 倒排列表
+ * @param[in] from 块中第一个文档的下标
+ * @param[in] to 块中最后一个文档的下标 + 1
+ * @param[in] pre_document_id 上一个块中最后一个文档的编号
+ * @param[in,out] docs 文档流
+ * @param[in,out] positions 位置信息流
+ * @retval 0 成功
+ * @retval -1 失败
  */
-void
+static int
+encode_postings_block(const wiser_env *env,
+                      const blocked_postings_header *h,
+                      const postings_list *postings, int from, int to,
+                      int pre_document_id, buffer *docs, buffer *positions)
+{
+  int i;
+
+  switch (env->compress) {
+  case compress_none:
+    append_buffer(docs, postings->document_ids + from,
+                  sizeof(int) * (to - from));
+    for (i = from; i < to; i++) {
+      int positions_count = POSTINGS_POSITIONS_COUNT(postings, i);
+      append_buffer(docs, &positions_count, sizeof(int));
+    }
+    append_buffer(positions, POSTINGS_POSITIONS(postings, from),
+                  sizeof(int) * (postings->positions_offsets[to] -
+                                 postings->positions_offsets[from]));
+    break;
+  case compress_golomb:
+    {
+      int b, t, mp, span = 0;
+      bit_writer w;
+      init_bit_writer(&w, docs);
+      calc_golomb_params(h->m, &b, &t);
+      for (i = from; i < to; i++) {
+        golomb_encoding(h->m, b, t,
+                        postings->document_ids[i] - pre_document_id - 1, &w);
+        pre_document_id = postings->document_ids[i];
+      }
+      calc_golomb_params(h->mt, &b, &t);
+      for (i = from; i < to; i++) {
+        golomb_encoding(h->mt, b, t,
+                        POSTINGS_POSITIONS_COUNT(postings, i) - 1, &w);
+      }
+      flush_bit_writer(&w);
+
+      /* 用块中各文档最后一次出现的位置之和除以出现次数之和，作为对位置信息进行编码时的参数m */
+      for (i = from; i < to; i++) {
+        span += postings->positions[postings->positions_offsets[i + 1] - 1] + 1;
+      }
+      mp = span / (postings->positions_offsets[to] -
+                   postings->positions_offsets[from]);
+      append_buffer(positions, &mp, sizeof(int));
+      init_bit_writer(&w, positions);
+      calc_golomb_params(mp, &b, &t);
+      for (i = from; i < to; i++) {
+        int j, pre_position = -1;
+        for (j = postings->positions_offsets[i];
+             j < postings->positions_offsets[i + 1]; j++) {
+          golomb_encoding(mp, b, t, postings->positions[j] - pre_position - 1,
+                          &w);
+          pre_position = postings->positions[j];
+        }
+      }
+      flush_bit_writer(&w);
+    }
+    break;
+  case compress_streamvbyte:
+    {
+      int n = to - from, positions_count, *values, *v;
+
+      positions_count = postings->positions_offsets[to] -
+                        postings->positions_offsets[from];
+      if (!(values = malloc(sizeof(int) * (n > positions_count ?
+                                           n : positions_count)))) {
+        print_error("cannot allocate memory for encoding postings.");
+        return -1;
+      }
+      for (i = from, v = values; i < to; i++) {
+        *v++ = postings->document_ids[i] - pre_document_id - 1;
+        pre_document_id = postings->document_ids[i];
+      }
+      if (streamvbyte_encode((uint32_t *)values, n, docs)) { goto fail; }
+      for (i = from, v = values; i < to; i++) {
+        *v++ = POSTINGS_POSITIONS_COUNT(postings, i) - 1;
+      }
+      if (streamvbyte_encode((uint32_t *)values, n, docs)) { goto fail; }
+      for (i = from, v = values; i < to; i++) {
+        int j, pre_position = -1;
+        for (j = postings->positions_offsets[i];
+             j < postings->positions_offsets[i + 1]; j++) {
+          *v++ = postings->positions[j] - pre_position - 1;
+          pre_position = postings->positions[j];
+        }
+      }
+      if (streamvbyte_encode((uint32_t *)values, positions_count,
+                             positions)) {
+        goto fail;
+      }
+      free(values);
+      break;
+fail:
+      free(values);
+      return -1;
+    }
+  default:
+    abort();
+  }
+  return 0;
+}
+
+/**
+ * 将倒排列表编码为带跳表的格式
+ * 每隔block_size个文档分为1个块，在跳表中记录各块的最后一个文档编号和各块的起始位置，
+ * 以便在求交集时跳过不需要的块，并只对需要的块进行解码
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] documents_count 文档总数
+ * @param[in] postings 待编码的倒排列表
+ * @param[in] postings_len 待编码的倒排列表中的元素数
+ * @param[out] postings_e 编码后的倒排列表
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+encode_postings_blocked(const wiser_env *env, int documents_count,
+                        const postings_list *postings, const int postings_len,
+                        buffer *postings_e)
+{
+  int i;
+  blocked_postings_header h;
+  skip_entry *skips;
+  buffer *docs, *positions;
+
+  memset(&h, 0, sizeof(h));
+  h.docs_count = postings ? postings->len : 0;
+  h.block_size = env->skip_interval;
+  h.n_blocks = (h.docs_count + h.block_size - 1) / h.block_size;
+  if (h.docs_count) {
+    h.m = documents_count / h.docs_count;
+    h.mt = postings->positions_len / h.docs_count;
+  }
+  if (h.m < 1) { h.m = 1; }
+  if (h.mt < 1) { h.mt = 1; }
+
+  if (!(skips = malloc(sizeof(skip_entry) * (h.n_blocks + 1)))) {
+    print_error("cannot allocate memory for skip entries.");
+    return -1;
+  }
+  if (!(docs = alloc_buffer())) {
+    free(skips);
+    return -1;
+  }
+  if (!(positions = alloc_buffer())) {
+    free_buffer(docs);
+    free(skips);
+    return -1;
+  }
+  for (i = 0; i < h.n_blocks; i++) {
+    int j, from, to;
+    from = i * h.block_size;
+    to = from + h.block_size < h.docs_count ? from + h.block_size
+                                            : h.docs_count;
+    skips[i].last_document_id = postings->document_ids[to - 1];
+    skips[i].max_positions_count = 0;
+    for (j = from; j < to; j++) {
+      if (POSTINGS_POSITIONS_COUNT(postings, j) >
+          skips[i].max_positions_count) {
+        skips[i].max_positions_count = POSTINGS_POSITIONS_COUNT(postings, j);
+      }
+    }
+    skips[i].docs_offset = BUFFER_SIZE(docs);
+    skips[i].positions_offset = BUFFER_SIZE(positions);
+    if (encode_postings_block(env, &h, postings, from, to,
+                              i ? skips[i - 1].last_document_id : 0,
+                              docs, positions)) {
+      free_buffer(positions);
+      free_buffer(docs);
+      free(skips);
+      return -1;
+    }
+  }
+  h.positions_start = sizeof(h) + sizeof(skip_entry) * h.n_blocks +
+                      BUFFER_SIZE(docs);
+  append_buffer(postings_e, &h, sizeof(h));
+  append_buffer(postings_e, skips, sizeof(skip_entry) * h.n_blocks);
+  append_buffer(postings_e, BUFFER_PTR(docs), BUFFER_SIZE(docs));
+  append_buffer(postings_e, BUFFER_PTR(positions), BUFFER_SIZE(positions));
+  free_buffer(positions);
+  free_buffer(docs);
+  free(skips);
+  return 0;
+}
+
+/**
+ * 对倒排列表进行还原或解码
+ * 带跳表的倒排列表的文档流和位置信息流是分开存储的，不需要位置信息时只解码文档流。
+ * 不带跳表的旧格式总是连同位置信息一起解码
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] postings_e 待还原或解码前的倒排列表
+ * @param[in] postings_e_size 待还原或解码前的倒排列表中的元素数
+ * @param[in] with_positions 是否解码位置信息。为假时解码结果的positions_len可能为0
+ * @param[out] postings 还原或解码后的倒排列表
+ * @param[out] postings_len 还原或解码后的倒排列表中的元素数
+ * @retval 0 成功
+ */
+int
+decode_postings(const wiser_env *env,
+                const char *postings_e, int postings_e_size,
+                int with_positions,
+                postings_list **postings, int *postings_len)
+{
+  if (env->skip_interval) {
+    return decode_postings_blocked(env, postings_e, postings_e_size,
+                                   with_positions, postings, postings_len);
+  }
+  switch (env->compress) {
+  case compress_none:
+    return decode_postings_none(postings_e, postings_e_size,
+                                postings, postings_len);
+  case compress_golomb:
+    return decode_postings_golomb(postings_e, postings_e_size,
+                                  postings, postings_len);
+  default:
+    abort();
+  }
+}
+
+/**
+ * 检查倒排列表能否被编码。文档编号以及各文档中的出现位置都必须严格递增，
+ * 否则编码时的差值会变为负数，破坏其后的所有编码
+ * @param[in] postings 倒排列表
+ * @retval 0 可以编码
+ * @retval -1 文档编号或出现位置没有严格递增
+ */
+static int
+check_postings_order(const postings_list *postings)
+{
+  int i, j;
+
+  for (i = 0; i < postings->len; i++) {
+    if (i && postings->document_ids[i] <= postings->document_ids[i - 1]) {
+      print_error("postings list is not sorted: document %d follows %d.",
+                  postings->document_ids[i], postings->document_ids[i - 1]);
+      return -1;
+    }
+    if (!postings->positions_len) { continue; }
+    for (j = postings->positions_offsets[i] + 1;
+         j < postings->positions_offsets[i + 1]; j++) {
+      if (postings->positions[j] <= postings->positions[j - 1]) {
+        print_error("positions are not sorted in document %d.",
+                    postings->document_ids[i]);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * 对倒排列表进行转换或编码
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] postings 待转换或编码前的倒排列表
+ * @param[in] postings_len 待转换或编码前的倒排列表中的元素数
+ * @param[out] postings_e 转换或编码后的倒排列表
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+encode_postings(const wiser_env *env,
+                const postings_list *postings, const int postings_len,
+                buffer *postings_e)
+{
+  if (postings && check_postings_order(postings)) { return -1; }
+  if (env->skip_interval) {
+    return encode_postings_blocked(env,
+                                   env->compress == compress_golomb ?
+                                   env->stats.documents_count : 0,
+                                   postings, postings_len, postings_e);
+  }
+  switch (env->compress) {
+  case compress_none:
+    return encode_postings_none(postings, postings_len, postings_e);
+  case compress_golomb:
+    return encode_postings_golomb(env->stats.documents_count,
+                                  postings, postings_len, postings_e);
+  default:
+    abort();
+  }
+}
+
+/**
+ * 将同一个词元的多个带跳表的倒排列表连接成1个带跳表的倒排列表
+ * 各倒排列表中的文档编号必须互不重叠，并且按文档编号的升序排列
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] documents_count 文档总数
+ * @param[in] postings_e 带跳表的倒排列表的数组
+ * @param[in] postings_e_size 各倒排列表的字节数的数组
+ * @param[in] n 倒排列表的个数
+ * @param[out] out 连接后的带跳表的倒排列表
+ * @param[out] docs_count 连接后的倒排列表中的文档数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+concat_encoded_postings(const wiser_env *env, int documents_count,
+                        const char *const *postings_e,
+                        const int *postings_e_size, int n,
+                        buffer *out, int *docs_count)
+{
+  int i, rc = 0;
+  postings_list *pl = NULL;
+
+  for (i = 0; i < n && !rc; i++) {
+    int decoded_len;
+    postings_list *decoded;
+    if (decode_postings_blocked(env, postings_e[i], postings_e_size[i], TRUE,
+                                &decoded, &decoded_len)) {
+      print_error("postings list decode error");
+      rc = -1;
+    } else if (!pl) {
+      pl = decoded;
+    } else {
+      rc = append_postings_documents(pl, decoded, 0, decoded->len);
+      free_postings_list(decoded);
+    }
+  }
+  if (!rc && pl) {
+    rc = check_postings_order(pl) ||
+         encode_postings_blocked(env, documents_count, pl, pl->len, out) ?
+         -1 : 0;
+    *docs_count = pl->len;
+  }
+  if (pl) { free_postings_list(pl); }
+  return rc;
+}
+
+/**
+ * 从各段中获取关联到指定词元上的倒排列表，并将它们连接起来
+ * 各段中的文档编号互不重叠，并且段是按文档编号的升序排列的
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] token_id 词元编号
+ * @param[in] with_positions 是否解码位置信息
+ * @param[out] postings 获取到的倒排列表。不存在时为NULL
+ * @param[out] postings_len 获取到的倒排列表中的元素数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+fetch_segments_postings(const wiser_env *env, const int token_id,
+                        int with_positions,
+                        postings_list **postings, int *postings_len)
+{
+  int i, rc = 0;
+  postings_list *pl = NULL;
+
+  for (i = 0; i < env->n_segments && !rc; i++) {
+    const char *postings_e;
+    int postings_e_size, docs_count, decoded_len;
+    postings_list *decoded;
+    if (segment_get_postings(env->segments[i], token_id, &postings_e,
+                             &postings_e_size, &docs_count)) {
+      continue;
+    }
+    if (decode_postings(env, postings_e, postings_e_size, with_positions,
+                        &decoded, &decoded_len)) {
+      print_error("postings list decode error");
+      rc = -1;
+    } else if (docs_count != decoded_len) {
+      print_error("postings list decode error: stored:%d decoded:%d.\n",
+                  docs_count, decoded_len);
+      free_postings_list(decoded);
+      rc = -1;
+    } else if (!pl) {
+      pl = decoded;
+    } else {
+      rc = append_postings_documents(pl, decoded, 0, decoded->len);
+      free_postings_list(decoded);
+    }
+  }
+  if (rc && pl) {
+    free_postings_list(pl);
+    pl = NULL;
+  }
+  *postings = pl;
+  if (postings_len) { *postings_len = pl ? pl->len : 0; }
+  return rc;
+}
+
+/**
+ * 从数据库或段中获取关联到指定词元上的倒排列表
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] token_id 词元编号
+ * @param[in] with_positions 是否解码位置信息。为假时只保证文档编号和出现次数有效
+ * @param[out] postings 获取到的倒排列表
+ * @param[out] postings_len 获取到的倒排列表中的元素数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+fetch_postings(const wiser_env *env, const int token_id,
+               int with_positions,
+               postings_list **postings, int *postings_len)
+{
+  char *postings_e;
+  int postings_e_size, docs_count, rc;
+
+  if (env->format == index_format_segment) {
+    return fetch_segments_postings(env, token_id, with_positions,
+                                   postings, postings_len);
+  }
+  rc = db_get_postings(env, token_id, &docs_count, (void **)&postings_e,
+                       &postings_e_size);
+  if (!rc && postings_e_size) {
+    /* 只有当倒排列表非空时，才进行解码 */
+    int decoded_len;
+    if (decode_postings(env, postings_e, postings_e_size, with_positions,
+                        postings, &decoded_len)) {
+      print_error("postings list decode error");
+      rc = -1;
+    } else if (docs_count != decoded_len) {
+      print_error("postings list decode error: stored:%d decoded:%d.\n",
+                  docs_count, decoded_len);
+      free_postings_list(*postings);
+      *postings = NULL;
+      decoded_len = 0;
+      rc = -1;
+    }
+    if (postings_len) { *postings_len = decoded_len; }
+  } else {
+    *postings = NULL;
+    if (postings_len) { *postings_len = 0; }
+  }
+  return rc;
+}
+
+static int postings_cursor_seek_block(postings_cursor *cur, int block);
+
+/**
+ * 获取倒排列表中各文档的出现次数的最大值
+ * @param[in] pl 倒排列表
+ * @return 出现次数的最大值
+ */
+static int
+calc_max_positions_count(const postings_list *pl)
+{
+  int i, max_positions_count = 0;
+  for (i = 0; i < pl->len; i++) {
+    if (POSTINGS_POSITIONS_COUNT(pl, i) > max_positions_count) {
+      max_positions_count = POSTINGS_POSITIONS_COUNT(pl, i);
+    }
+  }
+  return max_positions_count;
+}
+
+/**
+ * 使游标遍历整个解码后的倒排列表。将整个倒排列表视为1个块
+ * @param[in,out] cur 游标
+ * @param[in] pl 解码后的倒排列表
+ * @param[in] max_positions_count 各文档的出现次数的最大值
+ */
+static void
+set_whole_postings_cursor(postings_cursor *cur, postings_list *pl,
+                          int max_positions_count)
+{
+  cur->documents = pl;
+  cur->positions_decoded = TRUE;
+  cur->n_blocks = 1;
+  cur->block = 0;
+  cur->document_id = pl->len ? pl->document_ids[0] : 0;
+  cur->max_positions_count = max_positions_count;
+  cur->block_max_positions_count = max_positions_count;
+}
+
+/**
+ * 将带跳表的倒排列表中的所有块追加到游标要遍历的块中
+ * 倒排列表本身不会被复制，在关闭游标之前必须保持有效
+ * @param[in,out] cur 游标
+ * @param[in] postings_e 带跳表的倒排列表
+ * @param[in] postings_e_size 带跳表的倒排列表的字节数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+add_postings_cursor_blocks(postings_cursor *cur,
+                           const char *postings_e, int postings_e_size)
+{
+  int i;
+  blocked_postings bp;
+  postings_cursor_block *blocks;
+
+  if (parse_blocked_postings(postings_e, postings_e_size, &bp)) {
+    print_error("postings list decode error");
+    return -1;
+  }
+  if (!(blocks = realloc(cur->blocks, sizeof(postings_cursor_block) *
+                                      (cur->n_blocks +
+                                       bp.header->n_blocks)))) {
+    print_error("cannot allocate memory for a postings cursor.");
+    return -1;
+  }
+  cur->blocks = blocks;
+  for (i = 0; i < bp.header->n_blocks; i++) {
+    postings_cursor_block *b = &cur->blocks[cur->n_blocks++];
+    b->postings_e = postings_e;
+    b->postings_e_size = postings_e_size;
+    b->block = i;
+    b->last_document_id = bp.skips[i].last_document_id;
+    b->max_positions_count = bp.skips[i].max_positions_count;
+    if (b->max_positions_count > cur->max_positions_count) {
+      cur->max_positions_count = b->max_positions_count;
+    }
+  }
+  return 0;
+}
+
+/**
+ * 打开遍历指定词元的倒排列表的游标，并使其指向第一个文档
+ * 对于带跳表的倒排列表，只有在游标移动到某个块时才会对该块进行解码。
+ * 使用段文件时，依次遍历各个段中的倒排列表，并且不复制段文件中的数据
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] token_id 词元编号
+ * @param[out] cur 游标
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+open_postings_cursor(const wiser_env *env, const int token_id,
+                     postings_cursor *cur)
+{
+  int rc;
+
+  memset(cur, 0, sizeof(postings_cursor));
+  cur->env = env;
+  cur->token_id = token_id;
+  cur->block = -1;
+  if (env->postings_cache) {
+    /* 使用缓存时，借用缓存中整个解码后的倒排列表，并将其视为1个块 */
+    int max_positions_count;
+    const postings_list *pl;
+    postings_list *decoded;
+    if ((pl = postings_cache_get(env->postings_cache, token_id,
+                                 &max_positions_count))) {
+      cur->cached = TRUE;
+      set_whole_postings_cursor(cur, (postings_list *)pl,
+                                max_positions_count);
+      return 0;
+    }
+    if ((rc = fetch_postings(env, token_id, env->enable_phrase_search,
+                             &decoded, NULL))) {
+      return rc;
+    }
+    if (decoded) {
+      max_positions_count = calc_max_positions_count(decoded);
+      cur->cached = !postings_cache_put(env->postings_cache, token_id,
+                                        decoded, max_positions_count);
+      set_whole_postings_cursor(cur, decoded, max_positions_count);
+    }
+    return 0;
+  }
+  if (!env->skip_interval) {
+    /* 旧格式的倒排列表不带跳表，所以要一次性解码，并将其视为1个块 */
+    postings_list *decoded;
+    if ((rc = fetch_postings(env, token_id, env->enable_phrase_search,
+                             &decoded, NULL))) {
+      return rc;
+    }
+    if (decoded) {
+      set_whole_postings_cursor(cur, decoded,
+                                calc_max_positions_count(decoded));
+    }
+    return 0;
+  }
+  if (env->format == index_format_segment) {
+    /* 各段中的文档编号互不重叠，并且段是按文档编号的升序排列的 */
+    int i;
+    for (i = 0; i < env->n_segments; i++) {
+      const char *postings_e;
+      int postings_e_size;
+      if (!segment_get_postings(env->segments[i], token_id, &postings_e,
+                                &postings_e_size, NULL) &&
+          add_postings_cursor_blocks(cur, postings_e, postings_e_size)) {
+        close_postings_cursor(cur);
+        return -1;
+      }
+    }
+  } else {
+    const char *postings_e;
+    int postings_e_size;
+    rc = db_get_postings(env, token_id, NULL, (void **)&postings_e,
+                         &postings_e_size);
+    if (rc || !postings_e_size) { return rc; }
+    /* 数据库返回的数据在执行下一条语句后就会失效，所以要复制一份 */
+    if (!(cur->postings_e = malloc(postings_e_size))) {
+      print_error("cannot allocate memory for a postings cursor.");
+      return -1;
+    }
+    memcpy(cur->postings_e, postings_e, postings_e_size);
+    if (add_postings_cursor_blocks(cur, cur->postings_e, postings_e_size)) {
+      close_postings_cursor(cur);
+      return -1;
+    }
+  }
+  if (!cur->n_blocks) { return 0; }
+  if (!(cur->documents = alloc_postings_list(env->skip_interval,
+                                             env->skip_interval))) {
+    close_postings_cursor(cur);
+    return -1;
+  }
+  if (postings_cursor_seek_block(cur, 0)) {
+    close_postings_cursor(cur);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * 游标超出了要遍历的范围时，使其指向末尾
+ * @param[in,out] cur 游标
+ */
+static inline void
+limit_postings_cursor(postings_cursor *cur)
+{
+  if (cur->end_document_id && cur->document_id > cur->end_document_id) {
+    cur->document_id = 0;
+  }
+}
+
+/**
+ * 打开只遍历文档编号在指定范围内的文档的游标，并使其指向范围内的第一个文档
+ * 新的游标与base共享倒排列表（包括跳表和从缓存中借用的倒排列表），只有当前块解码后的内容是独立的，
+ * 所以可以在不同的线程中与base的其他范围的游标同时使用。在关闭新的游标之前，base必须保持打开
+ * @param[in] base 已打开的游标。须尚未移动过
+ * @param[in] from_document_id 要遍历的第一个文档的编号的下限
+ * @param[in] to_document_id 要遍历的最后一个文档的编号的上限
+ * @param[out] cur 游标
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+open_postings_cursor_range(const postings_cursor *base,
+                           int from_document_id, int to_document_id,
+                           postings_cursor *cur)
+{
+  memset(cur, 0, sizeof(postings_cursor));
+  cur->env = base->env;
+  cur->token_id = base->token_id;
+  cur->shared = TRUE;
+  cur->end_document_id = to_document_id;
+  cur->gallop = base->gallop;
+  cur->block = -1;
+  cur->max_positions_count = base->max_positions_count;
+  if (!base->document_id) { return 0; }
+  if (!base->blocks) {
+    /* 整个倒排列表已被解码，用二分查找找到范围内的第一个文档 */
+    const postings_list *pl = base->documents;
+    int low = 0, high = pl->len;
+    while (low < high) {
+      int mid = (low + high) / 2;
+      if (pl->document_ids[mid] < from_document_id) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    set_whole_postings_cursor(cur, base->documents, base->max_positions_count);
+    cur->current = low;
+    cur->document_id = low < pl->len ? pl->document_ids[low] : 0;
+  } else {
+    int block;
+    cur->blocks = base->blocks;
+    cur->n_blocks = base->n_blocks;
+    if (!(cur->documents = alloc_postings_list(cur->env->skip_interval,
+                                               cur->env->skip_interval))) {
+      return -1;
+    }
+    /* 跳过最后一个文档编号小于范围下限的块，这些块不会被解码 */
+    for (block = 0; block < cur->n_blocks &&
+         cur->blocks[block].last_document_id < from_document_id; block++) {}
+    if (postings_cursor_seek_block(cur, block)) {
+      close_postings_cursor(cur);
+      return -1;
+    }
+    postings_cursor_seek(cur, from_document_id);
+  }
+  limit_postings_cursor(cur);
+  return 0;
+}
+
+/**
+ * 按文档编号将游标所遍历的倒排列表大致均等地分割为若干个范围
+ * 带跳表的倒排列表按块分割，不会解码任何块。第i个范围是(bounds[i - 1], bounds[i]]，
+ * 第0个范围的下限为0，最后一个范围的上限为0（表示一直到末尾）
+ * @param[in] cur 尚未移动过的游标
+ * @param[in] n 范围数的上限
+ * @param[in] min_documents 整个倒排列表已被解码时，每个范围中至少要有的文档数
+ * @param[out] bounds 各个范围中最后一个文档的编号的上限。须能容纳n个元素
+ * @return 分割出的范围数。无法分割时为1
+ */
+int
+postings_cursor_split(const postings_cursor *cur, int n, int min_documents,
+                      int *bounds)
+{
+  int i, units;
+
+  if (!cur->document_id) {
+    units = 1;
+  } else if (cur->blocks) {
+    units = cur->n_blocks;
+  } else {
+    units = cur->documents->len / (min_documents > 0 ? min_documents : 1);
+  }
+  if (n > units) { n = units; }
+  if (n < 1) { n = 1; }
+  for (i = 0; i < n - 1; i++) {
+    /* 每个范围分到的块数（或文档数）之差不超过1 */
+    if (cur->blocks) {
+      bounds[i] = cur->blocks[(long long)(i + 1) * units / n - 1]
+                  .last_document_id;
+    } else {
+      bounds[i] = cur->documents->document_ids[
+                    (long long)(i + 1) * cur->documents->len / n - 1];
+    }
+  }
+  bounds[n - 1] = 0;
+  return n;
+}
+
+/**
+ * 解码游标所遍历的倒排列表中的指定块，并使游标指向该块中的第一个文档
+ * @param[in,out] cur 游标
+ * @param[in] block 块的编号
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+postings_cursor_seek_block(postings_cursor *cur, int block)
+{
+  blocked_postings bp;
+  const postings_cursor_block *b;
+
+  if (block >= cur->n_blocks) {
+    cur->block = cur->n_blocks;
+    cur->document_id = 0;
+    return 0;
+  }
+  b = &cur->blocks[block];
+  if (parse_blocked_postings(b->postings_e, b->postings_e_size, &bp)) {
+    print_error("postings list decode error");
+    return -1;
+  }
+  cur->documents->len = 0;
+  cur->documents->positions_len = 0;
+  /* 位置信息在需要时才由函数postings_cursor_positions解码 */
+  cur->positions_decoded = FALSE;
+  if (decode_postings_block_docs(cur->env, &bp, b->block, cur->documents)) {
+    print_error("postings list decode error");
+    return -1;
+  }
+  cur->block = block;
+  cur->current = 0;
+  cur->document_id = cur->documents->document_ids[0];
+  cur->block_max_positions_count = b->max_positions_count;
+  limit_postings_cursor(cur);
+  return 0;
+}
+
+/**
+ * 使游标指向下一个文档
+ * @param[in,out] cur 游标
+ * @return 下一个文档的编号。已到达末尾时为0
+ */
+int
+postings_cursor_next(postings_cursor *cur)
+{
+  if (!cur->document_id) { return 0; }
+  if (++cur->current < cur->documents->len) {
+    cur->document_id = cur->documents->document_ids[cur->current];
+    limit_postings_cursor(cur);
+  } else if (!cur->blocks ||
+             postings_cursor_seek_block(cur, cur->block + 1)) {
+    cur->document_id = 0;
+  }
+  return cur->document_id;
+}
+
+/**
+ * 用指数查找（galloping）找到最后一个文档编号不小于指定编号的第一个块
+ * 先以1, 2, 4, ...的步长向后跳跃，越过目标后再在最后一步的范围内进行二分查找
+ * @param[in] cur 游标
+ * @param[in] from 开始查找的块的编号
+ * @param[in] document_id 文档编号
+ * @return 块的编号。没有这样的块时为块数
+ */
+static int
+gallop_postings_blocks(const postings_cursor *cur, int from, int document_id)
+{
+  int low = from, high = from, step = 1;
+
+  while (high < cur->n_blocks &&
+         cur->blocks[high].last_document_id < document_id) {
+    low = high + 1;
+    high += step;
+    step *= 2;
+  }
+  if (high > cur->n_blocks) { high = cur->n_blocks; }
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (cur->blocks[mid].last_document_id < document_id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/**
+ * 用指数查找（galloping）找到文档编号不小于指定编号的第一个文档
+ * @param[in] document_ids 按升序排列的文档编号的数组
+ * @param[in] from 开始查找的下标
+ * @param[in] len 数组的元素数
+ * @param[in] document_id 文档编号
+ * @return 下标。没有这样的文档时为len
+ */
+static int
+gallop_document_ids(const int *document_ids, int from, int len,
+                    int document_id)
+{
+  int low = from, high = from, step = 1;
+
+  while (high < len && document_ids[high] < document_id) {
+    low = high + 1;
+    high += step;
+    step *= 2;
+  }
+  if (high > len) { high = len; }
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (document_ids[mid] < document_id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/**
+ * 使游标指向文档编号不小于指定编号的第一个文档
+ * 利用跳表跳过最后一个文档编号小于指定编号的块，这些块不会被解码。
+ * cur->gallop为真时，在跳表和块中都用指数查找代替顺序查找
+ * @param[in,out] cur 游标
+ * @param[in] document_id 文档编号
+ * @return 游标指向的文档的编号。已到达末尾时为0
+ */
+int
+postings_cursor_seek(postings_cursor *cur, int document_id)
+{
+  if (!cur->document_id || cur->document_id >= document_id) {
+    return cur->document_id;
+  }
+  if (cur->blocks && cur->blocks[cur->block].last_document_id < document_id) {
+    int block;
+    if (cur->gallop) {
+      block = gallop_postings_blocks(cur, cur->block + 1, document_id);
+    } else {
+      for (block = cur->block + 1;
+           block < cur->n_blocks &&
+           cur->blocks[block].last_document_id < document_id;
+           block++) {}
+    }
+    if (postings_cursor_seek_block(cur, block)) {
+      cur->document_id = 0;
+    }
+    if (!cur->document_id) { return 0; }
+  }
+  if (cur->gallop) {
+    /* 此时当前块中一定有这样的文档，或者已是最后一个块 */
+    const postings_list *pl = cur->documents;
+    cur->current = gallop_document_ids(pl->document_ids, cur->current,
+                                       pl->len, document_id);
+    if (cur->current < pl->len) {
+      cur->document_id = pl->document_ids[cur->current];
+      limit_postings_cursor(cur);
+    } else {
+      cur->document_id = 0;
+    }
+    return cur->document_id;
+  }
+  while (cur->document_id < document_id) {
+    if (!postings_cursor_next(cur)) { break; }
+  }
+  return cur->document_id;
+}
+
+/**
+ * 使游标指向当前位置以后第一个出现次数不小于指定值的文档
+ * 利用跳表跳过出现次数的最大值小于指定值的块，这些块不会被解码
+ * @param[in,out] cur 游标
+ * @param[in] min_positions_count 出现次数的下限
+ * @return 游标指向的文档的编号。已到达末尾时为0
+ */
+int
+postings_cursor_seek_positions_count(postings_cursor *cur,
+                                     int min_positions_count)
+{
+  while (cur->document_id) {
+    int block;
+    const postings_list *pl = cur->documents;
+    if (cur->block_max_positions_count >= min_positions_count) {
+      for (; cur->current < pl->len; cur->current++) {
+        if (POSTINGS_POSITIONS_COUNT(pl, cur->current) >=
+            min_positions_count) {
+          cur->document_id = pl->document_ids[cur->current];
+          limit_postings_cursor(cur);
+          return cur->document_id;
+        }
+      }
+    }
+    /* 当前块中已没有满足条件的文档 */
+    if (!cur->blocks) {
+      cur->document_id = 0;
+      break;
+    }
+    for (block = cur->block + 1;
+         block < cur->n_blocks &&
+         cur->blocks[block].max_positions_count < min_positions_count;
+         block++) {}
+    if (postings_cursor_seek_block(cur, block)) {
+      cur->document_id = 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * 在不解码的前提下，获取可能包含指定文档的块中出现次数的最大值
+ * @param[in] cur 游标
+ * @param[in] document_id 文档编号。不得小于游标当前指向的文档的编号
+ * @return 出现次数的最大值。倒排列表中已没有该文档时为0
+ */
+int
+postings_cursor_block_max(const postings_cursor *cur, int document_id)
+{
+  int block;
+
+  if (!cur->document_id ||
+      (cur->end_document_id && document_id > cur->end_document_id)) {
+    return 0;
+  }
+  if (!cur->blocks) {
+    return cur->documents->document_ids[cur->documents->len - 1] <
+           document_id ? 0 : cur->max_positions_count;
+  }
+  for (block = cur->block;
+       block < cur->n_blocks &&
+       cur->blocks[block].last_document_id < document_id;
+       block++) {}
+  return block < cur->n_blocks ? cur->blocks[block].max_positions_count : 0;
+}
+
+/**
+ * 获取游标当前指向的文档中词元的出现次数。不需要解码位置信息
+ * @param[in] cur 游标
+ * @return 出现次数
+ */
+int
+postings_cursor_positions_count(const postings_cursor *cur)
+{
+  return POSTINGS_POSITIONS_COUNT(cur->documents, cur->current);
+}
+
+/**
+ * 获取游标当前指向的文档中词元的位置信息
+ * 当前块的位置信息流在第一次调用该函数时才被解码，所以只有通过了求交集的候选文档所在的块
+ * 才需要付出解码位置信息的代价
+ * @param[in,out] cur 游标
+ * @param[out] positions_count 位置信息的条数
+ * @return 位置信息的数组。解码失败时为NULL，并且条数为0
+ */
+const int *
+postings_cursor_positions(postings_cursor *cur, int *positions_count)
+{
+  if (!cur->positions_decoded) {
+    blocked_postings bp;
+    const postings_cursor_block *b = &cur->blocks[cur->block];
+    if (parse_blocked_postings(b->postings_e, b->postings_e_size, &bp) ||
+        decode_postings_block_positions(cur->env, &bp, b->block,
+                                        cur->documents, 0)) {
+      print_error("postings list decode error");
+      if (positions_count) { *positions_count = 0; }
+      return NULL;
+    }
+    cur->positions_decoded = TRUE;
+  }
+  if (positions_count) {
+    *positions_count = POSTINGS_POSITIONS_COUNT(cur->documents,
+                                                cur->current);
+  }
+  return POSTINGS_POSITIONS(cur->documents, cur->current);
+}
+
+/**
+ * 关闭游标
+ * @param[in] cur 游标
+ */
+void
+close_postings_cursor(postings_cursor *cur)
+{
+  if (cur->shared) {
+    /* 只释放当前块解码后的内容 */
+    if (cur->blocks && cur->documents) { free_postings_list(cur->documents); }
+  } else if (cur->cached) {
+    postings_cache_release(cur->env->postings_cache, cur->token_id);
+  } else if (cur->documents) {
+    free_postings_list(cur->documents);
+  }
+  if (cur->blocks && !cur->shared) { free(cur->blocks); }
+  if (cur->postings_e) { free(cur->postings_e); }
+  memset(cur, 0, sizeof(postings_cursor));
+}
+
+/**
+ * 获取将两个倒排列表合并后得到的倒排列表
+ * @param[in] pa 要合并的倒排列表
+ * @param[in] pb 要合并的倒排列表
+ *
+ * @return 合并后的倒排列表
+ *
+ * @attention 若base和to_be_added（参见函数merge_inverted_index）中的任意一个被破坏了，
+ *            或者二者中含有相同的文档编号，则该函数的行为不可预知
+ */
+static postings_list *
+merge_postings(postings_list *pa, postings_list *pb)  //接收两个内存上的倒排列表作为参数
+{
+  int ia = 0, ib = 0;
+  postings_list *ret;  //返回将其合并后的倒排列表。我们使用变量 ret 来管理合并后的倒排列表
+
+  if (!pa || !pa->len) {
+    if (pa) { free_postings_list(pa); }
+    return pb;
+  }
+  if (!pb || !pb->len) {
+    if (pb) { free_postings_list(pb); }
+    return pa;
+  }
+  /* 一方的文档编号全部小于另一方时（构建索引时总是如此），直接追加到其末尾即可 */
+  if (pa->document_ids[pa->len - 1] < pb->document_ids[0]) {
+    if (append_postings_documents(pa, pb, 0, pb->len)) { abort(); }
+    free_postings_list(pb);
+    return pa;
+  }
+  if (pb->document_ids[pb->len - 1] < pa->document_ids[0]) {
+    if (append_postings_documents(pb, pa, 0, pa->len)) { abort(); }
+    free_postings_list(pa);
+    return pb;
+  }
+  /* 合并后的倒排列表从pa的内存池中分配，以便与pa一起释放 */
+  if (!(ret = arena_alloc_postings_list(pa->arena, pa->len + pb->len,
+                                        pa->positions_len +
+                                        pb->positions_len))) {
+    abort();
+  }
+  /* 用ia和ib分别遍历base和to_be_added（参见函数merge_inverted_index）中的倒排列表中的元素， */
+  /* 将二者连接成按文档编号升序排列的数组 */
+  while (ia < pa->len || ib < pb->len) {
+    if (ib == pb->len ||
+        (ia < pa->len && pa->document_ids[ia] <= pb->document_ids[ib])) {  //如果 pa 所指向的文档编号小于 pb 所指向的文档编号
+      append_postings_documents(ret, pa, ia, ia + 1);  //将 pa 所指向的元素添加到合并后的倒排列表中
+      ia++;  //并让 pa 指向下一个元素
+    } else {  //如果 pb 所指向的文档编号小于 pa 所指向的文档编号
+      append_postings_documents(ret, pb, ib, ib + 1);  //将 pb 所指向的元素添加到合并后的倒排列表中
+      ib++;  //让 pb 指向下一个元素
+    }
+  }
+  free_postings_list(pa);
+  free_postings_list(pb);
+  return ret;
+}
+
+/**
+ * 将内存上（小倒排索引中）的倒排列表与存储器上的倒排列表合并后存储到数据库中
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] p 含有倒排列表的倒排索引中的索引项
+ */
+void
 update_postings(const wiser_env *env, inverted_index_value *p)
 {
   int old_postings_len;
   postings_list *old_postings;
 
-  if (!fetch_postings(env, p->token_id, &old_postings,
+  if (!fetch_postings(env, p->token_id, TRUE, &old_postings,
                       &old_postings_len)) {  //从存储器中取出了作为合并源的倒排列表,如果存储器中存在作为合并源的倒排列表
     buffer *buf;
     if (old_postings_len) {
@@ -468,13 +2021,14 @@ merge_inverted_index(inverted_index_hash *base,
   HASH_ITER(hh, to_be_added, p, temp) {  //先将存储在作为合并源的倒排索引中的所有倒排列表逐一取出,存到临时变量里
     inverted_index_value *t;
     HASH_DEL(to_be_added, p);  //再将刚刚取出的倒排列表从作为合并源的关联数组中删除
-    HASH_FIND_INT(base, &p->token_id, t);  //用刚取出的倒排列表所对应的词元,到合并目标中去查找与该词元对应的倒排列表
+    HASH_FIND_TOKEN(base, &p->token_code, t);  //用刚取出的倒排列表所对应的词元,到合并目标中去查找与该词元对应的倒排列表
     if (t) {  //如果合并目标中存在相应的倒排列表
       t->postings_list = merge_postings(t->postings_list, p->postings_list);  //将合并源和合并目标中的元素所带有的倒排列表合并在一起
       t->docs_count += p->docs_count;  //并将出现过该词元的文档数相加
-      free(p);
+      t->positions_count += p->positions_count;
+      if (!p->arena) { free(p); }
     } else {  //如果合并目标中没有相应的倒排列表
-      HASH_ADD_INT(base, token_id, p);  //将获取的合并源中的倒排列表直接添加到作为合并目标的关联数组中
+      HASH_ADD_TOKEN(base, p);  //将获取的合并源中的倒排列表直接添加到作为合并目标的关联数组中
     }
   }
 }
@@ -486,14 +2040,12 @@ merge_inverted_index(inverted_index_hash *base,
 void
 dump_postings_list(const postings_list *postings)
 {
-  const postings_list *pl;
-  LL_FOREACH(postings, pl) {
-    printf("doc_id %d (", pl->document_id);
-    if (pl->positions) {
-      const int *p = NULL;
-      while ((p = (const int *)utarray_next(pl->positions, p))) {
-        printf("%d ", *p);
-      }
+  int i, j;
+  for (i = 0; postings && i < postings->len; i++) {
+    const int *p = POSTINGS_POSITIONS(postings, i);
+    printf("doc_id %d (", postings->document_ids[i]);
+    for (j = 0; j < POSTINGS_POSITIONS_COUNT(postings, i); j++) {
+      printf("%d ", p[j]);
     }
     printf(")\n");
   }
@@ -501,19 +2053,17 @@ dump_postings_list(const postings_list *postings)
 
 /**
  * 释放倒排列表
- * @param[in] pl 待释放的倒排列表中的首元素
+ * @param[in] pl 待释放的倒排列表
  */
 void
 free_postings_list(postings_list *pl)
 {
-  postings_list *a, *a2;
-  LL_FOREACH_SAFE(pl, a, a2) {
-    if (a->positions) {
-      utarray_free(a->positions);
-    }
-    LL_DELETE(pl, a);
-    free(a);
-  }
+  /* 从内存池中分配的倒排列表在重置内存池时一次性释放 */
+  if (pl->arena) { return; }
+  free(pl->document_ids);
+  free(pl->positions_offsets);
+  free(pl->positions);
+  free(pl);
 }
 
 /**
@@ -543,6 +2093,81 @@ dump_inverted_index(wiser_env *env, inverted_index_hash *ii)
   }
 }
 
+/**
+ * 从倒排列表中删除第i个文档及其位置信息
+ * @param[in,out] pl 倒排列表
+ * @param[in] i 要删除的文档的下标
+ */
+static void
+remove_postings_document(postings_list *pl, int i)
+{
+  int j, positions_count = POSTINGS_POSITIONS_COUNT(pl, i);
+
+  memmove(pl->document_ids + i, pl->document_ids + i + 1,
+          sizeof(int) * (pl->len - i - 1));
+  memmove(pl->positions + pl->positions_offsets[i],
+          pl->positions + pl->positions_offsets[i + 1],
+          sizeof(int) * (pl->positions_len - pl->positions_offsets[i + 1]));
+  for (j = i; j < pl->len; j++) {
+    pl->positions_offsets[j] = pl->positions_offsets[j + 1] - positions_count;
+  }
+  pl->len--;
+  pl->positions_len -= positions_count;
+}
+
+/**
+ * 从倒排索引中删除指定文档的所有倒排项。不再包含任何文档的索引项也一并删除
+ * 用于在写出缓冲区之前替换同一标题的文档
+ * @param[in,out] ii 倒排索引
+ * @param[in] document_id 要删除的文档的编号
+ */
+void
+remove_inverted_index_document(inverted_index_hash **ii, int document_id)
+{
+  inverted_index_value *p, *temp;
+
+  HASH_ITER(hh, *ii, p, temp) {
+    postings_list *pl = p->postings_list;
+    int lo = 0, hi = pl->len;
+
+    /* 倒排列表按文档编号的升序排列，用二分查找定位该文档 */
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (pl->document_ids[mid] < document_id) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo == pl->len || pl->document_ids[lo] != document_id) { continue; }
+    p->docs_count--;
+    p->positions_count -= POSTINGS_POSITIONS_COUNT(pl, lo);
+    remove_postings_document(pl, lo);
+    if (!pl->len) {
+      HASH_DEL(*ii, p);
+      free_postings_list(pl);
+      if (!p->arena) { free(p); }
+    }
+  }
+}
+
+/**
+ * 获取倒排索引中所有词元的出现次数之和
+ * @param[in] ii 倒排索引
+ * @return 出现次数之和
+ */
+long long
+inverted_index_positions_count(const inverted_index_hash *ii)
+{
+  long long count = 0;
+  const inverted_index_value *p;
+
+  for (p = ii; p; p = p->hh.next) {
+    count += p->positions_count;
+  }
+  return count;
+}
+
 /**
  * 释放倒排索引
  * @param[in] ii 指向倒排索引的指针
@@ -557,6 +2182,6 @@ free_inverted_index(inverted_index_hash *ii)
     if (cur->postings_list) {
       free_postings_list(cur->postings_list);
     }
-    free(cur);
+    if (!cur->arena) { free(cur); }
   }
 }
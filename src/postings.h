@@ -1,16 +1,85 @@
 #ifndef __POSTINGS_H__
 #define __POSTINGS_H__
 
+#include "util.h"
 #include "wiser.h"
 
+postings_list *alloc_postings_list(int capacity, int positions_capacity);
+postings_list *arena_alloc_postings_list(arena *a, int capacity,
+                                         int positions_capacity);
+size_t postings_list_size(const postings_list *pl);
+int append_postings_document(postings_list *pl, int document_id,
+                             const int *positions, int positions_count);
+int add_postings_position(postings_list *pl, int document_id, int position);
+
+/* 游标要遍历的1个块 */
+typedef struct {
+  const char *postings_e;   /* 块所属的带跳表的倒排列表 */
+  int postings_e_size;      /* 该倒排列表的字节数 */
+  int block;                /* 块在该倒排列表中的编号 */
+  int last_document_id;     /* 块中最后一个文档的编号 */
+  int max_positions_count;  /* 块中各文档的出现次数的最大值 */
+} postings_cursor_block;
+
+/* 遍历倒排列表的游标 */
+typedef struct {
+  const wiser_env *env;     /* 存储着应用程序运行环境的结构体 */
+  int token_id;             /* 词元编号 */
+  int cached;               /* documents是否是从缓存中借用的 */
+  int shared;               /* 是否与其他游标共享倒排列表。为真时不释放倒排列表和blocks */
+  int end_document_id;      /* 要遍历的最后一个文档的编号。为0时遍历到末尾 */
+  int gallop;               /* seek时是否用指数查找（galloping）代替顺序查找 */
+  char *postings_e;         /* 从数据库中复制的带跳表的倒排列表。没有复制时为NULL */
+  postings_cursor_block *blocks; /* 各个块。将整个倒排列表视为1个块时为NULL */
+  int n_blocks;             /* 块数 */
+  int block;                /* 当前块的编号 */
+  postings_list *documents; /* 当前块解码后的内容。旧格式或使用缓存时为整个倒排列表 */
+  int current;              /* 当前文档在documents中的下标 */
+  int document_id;          /* 当前文档的编号。为0时表示已到达末尾 */
+  int max_positions_count;  /* 整个倒排列表中各文档的出现次数的最大值 */
+  int block_max_positions_count; /* 当前块中各文档的出现次数的最大值 */
+  int positions_decoded;    /* 当前块的位置信息是否已解码 */
+} postings_cursor;
+
+int decode_postings(const wiser_env *env,
+                    const char *postings_e, int postings_e_size,
+                    int with_positions,
+                    postings_list **postings, int *postings_len);
+int encode_postings(const wiser_env *env,
+                    const postings_list *postings, const int postings_len,
+                    buffer *postings_e);
+int concat_encoded_postings(const wiser_env *env, int documents_count,
+                            const char *const *postings_e,
+                            const int *postings_e_size, int n,
+                            buffer *out, int *docs_count);
 int fetch_postings(const wiser_env *env, const int token_id,
+                   int with_positions,
                    postings_list **postings, int *postings_len);
+int open_postings_cursor(const wiser_env *env, const int token_id,
+                         postings_cursor *cur);
+int open_postings_cursor_range(const postings_cursor *base,
+                               int from_document_id, int to_document_id,
+                               postings_cursor *cur);
+int postings_cursor_split(const postings_cursor *cur, int n,
+                          int min_documents, int *bounds);
+int postings_cursor_next(postings_cursor *cur);
+int postings_cursor_seek(postings_cursor *cur, int document_id);
+int postings_cursor_seek_positions_count(postings_cursor *cur,
+                                         int min_positions_count);
+int postings_cursor_block_max(const postings_cursor *cur, int document_id);
+int postings_cursor_positions_count(const postings_cursor *cur);
+const int *postings_cursor_positions(postings_cursor *cur,
+                                     int *positions_count);
+void close_postings_cursor(postings_cursor *cur);
 void merge_inverted_index(inverted_index_hash *base,
                           inverted_index_hash *to_be_added);
+void remove_inverted_index_document(inverted_index_hash **ii,
+                                    int document_id);
 void update_postings(const wiser_env *env, inverted_index_hash *p);
 void dump_postings_list(const postings_list *postings);
 void free_postings_list(postings_list *pl);
 void dump_inverted_index(wiser_env *env, inverted_index_hash *ii);
+long long inverted_index_positions_count(const inverted_index_hash *ii);
 void free_inverted_index(inverted_index_hash *ii);
 
 #endif /* __POSTINGS_H__ */
@@ -1,5 +1,6 @@
 #include <math.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "util.h"
 #include "token.h"
@@ -11,15 +12,14 @@ typedef inverted_index_hash query_token_hash;
 typedef inverted_index_value query_token_value;
 typedef postings_list token_positions_list;
 
-typedef struct {
-  token_positions_list *documents; /* 文档编号的序列 */
-  token_positions_list *current;   /* 当前的文档编号 */
-} doc_search_cursor;
+typedef postings_cursor doc_search_cursor;
 
+/* 短语检索的游标。查询中每个词元的每次出现各对应1个 */
 typedef struct {
-  const UT_array *positions; /* 位置信息 */
+  int token;                 /* 该词元的文档检索游标的下标 */
   int base;                  /* 词元在查询中的位置 */
-  int *current;              /* 当前的位置信息 */
+  const int *current;        /* 当前文档中当前的位置信息 */
+  const int *positions_end;  /* 当前文档中位置信息的结尾 */
 } phrase_search_cursor;
 
 typedef struct {
@@ -28,17 +28,68 @@ typedef struct {
   UT_hash_handle hh;         /* 用于将该结构体转化为哈希表 */
 } search_results;
 
+/* 得分最高的前K个文档。以得分最低的文档为根的二叉堆 */
+typedef struct {
+  int document_id;           /* 文档编号 */
+  double score;              /* 检索得分 */
+} scored_document;
+
+typedef struct {
+  scored_document *docs;     /* 堆中的文档 */
+  int len;                   /* 堆中的文档数 */
+  int capacity;              /* 堆中最多可容纳的文档数（K） */
+} top_k_heap;
+
+/* 查询计划中求倒排列表的交集的方法 */
+typedef enum {
+  intersect_drive,  /* 驱动检索的循环的倒排列表（词元A）。逐个遍历其中的文档 */
+  intersect_merge,  /* 与候选文档像归并一样顺序地比较 */
+  intersect_gallop  /* 对每个候选文档用指数查找（galloping）跳过中间的文档 */
+} intersect_method;
+
+/* 查询计划中每次指数查找的比较次数相对于顺序比较1次的代价 */
+#define GALLOP_COMPARE_COST 2.0
+
+/* 查询中词元的1次出现。用于选择覆盖查询的词元 */
+typedef struct {
+  int position;              /* 词元在查询中的位置 */
+  query_token_value *token;  /* 词元 */
+  int count;                 /* 覆盖到该出现为止所选择的出现次数的最小值 */
+  long long docs_count;      /* 此时所选择的词元的文档数之和 */
+  int prev;                  /* 此时上一个被选择的出现的下标。没有时为-1 */
+} query_token_occurrence;
+
+/* 并行检索时，整个倒排列表已被解码的词元A的每个分片中至少要有的文档数 */
+#define SEARCH_SHARD_MIN_DOCUMENTS 128
+
+/* 检索的1个分片（文档编号的范围）及其检索结果 */
+typedef struct {
+  const wiser_env *env;           /* 存储着应用程序运行环境的结构体 */
+  const query_token_hash *tokens; /* 从查询中提取出的词元信息 */
+  int n_tokens;                   /* 查询中的词元数 */
+  doc_search_cursor *cursors;     /* 只遍历该分片的游标的集合 */
+  int n_open_cursors;             /* 已打开的游标数。其余的游标在第一次需要时才打开 */
+  const intersect_method *methods; /* 各倒排列表的求交集方法 */
+  const double *idfs;             /* 各词元的IDF。不需要剪枝时为NULL */
+  top_k_heap heap;                /* 该分片中得分最高的前K个文档 */
+  search_results *results;        /* 不使用堆时的检索结果 */
+  int n_hits;                     /* 检索出的文档数 */
+  int pruned;                     /* 是否跳过了文档 */
+  pthread_t thread;               /* 检索该分片的线程 */
+  int started;                    /* 是否启动了线程 */
+} search_shard;
+
 /**
- * 比较出现过词元a和词元b的文档数
+ * 比较出现过词元a和词元b的文档数。用于按文档频率的升序排列词元
  * @param[in] a 词元a的数据
  * @param[in] b 词元b的数据
  * @return 文档数的大小关系
  */
 static int
-query_token_value_docs_count_desc_sort(query_token_value *a,
-                                       query_token_value *b)
+query_token_value_docs_count_asc_sort(query_token_value *a,
+                                      query_token_value *b)
 {
-  return b->docs_count - a->docs_count;
+  return a->docs_count - b->docs_count;
 }
 
 /**
@@ -82,77 +133,203 @@ add_search_result(search_results **results, const int document_id,
 }
 
 /**
- * 进行短语检索
- * @param[in] query_tokens 从查询中提取出的词元信息
- * @param[in] doc_cursors 用于检索文档的游标的集合
- * @return 检索出的短语数
+ * 判断文档a的排名是否低于文档b
+ * 得分相同时，文档编号较大的文档排名较低
+ * @param[in] a 文档a
+ * @param[in] b 文档b
+ * @return 文档a的排名低于文档b时为真
+ */
+static inline int
+scored_document_worse(const scored_document *a, const scored_document *b)
+{
+  return a->score < b->score ||
+         (a->score == b->score && a->document_id > b->document_id);
+}
+
+/**
+ * 根据排名比较两个文档。用于qsort
+ * @param[in] a 文档a
+ * @param[in] b 文档b
+ * @return 排名的先后关系
  */
 static int
-search_phrase(const query_token_hash *query_tokens,
-              doc_search_cursor *doc_cursors)
+scored_document_rank_sort(const void *a, const void *b)
+{
+  return scored_document_worse(a, b) ? 1 :
+         scored_document_worse(b, a) ? -1 : 0;
+}
+
+/**
+ * 将文档添加到前K个文档的堆中。堆已满时替换掉排名最低的文档
+ * @param[in,out] heap 前K个文档的堆
+ * @param[in] document_id 文档编号
+ * @param[in] score 得分
+ */
+static void
+push_top_k(top_k_heap *heap, const int document_id, const double score)
+{
+  int i, child;
+  scored_document d, *docs = heap->docs;
+
+  d.document_id = document_id;
+  d.score = score;
+  if (heap->len < heap->capacity) {
+    /* 从末尾开始向上调整 */
+    for (i = heap->len++; i; i = (i - 1) / 2) {
+      if (!scored_document_worse(&d, &docs[(i - 1) / 2])) { break; }
+      docs[i] = docs[(i - 1) / 2];
+    }
+    docs[i] = d;
+    return;
+  }
+  if (!scored_document_worse(&docs[0], &d)) { return; }
+  /* 替换根节点，然后从根节点开始向下调整 */
+  for (i = 0; (child = i * 2 + 1) < heap->len; i = child) {
+    if (child + 1 < heap->len &&
+        scored_document_worse(&docs[child + 1], &docs[child])) {
+      child++;
+    }
+    if (!scored_document_worse(&docs[child], &d)) { break; }
+    docs[i] = docs[child];
+  }
+  docs[i] = d;
+}
+
+/**
+ * 将前K个文档按排名顺序添加到检索结果中
+ * @param[in,out] heap 前K个文档的堆。调用后堆中的顺序被打乱
+ * @param[in,out] results 检索结果
+ */
+static void
+top_k_to_results(top_k_heap *heap, search_results **results)
 {
-  int n_positions = 0;
+  int i;
+
+  qsort(heap->docs, heap->len, sizeof(scored_document),
+        scored_document_rank_sort);
+  for (i = 0; i < heap->len; i++) {
+    add_search_result(results, heap->docs[i].document_id,
+                      heap->docs[i].score);
+  }
+}
+
+/**
+ * 为查询中每个词元的每次出现分配短语检索的游标，并设定其在查询中的位置
+ * 游标在检索各文档时重复使用，只需分配1次
+ * @param[in] query_tokens 从查询中提取出的词元信息
+ * @param[out] n_cursors 游标的个数
+ * @return 游标的数组。失败时为NULL
+ */
+static phrase_search_cursor *
+alloc_phrase_cursors(const query_token_hash *query_tokens, int *n_cursors)
+{
+  int i, n = 0;
   const query_token_value *qt;
-  phrase_search_cursor *cursors;
+  phrase_search_cursor *cursors, *cur;
 
   /* 获取查询中词元的总数 */
   for (qt = query_tokens; qt; qt = qt->hh.next) {
-    n_positions += qt->positions_count;
+    n += qt->positions_count;
+  }
+  if (!(cursors = malloc(sizeof(phrase_search_cursor) * n))) {
+    print_error("cannot allocate memory for phrase search.");
+    return NULL;
+  }
+  for (i = 0, cur = cursors, qt = query_tokens; qt; i++, qt = qt->hh.next) {
+    int j;
+    for (j = 0; j < qt->postings_list->positions_len; j++, cur++) {
+      cur->token = i;
+      cur->base = qt->postings_list->positions[j];
+    }
+  }
+  *n_cursors = n;
+  return cursors;
+}
+
+/**
+ * 用指数查找（galloping）找到不小于指定值的第一个位置信息
+ * @param[in] p 开始查找的位置信息
+ * @param[in] end 位置信息的结尾
+ * @param[in] position 位置
+ * @return 找到的位置信息。没有这样的位置信息时为end
+ */
+static inline const int *
+gallop_positions(const int *p, const int *end, int position)
+{
+  int step = 1;
+  const int *high = p;
+
+  while (high < end && *high < position) {
+    p = high + 1;
+    high += step;
+    step *= 2;
+  }
+  if (high > end) { high = end; }
+  while (p < high) {
+    const int *mid = p + (high - p) / 2;
+    if (*mid < position) {
+      p = mid + 1;
+    } else {
+      high = mid;
+    }
   }
+  return p;
+}
+
+/**
+ * 进行短语检索
+ * 以当前文档中出现次数最少的词元为基准，按出现次数从少到多的顺序检查其他词元，
+ * 并用指数查找跳过位置信息
+ * @param[in,out] cursors 由函数alloc_phrase_cursors分配的短语检索的游标。顺序会被改变
+ * @param[in] n_cursors 游标的个数
+ * @param[in] doc_cursors 用于检索文档的游标的集合
+ * @param[in] max_count 找到这么多个短语后就停止检索。为0时统计所有的短语
+ * @return 检索出的短语数
+ */
+static int
+search_phrase(phrase_search_cursor *cursors, int n_cursors,
+              doc_search_cursor *doc_cursors, int max_count)
+{
+  int i, phrase_count = 0;
+  phrase_search_cursor *anchor = &cursors[0];
 
-  if ((cursors = (phrase_search_cursor *)malloc(sizeof(
-                   phrase_search_cursor) * n_positions))) {
-    int i, phrase_count = 0;
+  /* 将游标指向当前文档的位置信息，并按位置信息的条数的升序排列（插入排序） */
+  for (i = 0; i < n_cursors; i++) {
+    int j, positions_count;
+    phrase_search_cursor cur = cursors[i];
+    cur.current = postings_cursor_positions(&doc_cursors[cur.token],
+                                            &positions_count);
+    if (!positions_count) { return 0; }
+    cur.positions_end = cur.current + positions_count;
+    for (j = i; j > 0 && cursors[j - 1].positions_end -
+                         cursors[j - 1].current > positions_count; j--) {
+      cursors[j] = cursors[j - 1];
+    }
+    cursors[j] = cur;
+  }
+  while (anchor->current < anchor->positions_end) {
     phrase_search_cursor *cur;
-    /* 初始化游标 */
-    for (i = 0, cur = cursors, qt = query_tokens; qt;
-         i++, qt = qt->hh.next) {
-      int *pos = NULL;
-      while ((pos = (int *)utarray_next(qt->postings_list->positions,
-                                        pos))) {
-        cur->base = *pos;
-        cur->positions = doc_cursors[i].current->positions;
-        cur->current = (int *)utarray_front(cur->positions);
-        cur++;
-      }
+    int rel_position = *anchor->current - anchor->base;
+    /* 对于其他词元，跳到偏移量不小于基准词元的偏移量的位置，并检查偏移量是否相等 */
+    for (cur = cursors + 1, i = 1; i < n_cursors; cur++, i++) {
+      cur->current = gallop_positions(cur->current, cur->positions_end,
+                                      rel_position + cur->base);
+      if (cur->current == cur->positions_end) { return phrase_count; }
+      if (*cur->current - cur->base != rel_position) { break; }
     }
-    /* 检索短语 */
-    while (cursors[0].current) {
-      int rel_position, next_rel_position;
-      rel_position = next_rel_position = *cursors[0].current -
-                                         cursors[0].base;
-      /* 对于除词元A以外的词元，不断地向后读取其出现位置，直到其偏移量不小于词元A的偏移量为止 */
-      for (cur = cursors + 1, i = 1; i < n_positions; cur++, i++) {
-        for (; cur->current
-             && (*cur->current - cur->base) < rel_position;
-             cur->current = (int *)utarray_next(cur->positions, cur->current)) {}
-        if (!cur->current) { goto exit; }
-
-        /* 对于除词元A以外的词元，若其偏移量不等于A的偏移量，就退出循环 */
-        if ((*cur->current - cur->base) != rel_position) {
-          next_rel_position = *cur->current - cur->base;
-          break;
-        }
-      }
-      if (next_rel_position > rel_position) {
-        /* 不断向后读取，直到词元A的偏移量不小于next_rel_position为止 */
-        while (cursors[0].current &&
-               (*cursors[0].current - cursors[0].base) < next_rel_position) {
-          cursors[0].current = (int *)utarray_next(
-                                 cursors[0].positions, cursors[0].current);
-        }
-      } else {
-        /* 找到了短语 */
-        phrase_count++;
-        cursors->current = (int *)utarray_next(
-                             cursors->positions, cursors->current);
-      }
+    if (i < n_cursors) {
+      /* 将基准词元跳到偏移量不小于该词元的偏移量的位置 */
+      anchor->current = gallop_positions(anchor->current,
+                                         anchor->positions_end,
+                                         *cur->current - cur->base +
+                                         anchor->base);
+    } else {
+      /* 找到了短语 */
+      if (++phrase_count == max_count) { break; }
+      anchor->current++;
     }
-exit:
-    free(cursors);
-    return phrase_count;
   }
-  return 0;
+  return phrase_count;
 }
 
 /**
@@ -177,38 +354,508 @@ calc_tf_idf(
        i < n_query_tokens;
        qt = qt->hh.next, dcur++, i++) {
     double idf = log2((double)indexed_count / qt->docs_count);
-    score += (double)dcur->current->positions_count * idf;
+    score += (double)postings_cursor_positions_count(dcur) * idf;
   }
   return score;
 }
 
 /**
- * 释放词元的出现位置列表
- * @param[in] pl 待释放的出现位置列表的首元素
+ * 根据各词元出现次数的上限计算得分的上限
+ * 与函数calc_tf_idf按相同的顺序累加，以保证出现次数不超过上限时得分也不超过该值
+ * @param[in] idfs 各词元的IDF
+ * @param[in] bounds 各词元出现次数的上限
+ * @param[in] n_query_tokens 查询中的词元数
+ * @return 得分的上限
  */
-void
-free_token_positions_list(token_positions_list *list)
+static double
+calc_score_upper_bound(const double *idfs, const int *bounds,
+                       const int n_query_tokens)
+{
+  int i;
+  double score = 0;
+  for (i = 0; i < n_query_tokens; i++) {
+    score += (double)bounds[i] * idfs[i];
+  }
+  return score;
+}
+
+/**
+ * 计算要使得分超过阈值，词元A（第1个词元）至少要出现多少次
+ * 其他词元的出现次数按整个倒排列表中的最大值计算
+ * @param[in] idfs 各词元的IDF
+ * @param[in] cursors 用于检索文档的游标的集合
+ * @param[in,out] bounds 计算时使用的作业区
+ * @param[in] n_query_tokens 查询中的词元数
+ * @param[in] threshold 得分的阈值
+ * @return 出现次数的下限。无论出现多少次都无法超过阈值时为0
+ */
+static int
+calc_min_positions_count(const double *idfs, const doc_search_cursor *cursors,
+                         int *bounds, const int n_query_tokens,
+                         const double threshold)
+{
+  int i;
+  for (i = 1; i < n_query_tokens; i++) {
+    bounds[i] = cursors[i].max_positions_count;
+  }
+  for (bounds[0] = 1; bounds[0] <= cursors[0].max_positions_count;
+       bounds[0]++) {
+    if (calc_score_upper_bound(idfs, bounds, n_query_tokens) > threshold) {
+      return bounds[0];
+    }
+  }
+  return 0;
+}
+
+/**
+ * 打开分片中尚未打开的游标，直到打开了指定个数的游标为止，并设定查询计划中的求交集方法
+ * @param[in,out] shard 分片
+ * @param[in] n 要打开的游标数
+ * @retval 0 成功
+ * @retval -1 失败，或者某个倒排列表为空（检索结果一定为空）
+ */
+static int
+open_search_cursors(search_shard *shard, int n)
+{
+  int i;
+  const query_token_value *token = shard->tokens;
+
+  for (i = 0; i < shard->n_open_cursors; i++) { token = token->hh.next; }
+  for (; i < n; i++, token = token->hh.next) {
+    doc_search_cursor *cur = &shard->cursors[i];
+    if (open_postings_cursor(shard->env, token->token_id, cur)) {
+      print_error("decode postings error!: %d\n", token->token_id);
+      return -1;
+    }
+    shard->n_open_cursors = i + 1;
+    cur->gallop = shard->methods[i] == intersect_gallop;
+    if (!cur->document_id) {
+      /* 虽然当前的token存在，但是由于更新或删除导致其倒排列表为空 */
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * 在1个分片（文档编号的范围）中检索文档
+ * 指定了top_k时，只将得分最高的前top_k个文档添加到分片的堆中。
+ * 此时利用跳表中记录的各块出现次数的最大值计算得分的上限（Block-Max MaxScore），
+ * 跳过无法进入前top_k个的文档和块，并且不对这些文档进行短语检索
+ * @param[in,out] shard 分片。检索结果存储在其中
+ */
+static void
+search_shard_docs(search_shard *shard)
+{
+  int i, min_positions_count = 1;
+  double threshold = -1;
+  int n_tokens = shard->n_tokens;
+  doc_search_cursor *cursors = shard->cursors, *cur;
+  const double *idfs = shard->idfs;
+  top_k_heap *heap = &shard->heap;
+  int *bounds = NULL, n_phrase_cursors = 0;
+  phrase_search_cursor *phrase_cursors = NULL;
+
+  if (heap->capacity > 0 && !(bounds = malloc(sizeof(int) * n_tokens))) {
+    print_error("cannot allocate memory for search.");
+    return;
+  }
+  if (shard->env->enable_phrase_search &&
+      !(phrase_cursors = alloc_phrase_cursors(shard->tokens,
+                                              &n_phrase_cursors))) {
+    free(bounds);
+    return;
+  }
+  while (cursors[0].document_id) {
+    int doc_id, next_doc_id = 0;
+    if (heap->capacity > 0 && heap->len == heap->capacity) {
+      /* 堆已满时，得分不超过堆中最低得分的文档不会进入前K个 */
+      if (threshold != heap->docs[0].score) {
+        threshold = heap->docs[0].score;
+        min_positions_count = calc_min_positions_count(idfs, cursors, bounds,
+                                                       n_tokens, threshold);
+      }
+      if (!min_positions_count) {
+        /* 剩余的文档都无法进入前K个 */
+        shard->pruned = TRUE;
+        break;
+      }
+      doc_id = cursors[0].document_id;
+      if (!postings_cursor_seek_positions_count(&cursors[0],
+                                                min_positions_count)) {
+        shard->pruned = TRUE;
+        break;
+      }
+      if (cursors[0].document_id != doc_id) { shard->pruned = TRUE; }
+      /* 用其他词元所在块的出现次数的最大值估算得分的上限 */
+      doc_id = cursors[0].document_id;
+      bounds[0] = postings_cursor_positions_count(&cursors[0]);
+      for (i = 1; i < n_tokens; i++) {
+        if (!(bounds[i] = postings_cursor_block_max(&cursors[i], doc_id))) {
+          goto exit;
+        }
+      }
+      if (calc_score_upper_bound(idfs, bounds, n_tokens) <= threshold) {
+        shard->pruned = TRUE;
+        postings_cursor_next(&cursors[0]);
+        continue;
+      }
+    }
+    /* 将拥有文档最少的词元称作A */
+    doc_id = cursors[0].document_id;
+    /* 对于除词元A以外的词元，跳到document_id不小于词元A的document_id的文档为止 */
+    for (cur = cursors + 1, i = 1; i < n_tokens; cur++, i++) {
+      /* 候选文档第一次通过了覆盖查询的词元时，才打开其余的游标 */
+      if (i == shard->n_open_cursors &&
+          open_search_cursors(shard, n_tokens)) {
+        goto exit;
+      }
+      if (!postings_cursor_seek(cur, doc_id)) { goto exit; }
+      /* 对于除词元A以外的词元，如果其document_id不等于词元A的document_id，*/
+      /* 那么就将这个document_id设定为next_doc_id */
+      if (cur->document_id != doc_id) {
+        next_doc_id = cur->document_id;
+        break;
+      }
+    }
+    if (next_doc_id > 0) {
+      /* 将A跳到document_id不小于next_doc_id的文档为止 */
+      postings_cursor_seek(&cursors[0], next_doc_id);
+    } else {
+      int phrase_count = -1;
+      double score = -1;
+      if (heap->capacity > 0 && heap->len == heap->capacity) {
+        /* 先计算得分，对无法进入前K个的文档不进行短语检索 */
+        score = calc_tf_idf(shard->tokens, cursors, n_tokens,
+                            shard->env->stats.documents_count);
+        if (score <= threshold) {
+          shard->pruned = TRUE;
+          postings_cursor_next(&cursors[0]);
+          continue;
+        }
+      }
+      if (shard->env->enable_phrase_search) {
+        /* 只需要知道是否含有短语，所以找到1个后就停止 */
+        phrase_count = search_phrase(phrase_cursors, n_phrase_cursors,
+                                     cursors, 1);
+      }
+      if (phrase_count) {
+        if (score < 0) {
+          score = calc_tf_idf(shard->tokens, cursors, n_tokens,
+                              shard->env->stats.documents_count);
+        }
+        if (heap->capacity > 0) {
+          push_top_k(heap, doc_id, score);
+        } else {
+          add_search_result(&shard->results, doc_id, score);
+        }
+        shard->n_hits++;
+      }
+      postings_cursor_next(&cursors[0]);
+    }
+  }
+exit:
+  free(phrase_cursors);
+  free(bounds);
+}
+
+/**
+ * 检索线程的主函数。在分配给该线程的分片中检索文档
+ * @param[in] arg 分片
+ * @return NULL
+ */
+static void *
+search_shard_main(void *arg)
+{
+  search_shard_docs((search_shard *)arg);
+  return NULL;
+}
+
+/**
+ * 按照词元A（第1个词元）的倒排列表将文档编号分割为若干个分片，
+ * 并用多个线程并行地在各分片中检索文档，然后将结果按分片的顺序合并
+ * 各分片的游标与cursors共享倒排列表，所以不需要再次访问数据库
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] tokens 从查询中提取出的词元信息
+ * @param[in] cursors 用于检索文档的游标的集合。须尚未移动过
+ * @param[in] n_tokens 查询中的词元数
+ * @param[in] idfs 各词元的IDF。不需要剪枝时为NULL
+ * @param[in,out] heap 前K个文档的堆。不需要时容量为0
+ * @param[in,out] results 检索结果。不使用堆时添加到其中
+ * @param[out] n_hits 检索出的文档数
+ * @return 是否跳过了文档
+ */
+static int
+search_docs_parallel(const wiser_env *env, const query_token_hash *tokens,
+                     doc_search_cursor *cursors, int n_tokens,
+                     const double *idfs, top_k_heap *heap,
+                     search_results **results, int *n_hits)
+{
+  int i, j, n_shards, pruned = FALSE;
+  int *bounds;
+  search_shard *shards;
+
+  if (!(bounds = malloc(sizeof(int) * env->search_threads))) {
+    print_error("cannot allocate memory for search.");
+    return FALSE;
+  }
+  n_shards = postings_cursor_split(&cursors[0], env->search_threads,
+                                   SEARCH_SHARD_MIN_DOCUMENTS, bounds);
+  if (!(shards = calloc(n_shards, sizeof(search_shard)))) {
+    print_error("cannot allocate memory for search.");
+    free(bounds);
+    return FALSE;
+  }
+  for (i = 0; i < n_shards; i++) {
+    search_shard *s = &shards[i];
+    int from = i ? bounds[i - 1] + 1 : 0;
+    s->env = env;
+    s->tokens = tokens;
+    s->n_tokens = n_tokens;
+    s->idfs = idfs;
+    s->heap.capacity = heap->capacity;
+    if ((heap->capacity > 0 &&
+         !(s->heap.docs = malloc(sizeof(scored_document) * heap->capacity))) ||
+        !(s->cursors = calloc(n_tokens, sizeof(doc_search_cursor)))) {
+      print_error("cannot allocate memory for search.");
+      goto exit;
+    }
+    for (j = 0; j < n_tokens; j++) {
+      if (open_postings_cursor_range(&cursors[j], from, bounds[i],
+                                     &s->cursors[j])) {
+        goto exit;
+      }
+    }
+    s->n_open_cursors = n_tokens;
+  }
+  /* 第0个分片在当前线程中检索 */
+  for (i = 1; i < n_shards; i++) {
+    if (pthread_create(&shards[i].thread, NULL, search_shard_main,
+                       &shards[i])) {
+      print_error("cannot create a search thread.");
+      search_shard_docs(&shards[i]);
+    } else {
+      shards[i].started = TRUE;
+    }
+  }
+  search_shard_docs(&shards[0]);
+  for (i = 1; i < n_shards; i++) {
+    if (shards[i].started) { pthread_join(shards[i].thread, NULL); }
+  }
+  /* 按文档编号的顺序合并，使得分相同的检索结果的顺序与单线程检索时一致 */
+  for (i = 0; i < n_shards; i++) {
+    search_shard *s = &shards[i];
+    search_results *r, *tmp;
+    for (j = 0; j < s->heap.len; j++) {
+      push_top_k(heap, s->heap.docs[j].document_id, s->heap.docs[j].score);
+    }
+    HASH_ITER(hh, s->results, r, tmp) {
+      HASH_DEL(s->results, r);
+      HASH_ADD_INT(*results, document_id, r);
+    }
+    *n_hits += s->n_hits;
+    pruned |= s->pruned;
+  }
+exit:
+  for (i = 0; i < n_shards; i++) {
+    if (shards[i].cursors) {
+      for (j = 0; j < n_tokens; j++) {
+        close_postings_cursor(&shards[i].cursors[j]);
+      }
+      free(shards[i].cursors);
+    }
+    free(shards[i].heap.docs);
+  }
+  free(shards);
+  free(bounds);
+  return pruned;
+}
+
+/**
+ * 根据在查询中的位置比较词元的两次出现。用于qsort
+ * @param[in] a 出现a
+ * @param[in] b 出现b
+ * @return 位置的先后关系
+ */
+static int
+query_token_occurrence_position_sort(const void *a, const void *b)
+{
+  return ((const query_token_occurrence *)a)->position -
+         ((const query_token_occurrence *)b)->position;
+}
+
+/**
+ * 进行短语检索时，选择能覆盖查询中所有字符的最少的词元（优先选择文档数少的词元），
+ * 并将它们排在tokens的前面。只有这些词元参与文档层面的求交集，其余的词元只对通过了
+ * 求交集的候选文档进行检查（用于短语的边界和得分），所以检索结果不变。
+ * 例如对于长度为10的查询，只需对9个2-gram中的5个求交集
+ * 在位置p的词元覆盖位置p至p + N - 1。按位置的顺序进行动态规划，第i次出现的上一个被选择的出现
+ * 必须与之相距不超过N，或者是紧挨着的前一次出现（两者之间没有要覆盖的字符时）
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in,out] tokens 从查询中提取出的词元信息。须已按文档频率的升序排列
+ * @param[in] n_tokens 查询中的词元数
+ * @return 覆盖查询的词元数。失败时为n_tokens
+ */
+static int
+select_covering_tokens(const wiser_env *env, query_token_hash **tokens,
+                       int n_tokens)
 {
-  free_postings_list((postings_list *)list);
+  int i, j, n = 0, n_cover = 0;
+  query_token_value *token, *tmp, **deferred;
+  query_token_occurrence *occ;
+
+  HASH_ITER(hh, *tokens, token, tmp) {
+    n += token->postings_list->positions_len;
+  }
+  if (!(occ = malloc(sizeof(query_token_occurrence) * n))) {
+    print_error("cannot allocate memory for search.");
+    return n_tokens;
+  }
+  if (!(deferred = malloc(sizeof(query_token_value *) * n_tokens))) {
+    print_error("cannot allocate memory for search.");
+    free(occ);
+    return n_tokens;
+  }
+  i = 0;
+  HASH_ITER(hh, *tokens, token, tmp) {
+    for (j = 0; j < token->postings_list->positions_len; j++, i++) {
+      occ[i].position = token->postings_list->positions[j];
+      occ[i].token = token;
+    }
+  }
+  qsort(occ, n, sizeof(query_token_occurrence),
+        query_token_occurrence_position_sort);
+
+  /* 第一次和最后一次出现一定要被选择 */
+  for (i = 0; i < n; i++) {
+    int best = -1;
+    for (j = i - 1; j >= 0; j--) {
+      if (j < i - 1 && occ[i].position - occ[j].position > env->token_len) {
+        break;
+      }
+      if (best < 0 || occ[j].count < occ[best].count ||
+          (occ[j].count == occ[best].count &&
+           occ[j].docs_count < occ[best].docs_count)) {
+        best = j;
+      }
+    }
+    occ[i].prev = best;
+    occ[i].count = (best < 0 ? 0 : occ[best].count) + 1;
+    occ[i].docs_count = (best < 0 ? 0 : occ[best].docs_count) +
+                        occ[i].token->docs_count;
+  }
+
+  /* 将未被选择的词元按原来的顺序移到末尾 */
+  j = 0;
+  HASH_ITER(hh, *tokens, token, tmp) {
+    int k;
+    for (k = n - 1; k >= 0 && occ[k].token != token; k = occ[k].prev) {}
+    if (k >= 0) {
+      n_cover++;
+    } else {
+      HASH_DELETE(hh, *tokens, token);
+      deferred[j++] = token;
+    }
+  }
+  for (i = 0; i < j; i++) {
+    HASH_ADD_TOKEN(*tokens, deferred[i]);
+  }
+  free(deferred);
+  free(occ);
+  return n_cover;
+}
+
+/**
+ * 制定查询计划，为每个倒排列表选择求交集的方法
+ * 词元已按文档频率的升序排列。文档最少的词元A驱动循环，其余的倒排列表按从小到大的顺序
+ * 与候选文档求交集（small-versus-small）。先估算到达各倒排列表的候选文档数，然后比较顺序比较整个倒排列表的代价与对每个候选文档进行指数查找的代价，
+ * 选择代价较小的方法。N-gram的相邻词元高度相关，所以不假设各词元相互独立，
+ * 而是将第i个倒排列表的选择率按1/2^i次方衰减后再相乘（exponential backoff）
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] tokens 从查询中提取出的词元信息
+ * @param[in] n_tokens 查询中的词元数
+ * @param[in] n_cover 覆盖查询的词元数（参见select_covering_tokens）
+ * @param[out] methods 各倒排列表的求交集方法
+ */
+static void
+plan_search(const wiser_env *env, const query_token_hash *tokens,
+            int n_tokens, int n_cover, intersect_method *methods)
+{
+  int i;
+  double candidates = 0, backoff = 1;
+  const query_token_value *token;
+
+  if (env->explain) {
+    print_error("plan: %d tokens (%d covering the query), %d documents "
+                "(average length: %.1f tokens), "
+                "order: docs count asc, intersection: small-versus-small",
+                n_tokens, n_cover, env->stats.documents_count,
+                CORPUS_AVERAGE_DOCUMENT_LENGTH(&env->stats));
+  }
+  for (i = 0, token = tokens; token; i++, token = token->hh.next) {
+    intersect_method method;
+    double merge_cost = 0, gallop_cost = 0;
+    if (!i) {
+      method = intersect_drive;
+      candidates = token->docs_count;
+    } else {
+      double ratio;
+      merge_cost = token->docs_count;
+      ratio = candidates > 0 ? token->docs_count / candidates : 1;
+      gallop_cost = candidates * (GALLOP_COMPARE_COST * log2(ratio + 1) + 1);
+      method = gallop_cost < merge_cost ? intersect_gallop : intersect_merge;
+    }
+    methods[i] = method;
+    if (env->explain) {
+      static const char *const method_names[] = {"drive", "merge", "gallop"};
+      print_error("  #%d token_id: %d docs: %d candidates: %.1f "
+                  "method: %s cost: merge %.0f gallop %.0f%s",
+                  i, token->token_id, token->docs_count, candidates,
+                  method_names[method], merge_cost, gallop_cost,
+                  i < n_cover ? "" : " (deferred)");
+    }
+    /* 通过该倒排列表后剩下的候选文档数 */
+    if (i && env->stats.documents_count > 0) {
+      backoff /= 2;
+      candidates *= pow((double)token->docs_count / env->stats.documents_count,
+                        backoff);
+    }
+    if (candidates < 1) { candidates = 1; }
+  }
 }
 
 /**
  * 检索文档
+ * 指定了env->top_k时，只将得分最高的前top_k个文档添加到检索结果中（参见search_shard_docs）。
+ * 指定了env->search_threads时，将文档编号分割为多个分片并行检索（参见search_docs_parallel）
  * @param[in] env 存储着应用程序运行环境的结构体
  * @param[in,out] results 检索结果
  * @param[in] tokens 从查询中提取出的词元信息
+ * @return 检索出的文档总数。由于跳过了文档而无法得知总数时为-1
  */
-void
+int
 search_docs(wiser_env *env, search_results **results,
             query_token_hash *tokens)
 {
-  int n_tokens;
+  int n_tokens, n_cover, n_hits = 0, pruned = FALSE;
   doc_search_cursor *cursors;
+  top_k_heap heap;
+  double *idfs = NULL;
+  intersect_method *methods = NULL;
 
-  if (!tokens) { return; }
+  if (!tokens) { return 0; }
+  heap.docs = NULL;
+  heap.len = 0;
+  heap.capacity = env->top_k;
+  if (heap.capacity > 0 &&
+      !(heap.docs = malloc(sizeof(scored_document) * heap.capacity))) {
+    print_error("cannot allocate memory for search results.");
+    free_inverted_index(tokens);
+    return 0;
+  }
 
-  /* 按照文档频率的升序对tokens排序 */
-  HASH_SORT(tokens, query_token_value_docs_count_desc_sort);
+  /* 按照文档频率的升序对tokens排序，使文档最少的词元驱动检索的循环 */
+  HASH_SORT(tokens, query_token_value_docs_count_asc_sort);
 
   /* 初始化 */
   n_tokens = HASH_COUNT(tokens);
@@ -216,71 +863,67 @@ search_docs(wiser_env *env, search_results **results,
       (cursors = (doc_search_cursor *)calloc(
                    sizeof(doc_search_cursor), n_tokens))) {
     int i;
-    doc_search_cursor *cur;
     query_token_value *token;
-    for (i = 0, token = tokens; token; i++, token = token->hh.next) {
+    search_shard shard;
+    if ((heap.capacity > 0 && !(idfs = malloc(sizeof(double) * n_tokens))) ||
+        !(methods = malloc(sizeof(intersect_method) * n_tokens))) {
+      print_error("cannot allocate memory for search.");
+      goto exit;
+    }
+    for (token = tokens; token; token = token->hh.next) {
       if (!token->token_id) {
         /* 当前的token在构建索引的过程中从未出现过 */
         goto exit;
       }
-      if (fetch_postings(env, token->token_id,
-                         &cursors[i].documents, NULL)) {
-        print_error("decode postings error!: %d\n", token->token_id);
-        goto exit;
-      }
-      if (!cursors[i].documents) {
-        /* 虽然当前的token存在，但是由于更新或删除导致其倒排列表为空 */
-        goto exit;
-      }
-      cursors[i].current = cursors[i].documents;
-    }
-    while (cursors[0].current) {
-      int doc_id, next_doc_id = 0;
-      /* 将拥有文档最少的词元称作A */
-      doc_id = cursors[0].current->document_id;      
-      /* 对于除词元A以外的词元，不断获取其下一个document_id，直到当前的document_id不小于词元A的document_id为止 */
-      for (cur = cursors + 1, i = 1; i < n_tokens; cur++, i++) {
-        while (cur->current && cur->current->document_id < doc_id) {
-          cur->current = cur->current->next;
-        }
-        if (!cur->current) { goto exit; }      
-        /* 对于除词元A以外的词元，如果其document_id不等于词元A的document_id，*/
-        /* 那么就将这个document_id设定为next_doc_id */
-        if (cur->current->document_id != doc_id) {
-          next_doc_id = cur->current->document_id;
-          break;
-        }
-      }
-      if (next_doc_id > 0) {
-        /* 不断获取A的下一个document_id，直到其当前的document_id不小于next_doc_id为止 */
-        while (cursors[0].current
-               && cursors[0].current->document_id < next_doc_id) {
-          cursors[0].current = cursors[0].current->next;
-        }
-      } else {
-        int phrase_count = -1;
-        if (env->enable_phrase_search) {
-          phrase_count = search_phrase(tokens, cursors);
-        }
-        if (phrase_count) {
-          double score = calc_tf_idf(tokens, cursors, n_tokens,
-                                     env->indexed_count);
-          add_search_result(results, doc_id, score);
-        }
-        cursors[0].current = cursors[0].current->next;
-      }
+    }
+    n_cover = env->enable_phrase_search ?
+              select_covering_tokens(env, &tokens, n_tokens) : n_tokens;
+    for (i = 0, token = tokens; idfs && token; i++, token = token->hh.next) {
+      idfs[i] = log2((double)env->stats.documents_count / token->docs_count);
+    }
+    plan_search(env, tokens, n_tokens, n_cover, methods);
+
+    memset(&shard, 0, sizeof(search_shard));
+    shard.env = env;
+    shard.tokens = tokens;
+    shard.n_tokens = n_tokens;
+    shard.cursors = cursors;
+    shard.methods = methods;
+    /* 并行检索时各分片共享倒排列表，所以要先打开所有的游标 */
+    if (open_search_cursors(&shard, env->search_threads > 1 ?
+                                    n_tokens : n_cover)) {
+      goto exit;
+    }
+    if (env->search_threads > 1) {
+      pruned = search_docs_parallel(env, tokens, cursors, n_tokens, idfs,
+                                    &heap, results, &n_hits);
+    } else {
+      shard.idfs = idfs;
+      shard.heap = heap;
+      shard.results = *results;
+      search_shard_docs(&shard);
+      heap = shard.heap;
+      *results = shard.results;
+      n_hits = shard.n_hits;
+      pruned = shard.pruned;
     }
 exit:
     for (i = 0; i < n_tokens; i++) {
-      if (cursors[i].documents) {
-        free_token_positions_list(cursors[i].documents);
-      }
+      close_postings_cursor(&cursors[i]);
     }
     free(cursors);
   }
+  free(methods);
+  free(idfs);
   free_inverted_index(tokens);
 
-  HASH_SORT(*results, search_results_score_desc_sort);
+  if (heap.capacity > 0) {
+    top_k_to_results(&heap, results);
+    free(heap.docs);
+  } else {
+    HASH_SORT(*results, search_results_score_desc_sort);
+  }
+  return pruned ? -1 : n_hits;
 }
 
 /**
@@ -303,21 +946,25 @@ split_query_to_tokens(wiser_env *env,
   return text_to_postings_lists(env,
                                 0, /* 将document_id设为0 */
                                 text, text_len, n,
-                                (inverted_index_hash **)query_tokens);
+                                (inverted_index_hash **)query_tokens,
+                                env->query_arena);
 }
 
 /**
  * 打印检索结果
  * @param[in] env 存储着应用程序运行环境的结构体
  * @param[in] results 检索结果
+ * @param[in] num_search_results 检索出的文档总数。无法得知总数时为-1
+ * @param[in] out 输出检索结果的流
  */
 void
-print_search_results(wiser_env *env, search_results *results)
+print_search_results(wiser_env *env, search_results *results,
+                     int num_search_results, FILE *out)
 {
-  int num_search_results;
+  int pruned = num_search_results < 0;
 
   if (!results) { return; }
-  num_search_results = HASH_COUNT(results);
+  if (pruned) { num_search_results = HASH_COUNT(results); }
 
   while (results) {
     int title_len;
@@ -327,26 +974,32 @@ print_search_results(wiser_env *env, search_results *results)
     r = results;
     HASH_DEL(results, r);
     db_get_document_title(env, r->document_id, &title, &title_len);
-    printf("document_id: %d title: %.*s score: %lf\n",
-           r->document_id, title_len, title, r->score);
+    fprintf(out, "document_id: %d title: %.*s score: %lf\n",
+            r->document_id, title_len, title, r->score);
     free(r);
   }
 
-  printf("Total %u documents are found!\n", num_search_results);
+  if (pruned) {
+    fprintf(out, "Top %u documents are found!\n", num_search_results);
+  } else {
+    fprintf(out, "Total %u documents are found!\n", num_search_results);
+  }
 }
 
 /**
  * 进行全文检索
  * @param[in] env 存储着应用程序运行环境的结构体
  * @param[in] query 查询
+ * @param[in] out 输出检索结果的流
  */
 void
-search(wiser_env *env, const char *query)
+search(wiser_env *env, const char *query, FILE *out)
 {
   int query32_len;
   UTF32Char *query32;
 
   if (!utf8toutf32(query, strlen(query), &query32, &query32_len)) {
+    int num_search_results = 0;
     search_results *results = NULL;
 
     if (query32_len < env->token_len) {
@@ -355,10 +1008,12 @@ search(wiser_env *env, const char *query)
       query_token_hash *query_tokens = NULL;
       split_query_to_tokens(
         env, query32, query32_len, env->token_len, &query_tokens);
-      search_docs(env, &results, query_tokens);
+      num_search_results = search_docs(env, &results, query_tokens);
+      /* 查询的词元和位置信息已随search_docs不再使用，一次性释放 */
+      reset_arena(env->query_arena);
     }
 
-    print_search_results(env, results);
+    print_search_results(env, results, num_search_results, out);
 
     free(query32);
   }
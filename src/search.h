@@ -1,8 +1,10 @@
 #ifndef __SEARCH_H__
 #define __SEARCH_H__
 
+#include <stdio.h>
+
 #include "wiser.h"
 
-void search(wiser_env *env, const char *query);
+void search(wiser_env *env, const char *query, FILE *out);
 
 #endif /* __SEARCH_H__ */
@@ -0,0 +1,889 @@
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "segment.h"
+#include "postings.h"
+#include "database.h"
+
+/* 段文件中各倒排列表和词元词典的对齐字节数 */
+#define SEGMENT_ALIGN 8
+/* 每次将多少个同一层级的相邻段合并为1个 */
+#define SEGMENT_MERGE_FACTOR 10
+/* 小于该字节数的段都属于最低的层级 */
+#define SEGMENT_MERGE_MIN_SIZE (1 << 20)
+
+/* 在后台合并段的线程 */
+typedef struct _segment_merger {
+  wiser_env *env;          /* 存储着应用程序运行环境的结构体 */
+  pthread_t thread;        /* 线程 */
+  pthread_mutex_t mutex;   /* 保护env中与段相关的字段和segments表的互斥锁 */
+  pthread_cond_t changed;  /* 添加了新的段或要结束线程时发出通知 */
+  int stopping;            /* 是否要在完成所有可以进行的合并后结束线程 */
+  int merge_count;         /* 已进行的合并的次数 */
+} segment_merger;
+
+/**
+ * 用mmap打开段文件，并检查其结构
+ * @param[in] path 段文件的路径
+ * @param[in] id 段的编号
+ * @return 打开的段。失败时为NULL
+ */
+segment *
+open_segment(const char *path, int id)
+{
+  int fd;
+  struct stat st;
+  segment *seg;
+  const segment_header *h;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    print_error("cannot open segment %s: %s", path, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(segment_header)) {
+    print_error("invalid segment %s", path);
+    close(fd);
+    return NULL;
+  }
+  if (!(seg = calloc(1, sizeof(segment)))) {
+    print_error("cannot allocate memory for a segment.");
+    close(fd);
+    return NULL;
+  }
+  seg->id = id;
+  seg->map_size = st.st_size;
+  seg->map = mmap(NULL, seg->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg->map == MAP_FAILED) {
+    print_error("cannot mmap segment %s: %s", path, strerror(errno));
+    free(seg);
+    return NULL;
+  }
+  h = seg->header = (const segment_header *)seg->map;
+  if (memcmp(h->magic, SEGMENT_MAGIC, sizeof(h->magic)) ||
+      h->version != SEGMENT_VERSION ||
+      h->file_size != seg->map_size || h->n_tokens < 0 ||
+      h->dict_offset % SEGMENT_ALIGN ||
+      h->dict_offset > seg->map_size ||
+      (seg->map_size - h->dict_offset) / sizeof(segment_dict_entry) <
+      (uint64_t)h->n_tokens) {
+    print_error("invalid segment %s", path);
+    close_segment(seg);
+    return NULL;
+  }
+  seg->dict = (const segment_dict_entry *)(seg->map + h->dict_offset);
+  return seg;
+}
+
+/**
+ * 关闭段
+ * @param[in] seg 段
+ */
+void
+close_segment(segment *seg)
+{
+  munmap((void *)seg->map, seg->map_size);
+  free(seg);
+}
+
+/**
+ * 用二分查找从段中获取指定词元的倒排列表。倒排列表不会被复制
+ * @param[in] seg 段
+ * @param[in] token_id 词元编号
+ * @param[out] postings_e 带跳表的倒排列表。在关闭段之前有效
+ * @param[out] postings_e_size 带跳表的倒排列表的字节数
+ * @param[out] docs_count 倒排列表中的文档数
+ * @retval 0 成功
+ * @retval -1 段中没有该词元
+ */
+int
+segment_get_postings(const segment *seg, int token_id,
+                     const char **postings_e, int *postings_e_size,
+                     int *docs_count)
+{
+  int lo = 0, hi = seg->header->n_tokens;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (seg->dict[mid].token_id < token_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == seg->header->n_tokens || seg->dict[lo].token_id != token_id ||
+      seg->dict[lo].offset + seg->dict[lo].size > seg->header->dict_offset) {
+    return -1;
+  }
+  if (postings_e) { *postings_e = seg->map + seg->dict[lo].offset; }
+  if (postings_e_size) { *postings_e_size = seg->dict[lo].size; }
+  if (docs_count) { *docs_count = seg->dict[lo].docs_count; }
+  return 0;
+}
+
+/**
+ * 向文件中写入0字节，直到写入位置按SEGMENT_ALIGN对齐为止
+ * @param[in,out] w 用于写入段文件的结构体
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+pad_segment_writer(segment_writer *w)
+{
+  static const char zeros[SEGMENT_ALIGN];
+  int pad = (SEGMENT_ALIGN - w->offset % SEGMENT_ALIGN) % SEGMENT_ALIGN;
+
+  if (pad && fwrite(zeros, 1, pad, w->fp) != pad) { return -1; }
+  w->offset += pad;
+  return 0;
+}
+
+/**
+ * 开始写入段文件。数据先被写入临时文件，
+ * 在调用函数close_segment_writer时才被重命名为段文件
+ * @param[in] path 段文件的路径
+ * @return 用于写入段文件的结构体。失败时为NULL
+ */
+segment_writer *
+open_segment_writer(const char *path)
+{
+  segment_writer *w;
+
+  if (!(w = calloc(1, sizeof(segment_writer))) ||
+      !(w->path = strdup(path)) ||
+      !(w->tmp_path = malloc(strlen(path) + sizeof(".tmp")))) {
+    print_error("cannot allocate memory for a segment writer.");
+    if (w) {
+      free(w->path);
+      free(w);
+    }
+    return NULL;
+  }
+  sprintf(w->tmp_path, "%s.tmp", path);
+  if (!(w->fp = fopen(w->tmp_path, "wb"))) {
+    print_error("cannot create segment %s: %s", w->tmp_path,
+                strerror(errno));
+    free(w->tmp_path);
+    free(w->path);
+    free(w);
+    return NULL;
+  }
+  /* 头部在最后才写入，先留出空间 */
+  memcpy(w->header.magic, SEGMENT_MAGIC, sizeof(w->header.magic));
+  w->header.version = SEGMENT_VERSION;
+  if (fwrite(&w->header, sizeof(segment_header), 1, w->fp) != 1) {
+    abort_segment_writer(w);
+    return NULL;
+  }
+  w->offset = sizeof(segment_header);
+  return w;
+}
+
+/**
+ * 向段文件中写入1个词元的倒排列表。必须按词元编号的升序写入
+ * @param[in,out] w 用于写入段文件的结构体
+ * @param[in] token_id 词元编号
+ * @param[in] docs_count 倒排列表中的文档数
+ * @param[in] postings_e 带跳表的倒排列表
+ * @param[in] postings_e_size 带跳表的倒排列表的字节数
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+segment_writer_add(segment_writer *w, int token_id, int docs_count,
+                   const void *postings_e, int postings_e_size)
+{
+  segment_dict_entry *e;
+
+  if (w->header.n_tokens &&
+      w->dict[w->header.n_tokens - 1].token_id >= token_id) {
+    print_error("tokens must be added to a segment in ascending order.");
+    return -1;
+  }
+  if (w->header.n_tokens == w->dict_capacity) {
+    int capacity = w->dict_capacity ? w->dict_capacity * 2 : 1024;
+    if (!(e = realloc(w->dict, sizeof(segment_dict_entry) * capacity))) {
+      print_error("cannot allocate memory for a segment writer.");
+      return -1;
+    }
+    w->dict = e;
+    w->dict_capacity = capacity;
+  }
+  if (pad_segment_writer(w) ||
+      fwrite(postings_e, 1, postings_e_size, w->fp) != postings_e_size) {
+    print_error("cannot write segment %s: %s", w->tmp_path, strerror(errno));
+    return -1;
+  }
+  e = &w->dict[w->header.n_tokens++];
+  e->token_id = token_id;
+  e->docs_count = docs_count;
+  e->offset = w->offset;
+  e->size = postings_e_size;
+  e->reserved = 0;
+  w->offset += postings_e_size;
+  return 0;
+}
+
+/**
+ * 写入词元词典和头部，并将临时文件重命名为段文件
+ * 无论成功与否，用于写入段文件的结构体都会被释放
+ * @param[in] w 用于写入段文件的结构体
+ * @param[in] min_document_id 段中最小的文档编号
+ * @param[in] max_document_id 段中最大的文档编号
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+close_segment_writer(segment_writer *w, int min_document_id,
+                     int max_document_id)
+{
+  int n = w->header.n_tokens;
+
+  w->header.min_document_id = min_document_id;
+  w->header.max_document_id = max_document_id;
+  if (pad_segment_writer(w)) { goto err; }
+  w->header.dict_offset = w->offset;
+  w->header.file_size = w->offset + sizeof(segment_dict_entry) * n;
+  if ((n && fwrite(w->dict, sizeof(segment_dict_entry), n, w->fp) != n) ||
+      fseeko(w->fp, 0, SEEK_SET) ||
+      fwrite(&w->header, sizeof(segment_header), 1, w->fp) != 1 ||
+      fflush(w->fp) || fsync(fileno(w->fp))) {
+    goto err;
+  }
+  fclose(w->fp);
+  w->fp = NULL;
+  /* 段文件一旦出现在最终路径上就是完整的 */
+  if (rename(w->tmp_path, w->path)) { goto err; }
+  free(w->dict);
+  free(w->tmp_path);
+  free(w->path);
+  free(w);
+  return 0;
+err:
+  print_error("cannot write segment %s: %s", w->tmp_path, strerror(errno));
+  abort_segment_writer(w);
+  return -1;
+}
+
+/**
+ * 放弃写入段文件，删除临时文件并释放用于写入段文件的结构体
+ * @param[in] w 用于写入段文件的结构体
+ */
+void
+abort_segment_writer(segment_writer *w)
+{
+  if (w->fp) { fclose(w->fp); }
+  unlink(w->tmp_path);
+  free(w->dict);
+  free(w->tmp_path);
+  free(w->path);
+  free(w);
+}
+
+/**
+ * 获取段文件的路径。段文件存放在与数据库文件同名、以.segments结尾的目录中
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] id 段的编号。为0时获取目录的路径
+ * @return 段文件的路径。使用后需要用free释放。失败时为NULL
+ */
+char *
+get_segment_path(const wiser_env *env, int id)
+{
+  char *path;
+  size_t size = strlen(env->db_path) + sizeof(".segments/00000000.seg");
+
+  if (!(path = malloc(size))) {
+    print_error("cannot allocate memory for a segment path.");
+    return NULL;
+  }
+  if (id) {
+    snprintf(path, size, "%s.segments/%08d.seg", env->db_path, id);
+  } else {
+    snprintf(path, size, "%s.segments", env->db_path);
+  }
+  return path;
+}
+
+/**
+ * 在后台合并段时，获取保护env中与段相关的字段和segments表的互斥锁
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+static void
+lock_segments(const wiser_env *env)
+{
+  if (env->merger) { pthread_mutex_lock(&env->merger->mutex); }
+}
+
+/**
+ * 在后台合并段时，释放保护env中与段相关的字段和segments表的互斥锁
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+static void
+unlock_segments(const wiser_env *env)
+{
+  if (env->merger) { pthread_mutex_unlock(&env->merger->mutex); }
+}
+
+/**
+ * 将段添加到env->segments的末尾
+ * @param[in,out] env 存储着应用程序运行环境的结构体
+ * @param[in] seg 段
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+add_segment(wiser_env *env, segment *seg)
+{
+  segment **segments;
+
+  if (!(segments = realloc(env->segments,
+                           sizeof(segment *) * (env->n_segments + 1)))) {
+    print_error("cannot allocate memory for segments.");
+    return -1;
+  }
+  env->segments = segments;
+  env->segments[env->n_segments++] = seg;
+  if (seg->id > env->max_segment_id) { env->max_segment_id = seg->id; }
+  return 0;
+}
+
+/**
+ * 打开segments表中记录的1个段。由函数db_scan_segments调用
+ * @param[in] arg 存储着应用程序运行环境的结构体
+ * @param[in] id 段的编号
+ * @param[in] min_document_id 段中最小的文档编号
+ * @param[in] max_document_id 段中最大的文档编号
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+load_segment(void *arg, int id, int min_document_id, int max_document_id)
+{
+  wiser_env *env = arg;
+  char *path;
+  segment *seg = NULL;
+
+  if ((path = get_segment_path(env, id))) {
+    seg = open_segment(path, id);
+    free(path);
+  }
+  if (!seg) { return -1; }
+  if (add_segment(env, seg)) {
+    close_segment(seg);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * 打开segments表中记录的所有段。各段按文档编号的升序排列
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+load_segments(wiser_env *env)
+{
+  free_segments(env);
+  if (db_scan_segments(env, load_segment, env)) {
+    free_segments(env);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * 关闭所有的段
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+free_segments(wiser_env *env)
+{
+  int i;
+
+  for (i = 0; i < env->n_segments; i++) {
+    close_segment(env->segments[i]);
+  }
+  free(env->segments);
+  env->segments = NULL;
+  env->n_segments = 0;
+}
+
+/**
+ * 用于按词元编号的升序排列小倒排索引中各项的比较函数
+ * @param[in] a 指向小倒排索引中的项的指针
+ * @param[in] b 指向小倒排索引中的项的指针
+ * @return 比较结果
+ */
+static int
+inverted_index_value_token_id_cmp(const void *a, const void *b)
+{
+  return (*(inverted_index_value *const *)a)->token_id -
+         (*(inverted_index_value *const *)b)->token_id;
+}
+
+/**
+ * 将小倒排索引写入新的段文件，并将其记录到segments表中
+ * 与函数update_postings不同，不需要读出已有的倒排列表，
+ * 但小倒排索引中的文档编号必须大于已有的各段中的文档编号。
+ * 写入的段会在后台与其他的段合并。
+ * env->spimi为真时，写入的是临时的有序段（run），要在最后用函数merge_runs进行归并
+ * @param[in,out] env 存储着应用程序运行环境的结构体
+ * @param[in] ii 小倒排索引。各项的词元编号必须已经确定
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+flush_segment(wiser_env *env, inverted_index_hash *ii)
+{
+  int i, n, id, rc = -1;
+  int min_document_id = 0, max_document_id = 0;
+  char *path = NULL;
+  buffer *buf = NULL;
+  segment *seg;
+  segment_writer *w = NULL;
+  inverted_index_value *p, **entries;
+
+  if (!(n = HASH_COUNT(ii))) { return 0; }
+  if (!(entries = malloc(sizeof(inverted_index_value *) * n))) {
+    print_error("cannot allocate memory for flushing a segment.");
+    return -1;
+  }
+  for (i = 0, p = ii; p; p = p->hh.next) {
+    const postings_list *pl = p->postings_list;
+    entries[i++] = p;
+    if (!min_document_id || pl->document_ids[0] < min_document_id) {
+      min_document_id = pl->document_ids[0];
+    }
+    if (pl->document_ids[pl->len - 1] > max_document_id) {
+      max_document_id = pl->document_ids[pl->len - 1];
+    }
+  }
+  qsort(entries, n, sizeof(inverted_index_value *),
+        inverted_index_value_token_id_cmp);
+
+  if (!(path = get_segment_path(env, 0))) { goto exit; }
+  if (mkdir(path, 0777) && errno != EEXIST) {
+    print_error("cannot create directory %s: %s", path, strerror(errno));
+    goto exit;
+  }
+  free(path);
+  lock_segments(env);
+  id = ++env->max_segment_id;
+  unlock_segments(env);
+  if (!(path = get_segment_path(env, id)) ||
+      !(w = open_segment_writer(path)) ||
+      !(buf = alloc_buffer())) {
+    goto exit;
+  }
+  for (i = 0; i < n; i++) {
+    p = entries[i];
+    buf->curr = buf->head;
+    buf->bit = 0;
+    if (encode_postings(env, p->postings_list, p->docs_count, buf) ||
+        segment_writer_add(w, p->token_id, p->docs_count,
+                           BUFFER_PTR(buf), BUFFER_SIZE(buf))) {
+      goto exit;
+    }
+  }
+  rc = close_segment_writer(w, min_document_id, max_document_id);
+  w = NULL;
+  if (rc) { goto exit; }
+  rc = -1;
+  if (!(seg = open_segment(path, id))) { goto exit; }
+  lock_segments(env);
+  /* 有序段（run）在最后被归并之前不记录到segments表中 */
+  if ((!env->spimi && db_add_segment(env, id, min_document_id,
+                                     max_document_id, seg->map_size)) ||
+      add_segment(env, seg)) {
+    unlock_segments(env);
+    close_segment(seg);
+    unlink(path);
+    goto exit;
+  }
+  if (env->merger) { pthread_cond_signal(&env->merger->changed); }
+  unlock_segments(env);
+  print_error("%s %d written: %d tokens, %zu bytes.",
+              env->spimi ? "run" : "segment", id, n, seg->map_size);
+  rc = 0;
+exit:
+  if (w) { abort_segment_writer(w); }
+  if (buf) { free_buffer(buf); }
+  free(path);
+  free(entries);
+  return rc;
+}
+
+/**
+ * 获取出现过指定词元的文档数，即各段中该词元的倒排列表的文档数之和
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] token_id 词元编号
+ * @return 文档数
+ */
+int
+get_segments_docs_count(const wiser_env *env, int token_id)
+{
+  int i, docs_count, sum = 0;
+
+  for (i = 0; i < env->n_segments; i++) {
+    if (!segment_get_postings(env->segments[i], token_id, NULL, NULL,
+                              &docs_count)) {
+      sum += docs_count;
+    }
+  }
+  return sum;
+}
+
+/**
+ * 获取段所属的层级。段文件的字节数每增大SEGMENT_MERGE_FACTOR倍，层级加1
+ * @param[in] seg 段
+ * @return 层级
+ */
+static int
+get_segment_level(const segment *seg)
+{
+  int level;
+  uint64_t limit;
+
+  for (level = 0, limit = SEGMENT_MERGE_MIN_SIZE; seg->map_size >= limit;
+       level++) {
+    limit *= SEGMENT_MERGE_FACTOR;
+  }
+  return level;
+}
+
+/**
+ * 寻找要合并的段。只有相邻的段才能合并，这样合并后各段中的文档编号仍然互不重叠
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[out] from 要合并的SEGMENT_MERGE_FACTOR个段中第一个段的下标
+ * @retval TRUE 找到了要合并的段
+ * @retval FALSE 没有需要合并的段
+ */
+static int
+find_segments_to_merge(const wiser_env *env, int *from)
+{
+  int i, run = 0, run_level = -1;
+
+  for (i = 0; i < env->n_segments; i++) {
+    int level = get_segment_level(env->segments[i]);
+    if (level == run_level) {
+      run++;
+    } else {
+      run = 1;
+      run_level = level;
+    }
+    if (run == SEGMENT_MERGE_FACTOR) {
+      *from = i - SEGMENT_MERGE_FACTOR + 1;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* 多路归并时，堆中的1项。表示1个段中尚未处理的第一个词元 */
+typedef struct {
+  int token_id; /* 词元编号 */
+  int seg;      /* 段在数组中的下标 */
+} merge_head;
+
+/* 判断堆中的项a是否应排在b之前。词元编号相同时，文档编号较小的段排在前面 */
+#define MERGE_HEAD_LESS(a, b) \
+  ((a).token_id < (b).token_id || \
+   ((a).token_id == (b).token_id && (a).seg < (b).seg))
+
+/**
+ * 使堆中第i项以下的部分满足堆的性质
+ * @param[in,out] heap 堆
+ * @param[in] n 堆中的项数
+ * @param[in] i 项的下标
+ */
+static void
+sift_down_merge_heads(merge_head *heap, int n, int i)
+{
+  merge_head h = heap[i];
+
+  while (2 * i + 1 < n) {
+    int c = 2 * i + 1;
+    if (c + 1 < n && MERGE_HEAD_LESS(heap[c + 1], heap[c])) { c++; }
+    if (!MERGE_HEAD_LESS(heap[c], h)) { break; }
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = h;
+}
+
+/**
+ * 对相邻的多个段进行多路归并，并将结果写入新的段文件
+ * 只在1个段中出现的词元的倒排列表会被原样复制，不需要解码
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] segs 按文档编号的升序排列的段的数组
+ * @param[in] n 段的个数
+ * @param[in] id 新的段的编号
+ * @return 合并后的段。失败时为NULL
+ */
+static segment *
+merge_segments(const wiser_env *env, segment *const *segs, int n, int id)
+{
+  int i, n_heads = 0, rc = 0, *pos, *postings_e_size;
+  int max_document_id = segs[n - 1]->header->max_document_id;
+  char *path = NULL;
+  const char **postings_e;
+  buffer *buf = NULL;
+  merge_head *heap;
+  segment *merged = NULL;
+  segment_writer *w = NULL;
+
+  pos = calloc(n, sizeof(int));
+  postings_e_size = malloc(sizeof(int) * n);
+  postings_e = malloc(sizeof(const char *) * n);
+  heap = malloc(sizeof(merge_head) * n);
+  if (!pos || !postings_e_size || !postings_e || !heap) {
+    print_error("cannot allocate memory for merging segments.");
+    goto exit;
+  }
+  if (!(path = get_segment_path(env, id)) ||
+      !(w = open_segment_writer(path)) ||
+      !(buf = alloc_buffer())) {
+    goto exit;
+  }
+  for (i = 0; i < n; i++) {
+    if (segs[i]->header->n_tokens) {
+      heap[n_heads].token_id = segs[i]->dict[0].token_id;
+      heap[n_heads].seg = i;
+      n_heads++;
+    }
+  }
+  for (i = n_heads / 2 - 1; i >= 0; i--) {
+    sift_down_merge_heads(heap, n_heads, i);
+  }
+  while (n_heads && !rc) {
+    int k = 0, token_id = heap[0].token_id, docs_count = 0;
+    /* 按段的顺序取出所有段中该词元的倒排列表 */
+    while (n_heads && heap[0].token_id == token_id) {
+      const segment *seg = segs[heap[0].seg];
+      const segment_dict_entry *e = &seg->dict[pos[heap[0].seg]++];
+      postings_e[k] = seg->map + e->offset;
+      postings_e_size[k] = e->size;
+      docs_count += e->docs_count;
+      k++;
+      if (pos[heap[0].seg] < seg->header->n_tokens) {
+        heap[0].token_id = seg->dict[pos[heap[0].seg]].token_id;
+      } else {
+        heap[0] = heap[--n_heads];
+      }
+      sift_down_merge_heads(heap, n_heads, 0);
+    }
+    if (k == 1) {
+      rc = segment_writer_add(w, token_id, docs_count,
+                              postings_e[0], postings_e_size[0]);
+    } else {
+      buf->curr = buf->head;
+      buf->bit = 0;
+      /* 文档编号是从1开始连续分配的，所以最大的文档编号就是文档总数 */
+      rc = concat_encoded_postings(env, max_document_id, postings_e,
+                                   postings_e_size, k, buf, &docs_count) ||
+           segment_writer_add(w, token_id, docs_count,
+                              BUFFER_PTR(buf), BUFFER_SIZE(buf));
+    }
+  }
+  if (rc) { goto exit; }
+  rc = close_segment_writer(w, segs[0]->header->min_document_id,
+                            max_document_id);
+  w = NULL;
+  if (!rc) { merged = open_segment(path, id); }
+exit:
+  if (w) { abort_segment_writer(w); }
+  if (buf) { free_buffer(buf); }
+  free(path);
+  free(heap);
+  free(postings_e);
+  free(postings_e_size);
+  free(pos);
+  return merged;
+}
+
+/**
+ * 用合并后的段替换env->segments和segments表中被合并的段，并删除被合并的段文件
+ * @param[in,out] env 存储着应用程序运行环境的结构体
+ * @param[in] from 被合并的段中第一个段的下标
+ * @param[in] n 被合并的段的个数
+ * @param[in] merged 合并后的段
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+replace_segments(wiser_env *env, int from, int n, segment *merged)
+{
+  int i;
+
+  for (i = from; i < from + n; i++) {
+    if (db_delete_segment(env, env->segments[i]->id)) { return -1; }
+  }
+  if (db_add_segment(env, merged->id, merged->header->min_document_id,
+                     merged->header->max_document_id, merged->map_size)) {
+    return -1;
+  }
+  for (i = from; i < from + n; i++) {
+    char *path = get_segment_path(env, env->segments[i]->id);
+    if (path) {
+      unlink(path);
+      free(path);
+    }
+    close_segment(env->segments[i]);
+  }
+  env->segments[from] = merged;
+  memmove(env->segments + from + 1, env->segments + from + n,
+          sizeof(segment *) * (env->n_segments - from - n));
+  env->n_segments -= n - 1;
+  return 0;
+}
+
+/**
+ * 合并段的线程的主函数
+ * 每当有新的段写入时，就寻找SEGMENT_MERGE_FACTOR个同一层级的相邻段并将它们合并
+ * @param[in] arg 在后台合并段的线程
+ * @return NULL
+ */
+static void *
+segment_merger_main(void *arg)
+{
+  segment_merger *m = (segment_merger *)arg;
+  wiser_env *env = m->env;
+
+  pthread_mutex_lock(&m->mutex);
+  while (1) {
+    int from, id;
+    segment *segs[SEGMENT_MERGE_FACTOR], *merged;
+
+    if (!find_segments_to_merge(env, &from)) {
+      if (m->stopping) { break; }
+      pthread_cond_wait(&m->changed, &m->mutex);
+      continue;
+    }
+    /* 在合并期间，只有本线程会删除段，所以被合并的段不会被释放 */
+    memcpy(segs, env->segments + from, sizeof(segs));
+    id = ++env->max_segment_id;
+    pthread_mutex_unlock(&m->mutex);
+    merged = merge_segments(env, segs, SEGMENT_MERGE_FACTOR, id);
+    pthread_mutex_lock(&m->mutex);
+    if (!merged || replace_segments(env, from, SEGMENT_MERGE_FACTOR,
+                                    merged)) {
+      print_error("cannot merge segments %d-%d. stop merging.",
+                  segs[0]->id, segs[SEGMENT_MERGE_FACTOR - 1]->id);
+      if (merged) {
+        char *path = get_segment_path(env, merged->id);
+        close_segment(merged);
+        if (path) {
+          unlink(path);
+          free(path);
+        }
+      }
+      break;
+    }
+    m->merge_count++;
+    print_error("segments merged into segment %d: %zu bytes.",
+                merged->id, merged->map_size);
+  }
+  pthread_mutex_unlock(&m->mutex);
+  return NULL;
+}
+
+/**
+ * 启动在后台合并段的线程
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+start_segment_merger(wiser_env *env)
+{
+  segment_merger *m;
+
+  if (!(m = calloc(1, sizeof(segment_merger)))) {
+    print_error("cannot allocate memory for a segment merger.");
+    return -1;
+  }
+  m->env = env;
+  pthread_mutex_init(&m->mutex, NULL);
+  pthread_cond_init(&m->changed, NULL);
+  if (pthread_create(&m->thread, NULL, segment_merger_main, m)) {
+    print_error("cannot create a segment merging thread.");
+    pthread_mutex_destroy(&m->mutex);
+    pthread_cond_destroy(&m->changed);
+    free(m);
+    return -1;
+  }
+  env->merger = m;
+  return 0;
+}
+
+/**
+ * 等待所有可以进行的合并完成后，结束在后台合并段的线程
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+stop_segment_merger(wiser_env *env)
+{
+  segment_merger *m = env->merger;
+
+  if (!m) { return; }
+  pthread_mutex_lock(&m->mutex);
+  m->stopping = TRUE;
+  pthread_cond_signal(&m->changed);
+  pthread_mutex_unlock(&m->mutex);
+  pthread_join(m->thread, NULL);
+
+  print_error("%d segment merges done. %d segments remain.",
+              m->merge_count, env->n_segments);
+  pthread_mutex_destroy(&m->mutex);
+  pthread_cond_destroy(&m->changed);
+  free(m);
+  env->merger = NULL;
+}
+
+/**
+ * 将构建索引时写入的所有有序段（run）一次性多路归并为1个段，
+ * 并将其记录到segments表中。归并后删除各个run
+ * @param[in,out] env 存储着应用程序运行环境的结构体
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+merge_runs(wiser_env *env)
+{
+  int n = env->n_segments;
+  segment *merged;
+
+  if (!n) { return 0; }
+  if (n == 1) {
+    /* 只有1个run时，直接将其作为最终的段 */
+    const segment *seg = env->segments[0];
+    return db_add_segment(env, seg->id, seg->header->min_document_id,
+                          seg->header->max_document_id, seg->map_size)
+           ? -1 : 0;
+  }
+  print_error("merging %d runs.", n);
+  if (!(merged = merge_segments(env, env->segments, n,
+                                ++env->max_segment_id))) {
+    return -1;
+  }
+  if (replace_segments(env, 0, n, merged)) {
+    char *path = get_segment_path(env, merged->id);
+    close_segment(merged);
+    if (path) {
+      unlink(path);
+      free(path);
+    }
+    return -1;
+  }
+  print_error("%d runs merged into segment %d: %d tokens, %zu bytes.",
+              n, merged->id, merged->header->n_tokens, merged->map_size);
+  return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef __SEGMENT_H__
+#define __SEGMENT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "wiser.h"
+
+/* 段文件开头的魔数 */
+#define SEGMENT_MAGIC "WISERSEG"
+/* 段文件格式的版本 */
+#define SEGMENT_VERSION 1
+
+/*
+ * 段文件（不可变）的结构。各整数均以本机字节序存储
+ *   segment_header
+ *   各词元的带跳表的倒排列表（按词元编号的升序排列，各自按8字节对齐）
+ *   segment_dict_entry[n_tokens]（按词元编号的升序排列的词元词典）
+ */
+
+/* 段文件的头部 */
+typedef struct {
+  char magic[8];           /* 魔数。为SEGMENT_MAGIC */
+  int32_t version;         /* 格式的版本 */
+  int32_t n_tokens;        /* 词元数 */
+  int32_t min_document_id; /* 段中最小的文档编号 */
+  int32_t max_document_id; /* 段中最大的文档编号 */
+  uint64_t dict_offset;    /* 词元词典在文件中的起始位置 */
+  uint64_t file_size;      /* 文件的字节数 */
+} segment_header;
+
+/* 段文件的词元词典中的1项 */
+typedef struct {
+  int32_t token_id;        /* 词元编号 */
+  int32_t docs_count;      /* 倒排列表中的文档数 */
+  uint64_t offset;         /* 倒排列表在文件中的起始位置 */
+  int32_t size;            /* 倒排列表的字节数 */
+  int32_t reserved;        /* 未使用 */
+} segment_dict_entry;
+
+/* 用mmap打开的段 */
+typedef struct _segment {
+  int id;                          /* 段的编号 */
+  const char *map;                 /* 映射到内存中的文件 */
+  size_t map_size;                 /* 映射的字节数 */
+  const segment_header *header;    /* 段文件的头部 */
+  const segment_dict_entry *dict;  /* 词元词典 */
+} segment;
+
+/* 用于写入段文件的结构体 */
+typedef struct {
+  FILE *fp;                    /* 临时文件 */
+  char *path;                  /* 段文件的路径 */
+  char *tmp_path;              /* 临时文件的路径 */
+  segment_header header;       /* 段文件的头部 */
+  segment_dict_entry *dict;    /* 已写入的倒排列表的词元词典 */
+  int dict_capacity;           /* dict中可以容纳的项数 */
+  uint64_t offset;             /* 下一个倒排列表的写入位置 */
+} segment_writer;
+
+segment *open_segment(const char *path, int id);
+void close_segment(segment *seg);
+int segment_get_postings(const segment *seg, int token_id,
+                         const char **postings_e, int *postings_e_size,
+                         int *docs_count);
+segment_writer *open_segment_writer(const char *path);
+int segment_writer_add(segment_writer *w, int token_id, int docs_count,
+                       const void *postings_e, int postings_e_size);
+int close_segment_writer(segment_writer *w, int min_document_id,
+                         int max_document_id);
+void abort_segment_writer(segment_writer *w);
+char *get_segment_path(const wiser_env *env, int id);
+int load_segments(wiser_env *env);
+void free_segments(wiser_env *env);
+int flush_segment(wiser_env *env, inverted_index_hash *ii);
+int get_segments_docs_count(const wiser_env *env, int token_id);
+int start_segment_merger(wiser_env *env);
+void stop_segment_merger(wiser_env *env);
+int merge_runs(wiser_env *env);
+
+#endif /* __SEGMENT_H__ */
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "search.h"
+#include "database.h"
+#include "server.h"
+
+/* 收到结束信号时设为真 */
+static volatile sig_atomic_t server_stopping = 0;
+
+/**
+ * 处理结束信号
+ * @param[in] sig 信号的编号
+ */
+static void
+stop_server(int sig)
+{
+  server_stopping = 1;
+}
+
+/**
+ * 处理1个连接。逐行读取查询，依次进行检索并返回结果
+ * 每个查询的检索结果以1个空行结尾
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] fd 连接的文件描述符
+ */
+static void
+serve_connection(wiser_env *env, int fd)
+{
+  int wfd;
+  FILE *in, *out;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  ssize_t line_len;
+
+  if ((wfd = dup(fd)) < 0) {
+    close(fd);
+    return;
+  }
+  if (!(in = fdopen(fd, "r"))) {
+    close(fd);
+    close(wfd);
+    return;
+  }
+  if (!(out = fdopen(wfd, "w"))) {
+    fclose(in);
+    close(wfd);
+    return;
+  }
+  while (!server_stopping &&
+         (line_len = getline(&line, &line_capacity, in)) >= 0) {
+    /* 去掉行尾的换行符 */
+    while (line_len && (line[line_len - 1] == '\n' ||
+                        line[line_len - 1] == '\r')) {
+      line[--line_len] = '\0';
+    }
+    if (line_len) {
+      search(env, line, out);
+      db_reset_statements(env);
+    }
+    fputc('\n', out);
+    if (fflush(out)) { break; }
+  }
+  free(line);
+  fclose(out);
+  fclose(in);
+}
+
+/**
+ * 以服务器模式运行。在Unix域套接字上等待连接，并逐个处理连接
+ * 在收到SIGINT或SIGTERM之前，应用程序的运行环境、数据库连接和各种缓存会一直保留
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] socket_path 套接字的路径
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+run_server(wiser_env *env, const char *socket_path)
+{
+  int sock;
+  struct sockaddr_un addr;
+  struct sigaction sa;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    print_error("too long socket path: %s", socket_path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    print_error("cannot create a socket: %s", strerror(errno));
+    return -1;
+  }
+  unlink(socket_path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(sock, SOMAXCONN)) {
+    print_error("cannot listen on %s: %s", socket_path, strerror(errno));
+    close(sock);
+    return -1;
+  }
+
+  /* 不设置SA_RESTART，使accept在收到信号后返回 */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_server;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  /* 客户端提前断开连接时不结束进程 */
+  signal(SIGPIPE, SIG_IGN);
+
+  db_reset_statements(env);
+  print_error("listening on %s", socket_path);
+  while (!server_stopping) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        print_error("cannot accept a connection: %s", strerror(errno));
+      }
+      continue;
+    }
+    serve_connection(env, fd);
+  }
+  close(sock);
+  unlink(socket_path);
+  return 0;
+}
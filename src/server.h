@@ -0,0 +1,8 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "wiser.h"
+
+int run_server(wiser_env *env, const char *socket_path);
+
+#endif /* __SERVER_H__ */
@@ -0,0 +1,187 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "streamvbyte.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define STREAMVBYTE_SSSE3
+#endif
+
+/*
+ * Stream VByte编码
+ * 以4个整数为1组，先存储每组1字节的控制字节，再存储数据字节。
+ * 控制字节中每2个比特表示1个整数所占的字节数减1（从低位开始），
+ * 数据字节中的各个整数用小端序存储1～4个字节。
+ * 由于控制字节和数据字节是分开存储的，所以解码时可以根据控制字节查表，
+ * 用1次字节重排指令还原出4个整数
+ */
+
+/* 各控制字节所对应的1组数据的字节数 */
+static uint8_t group_sizes[256];
+/* 各控制字节所对应的字节重排表 */
+static uint8_t shuffle_masks[256][16];
+/* 用于只初始化1次上述各表 */
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/* 解码整组数据的函数。根据CPU支持的指令集选择 */
+static const char *(*decode_groups)(const uint8_t *ctrl, int n_groups,
+                                    const char *in, const char *in_end,
+                                    uint32_t *out);
+
+/**
+ * 用标量运算对整组数据进行解码
+ * @param[in] ctrl 控制字节的序列
+ * @param[in] n_groups 组数
+ * @param[in] in 数据字节的开头
+ * @param[in] in_end 数据字节的结尾
+ * @param[out] out 解码后的整数
+ * @return 解码后的数据字节的下一个字节。数据已损坏时为NULL
+ */
+static const char *
+decode_groups_scalar(const uint8_t *ctrl, int n_groups,
+                     const char *in, const char *in_end, uint32_t *out)
+{
+  int i, k;
+
+  for (i = 0; i < n_groups; i++) {
+    if (in + group_sizes[ctrl[i]] > in_end) { return NULL; }
+    for (k = 0; k < 4; k++) {
+      int j, len = ((ctrl[i] >> (k * 2)) & 3) + 1;
+      uint32_t v = 0;
+      for (j = 0; j < len; j++) {
+        v |= (uint32_t)(uint8_t)in[j] << (j * 8);
+      }
+      *out++ = v;
+      in += len;
+    }
+  }
+  return in;
+}
+
+#ifdef STREAMVBYTE_SSSE3
+/**
+ * 用SSSE3的字节重排指令对整组数据进行解码
+ * 剩余的数据字节不足16字节时，为了不越界读取，改用标量运算
+ * @param[in] ctrl 控制字节的序列
+ * @param[in] n_groups 组数
+ * @param[in] in 数据字节的开头
+ * @param[in] in_end 数据字节的结尾
+ * @param[out] out 解码后的整数
+ * @return 解码后的数据字节的下一个字节。数据已损坏时为NULL
+ */
+__attribute__((target("ssse3")))
+static const char *
+decode_groups_ssse3(const uint8_t *ctrl, int n_groups,
+                    const char *in, const char *in_end, uint32_t *out)
+{
+  int i;
+
+  for (i = 0; i < n_groups && in_end - in >= 16; i++) {
+    __m128i data = _mm_loadu_si128((const __m128i *)in);
+    __m128i mask = _mm_loadu_si128((const __m128i *)shuffle_masks[ctrl[i]]);
+    _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(data, mask));
+    in += group_sizes[ctrl[i]];
+    out += 4;
+  }
+  return decode_groups_scalar(ctrl + i, n_groups - i, in, in_end, out);
+}
+#endif /* STREAMVBYTE_SSSE3 */
+
+/**
+ * 初始化解码时用到的各表，并选择解码函数
+ */
+static void
+init_tables(void)
+{
+  int c, k;
+
+  for (c = 0; c < 256; c++) {
+    int size = 0;
+    for (k = 0; k < 4; k++) {
+      int j, len = ((c >> (k * 2)) & 3) + 1;
+      for (j = 0; j < 4; j++) {
+        /* 最高位为1的下标会被字节重排指令置为0 */
+        shuffle_masks[c][k * 4 + j] = j < len ? size + j : 0x80;
+      }
+      size += len;
+    }
+    group_sizes[c] = size;
+  }
+  decode_groups = decode_groups_scalar;
+#ifdef STREAMVBYTE_SSSE3
+  if (__builtin_cpu_supports("ssse3")) {
+    decode_groups = decode_groups_ssse3;
+  }
+#endif /* STREAMVBYTE_SSSE3 */
+}
+
+/**
+ * 用Stream VByte对整数序列进行编码，并将结果追加到缓冲区中
+ * @param[in] in 待编码的整数序列
+ * @param[in] n 待编码的整数的个数
+ * @param[in,out] out 存储编码结果的缓冲区
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+streamvbyte_encode(const uint32_t *in, int n, buffer *out)
+{
+  int i, ctrl_size = (n + 3) / 4;
+  uint8_t *ctrl;
+  char *data;
+
+  /* 预先确保缓冲区足够大，然后直接写入缓冲区 */
+  if (append_buffer(out, NULL, ctrl_size + sizeof(uint32_t) * n) !=
+      ctrl_size + sizeof(uint32_t) * n) {
+    return -1;
+  }
+  ctrl = (uint8_t *)out->curr;
+  data = out->curr + ctrl_size;
+  memset(ctrl, 0, ctrl_size);
+  for (i = 0; i < n; i++) {
+    uint32_t v = in[i];
+    int len = v < (1U << 8) ? 1 : v < (1U << 16) ? 2 : v < (1U << 24) ? 3 : 4;
+    ctrl[i / 4] |= (len - 1) << ((i % 4) * 2);
+    for (; len; len--, v >>= 8) { *data++ = (char)(v & 0xff); }
+  }
+  out->curr = data;
+  return 0;
+}
+
+/**
+ * 对用Stream VByte编码的整数序列进行解码
+ * @param[in] in 编码后的数据的开头
+ * @param[in] in_end 编码后的数据的结尾
+ * @param[in] n 待解码的整数的个数
+ * @param[out] out 解码后的整数。至少要能容纳n个整数
+ * @return 解码后的数据的下一个字节。数据已损坏时为NULL
+ */
+const char *
+streamvbyte_decode(const char *in, const char *in_end, int n, uint32_t *out)
+{
+  int rest;
+  const uint8_t *ctrl = (const uint8_t *)in;
+
+  pthread_once(&tables_once, init_tables);
+  if (in_end - in < (n + 3) / 4) { return NULL; }
+  in += (n + 3) / 4;
+  if (!(in = decode_groups(ctrl, n / 4, in, in_end, out))) { return NULL; }
+  /* 对最后1个不满4个整数的组进行解码 */
+  if ((rest = n % 4)) {
+    int j, k;
+    uint8_t last = ctrl[n / 4];
+    out += n - rest;
+    for (k = 0; k < rest; k++) {
+      int len = ((last >> (k * 2)) & 3) + 1;
+      uint32_t v = 0;
+      if (in + len > in_end) { return NULL; }
+      for (j = 0; j < len; j++) {
+        v |= (uint32_t)(uint8_t)in[j] << (j * 8);
+      }
+      *out++ = v;
+      in += len;
+    }
+  }
+  return in;
+}
@@ -0,0 +1,12 @@
+#ifndef __STREAMVBYTE_H__
+#define __STREAMVBYTE_H__
+
+#include <stdint.h>
+
+#include "util.h"
+
+int streamvbyte_encode(const uint32_t *in, int n, buffer *out);
+const char *streamvbyte_decode(const char *in, const char *in_end,
+                               int n, uint32_t *out);
+
+#endif /* __STREAMVBYTE_H__ */
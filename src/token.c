@@ -1,9 +1,15 @@
 #include "util.h"
 #include "token.h"
+#include "indexer.h"
 #include "postings.h"
 #include "database.h"
+#include "segment.h"
 
 #include <stdio.h>
+#include <stddef.h>
+
+/* 在词元编码中表示“此处没有字符”的值。不是合法的Unicode码位 */
+#define TOKEN_CODE_NO_CHAR 0xffffffff
 
 /**
  * 检查输入的字符（UTF-32）是否不属于索引对象
@@ -70,22 +76,27 @@ ngram_next(const UTF32Char *ustr, const UTF32Char *ustr_end,
 
 /**
  * 为inverted_index_value分配存储空间并对其进行初始化
+ * @param[in,out] a 内存池。为NULL时用malloc分配
+ * @param[in] token_code 词元编码
  * @param[in] token_id 词元编号
  * @param[in] docs_count 包含该词元的文档数
  * @return 生成的inverted_index_value
  */
 static inverted_index_value *
-create_new_inverted_index(int token_id, int docs_count)
+create_new_inverted_index(arena *a, uint64_t token_code, int token_id,
+                          int docs_count)
 {
   inverted_index_value *ii_entry;
 
-  ii_entry = malloc(sizeof(inverted_index_value));
+  ii_entry = arena_alloc(a, sizeof(inverted_index_value));
   if (!ii_entry) {
     print_error("cannot allocate memory for an inverted index.");
     return NULL;
   }
+  ii_entry->arena = a;
   ii_entry->positions_count = 0;
   ii_entry->postings_list = NULL;
+  ii_entry->token_code = token_code;
   ii_entry->token_id = token_id;
   ii_entry->docs_count = docs_count;
 
@@ -93,82 +104,245 @@ create_new_inverted_index(int token_id, int docs_count)
 }
 
 /**
- * 为倒排列表分配存储空间并对其进行并初始化
- * @param[in] document_id 文档编号
- * @return 生成的倒排列表
+ * 将词元添加到词元词典中
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] token_id 词元编号
+ * @param[in] token 词元（UTF-8）
+ * @param[in] token_size 词元的字节数
+ * @return 添加到词元词典中的元素。失败时为NULL
  */
-static postings_list *
-create_new_postings_list(int document_id)
+static token_dictionary *
+add_token_dictionary(wiser_env *env, int token_id,
+                     const char *token, int token_size)
 {
-  postings_list *pl;
+  token_dictionary *td;
 
-  pl = malloc(sizeof(postings_list));
-  if (!pl) {
-    print_error("cannot allocate memory for a postings list.");
+  td = malloc(offsetof(token_dictionary, token) + token_size + 1);
+  if (!td) {
+    print_error("cannot allocate memory for a token dictionary.");
     return NULL;
   }
-  pl->document_id = document_id;
-  pl->positions_count = 1;
-  utarray_new(pl->positions, &ut_int_icd);
+  td->token_id = token_id;
+  td->next_new = NULL;
+  td->token_size = token_size;
+  memcpy(td->token, token, token_size);
+  td->token[token_size] = '\0';
+  HASH_ADD_KEYPTR(hh, env->token_dict, td->token, token_size, td);
+  if (token_id > env->max_token_id) { env->max_token_id = token_id; }
+  return td;
+}
 
-  return pl;
+/**
+ * 将从tokens表中读出的词元添加到词元词典中。db_scan_tokens的回调函数
+ */
+static void
+load_token_dictionary_callback(void *arg, int token_id,
+                               const char *token, int token_size)
+{
+  add_token_dictionary((wiser_env *)arg, token_id, token, token_size);
 }
 
 /**
- * 为传入的词元创建倒排列表
+ * 从词元词典中获取词元编号。若词元尚未分配编号，则为其分配新的编号
+ * 新的词元只会被记录在内存中，直到调用flush_token_dictionary时才写入tokens表
  * @param[in] env 存储着应用程序运行环境的结构体
- * @param[in] document_id 文档编号
  * @param[in] token 词元（UTF-8）
- * @param[in] token_size 词元的长度（以字节为单位）
+ * @param[in] token_size 词元的字节数
+ * @return 词元编号。失败时为0
+ */
+int
+get_token_id(wiser_env *env, const char *token, unsigned int token_size)
+{
+  token_dictionary *td;
+
+  if (!env->token_dict_loaded) {
+    /* 首次使用时，从tokens表中加载所有已存在的词元 */
+    db_scan_tokens(env, load_token_dictionary_callback, env);
+    env->new_tokens_tail = &env->new_tokens;
+    env->token_dict_loaded = TRUE;
+  }
+  HASH_FIND(hh, env->token_dict, token, token_size, td);
+  if (!td) {
+    if (!(td = add_token_dictionary(env, env->max_token_id + 1,
+                                    token, token_size))) {
+      return 0;
+    }
+    *env->new_tokens_tail = td;
+    env->new_tokens_tail = &td->next_new;
+  }
+  return td->token_id;
+}
+
+/**
+ * 将词元词典中新分配了编号的词元写入tokens表
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+flush_token_dictionary(wiser_env *env)
+{
+  token_dictionary *td, *next;
+
+  for (td = env->new_tokens; td; td = next) {
+    next = td->next_new;
+    db_store_token(env, td->token_id, td->token, td->token_size);
+    td->next_new = NULL;
+  }
+  env->new_tokens = NULL;
+  env->new_tokens_tail = &env->new_tokens;
+}
+
+/**
+ * 释放词元词典
+ * @param[in] env 存储着应用程序运行环境的结构体
+ */
+void
+free_token_dictionary(wiser_env *env)
+{
+  token_dictionary *td, *tmp;
+
+  HASH_ITER(hh, env->token_dict, td, tmp) {
+    HASH_DEL(env->token_dict, td);
+    free(td);
+  }
+  env->new_tokens = NULL;
+  env->new_tokens_tail = &env->new_tokens;
+  env->token_dict_loaded = FALSE;
+}
+
+/**
+ * 将词元的出现位置添加到倒排列表中
+ * @param[in] token_code 词元编码
+ * @param[in] token_id 词元编号。按词元编码构建索引时为0
+ * @param[in] token_docs_count 出现过该词元的文档数
+ * @param[in] document_id 文档编号
  * @param[in] position 词元出现的位置
  * @param[in,out] postings 倒排列表的数组
+ * @param[in,out] a 分配新的索引项和倒排列表的内存池。为NULL时用malloc分配
  * @retval 0 成功
  * @retval -1 失败
  */
-int
-token_to_postings_list(wiser_env *env,
-                       const int document_id, const char *token,
-                       const unsigned int token_size,
-                       const int position,
-                       inverted_index_hash **postings)
+static int
+add_token_position(uint64_t token_code, int token_id, int token_docs_count,
+                   const int document_id, const int position,
+                   inverted_index_hash **postings, arena *a)
 {
   postings_list *pl;
   inverted_index_value *ii_entry;
-  int token_id, token_docs_count;
 
-  token_id = db_get_token_id(
-               env, token, token_size, document_id, &token_docs_count);  //获取词元对应的编号
-  /*
-  如果之前已将编号分配给了该词元,那么在此处获取的正是这个编号;
-  反之,如果之前没有分配编号,那么函数 db_get_token_id() 会为该词元分配一个新的编号。
-  */
   if (*postings) {  //如果存在已经构建好的小倒排索引
-    HASH_FIND_INT(*postings, &token_id, ii_entry);  //从中获取关联到该词元编号上的倒排列表
-  } else {  //如果找不到以 token_id 为键的倒排列表
+    HASH_FIND_TOKEN(*postings, &token_code, ii_entry);  //从中获取关联到该词元上的倒排列表
+  } else {  //如果找不到以 token_code 为键的倒排列表
     ii_entry = NULL;  //将变量 ii_entry 的值设为 NULL
   }
   if (ii_entry) {  //如果变量 ii_entry 的值不为 NULL,小倒排索引中存在关联到该词元上的倒排列表
     pl = ii_entry->postings_list;  //先将指针 pl 指向该倒排列表
-    pl->positions_count++;  //然后再将该倒排列表中词元的出现次数增加 1,在计算用于对检索结果进行排名的分数时,会用到词元的出现次数
+    /* 该词元在新的文档中出现时，增加出现过该词元的文档数 */
+    if (document_id && pl->document_ids[pl->len - 1] != document_id) {
+      ii_entry->docs_count++;
+    }
   } else {  //如果变量 ii_entry 的值为 NULL ,也就是说小倒排索引中不存在关联到该词元上的倒排列表
-    ii_entry = create_new_inverted_index(token_id,
+    ii_entry = create_new_inverted_index(a, token_code, token_id,
                                          document_id ? 1 : token_docs_count);  //生成一个空的小倒排索引
     if (!ii_entry) { return -1; }
-    HASH_ADD_INT(*postings, token_id, ii_entry);  //将该词元添加到新建的小倒排索引中
+    HASH_ADD_TOKEN(*postings, ii_entry);  //将该词元添加到新建的小倒排索引中
 
-    pl = create_new_postings_list(document_id);  //创建出了仅由 1 个文档构成的倒排列表 pl
+    pl = arena_alloc_postings_list(a, 1, 1);  //创建出空的倒排列表 pl
     if (!pl) { return -1; }
-    LL_APPEND(ii_entry->postings_list, pl);  //将该倒排列表添加到了刚刚生成的小倒排索引中
-    /*
-    此时,指针 pl 指向关联到词元上的倒排列表
-    */
+    ii_entry->postings_list = pl;  //将该倒排列表添加到了刚刚生成的小倒排索引中
   }
-  /* 存储位置信息 */
-  utarray_push_back(pl->positions, &position);  //将词元的出现位置添加到了倒排列表中存储着出现位置的数组的末尾
+  /* 存储位置信息。出现次数由位置信息的条数得出，在计算用于对检索结果进行排名的分数时，会用到词元的出现次数 */
+  if (add_postings_position(pl, document_id, position)) { return -1; }  //将词元的出现位置添加到了倒排列表中存储着出现位置的数组的末尾
   ii_entry->positions_count++;  //将当前词元在所有文档中的出现次数之和增加 1 。出现次数之和的数据存储在关联到词元的倒排列表中
   return 0;
 }
 
+/**
+ * 为传入的词元创建倒排列表
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] document_id 文档编号
+ * @param[in] token 词元（UTF-8）
+ * @param[in] token_size 词元的长度（以字节为单位）
+ * @param[in] position 词元出现的位置
+ * @param[in,out] postings 倒排列表的数组
+ * @param[in,out] a 分配新的索引项和倒排列表的内存池。为NULL时用malloc分配
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+token_to_postings_list(wiser_env *env,
+                       const int document_id, const char *token,
+                       const unsigned int token_size,
+                       const int position,
+                       inverted_index_hash **postings, arena *a)
+{
+  int token_id, token_docs_count = 0;
+
+  lock_indexer_db(env);
+  if (document_id) {
+    /* 构建索引时，从内存中的词元词典获取词元对应的编号 */
+    token_id = get_token_id(env, token, token_size);
+  } else {
+    token_id = db_get_token_id(
+                 env, token, token_size, 0, &token_docs_count);  //获取词元对应的编号
+    if (env->format == index_format_segment) {
+      /* 段格式不更新tokens表中的文档数，而是由各段的词元词典得出 */
+      token_docs_count = get_segments_docs_count(env, token_id);
+    }
+  }
+  unlock_indexer_db(env);
+  /*
+  如果之前已将编号分配给了该词元,那么在此处获取的正是这个编号;
+  反之,如果之前没有分配编号,那么函数 get_token_id() 会为该词元分配一个新的编号。
+  */
+  return add_token_position(token_id, token_id, token_docs_count,
+                            document_id, position, postings, a);
+}
+
+/**
+ * 将长度不超过TOKEN_CODE_MAX_LEN的词元（UTF-32）拼成64位的词元编码
+ * 高32位为第1个字符，低32位为第2个字符。词元只有1个字符时，低32位为TOKEN_CODE_NO_CHAR
+ * @param[in] token 词元（UTF-32）
+ * @param[in] token_len 词元的长度
+ * @return 词元编码
+ */
+static inline uint64_t
+utf32_to_token_code(const UTF32Char *token, int token_len)
+{
+  return ((uint64_t)token[0] << 32) |
+         (token_len > 1 ? token[1] : TOKEN_CODE_NO_CHAR);
+}
+
+/**
+ * 为倒排索引中按词元编码添加的词元分配词元编号
+ * 只有在这时才会把词元编码还原为字符串（UTF-8），并在词元词典中查找
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in,out] ii 倒排索引
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+int
+resolve_token_codes(wiser_env *env, inverted_index_hash *ii)
+{
+  inverted_index_value *p;
+
+  for (p = ii; p; p = p->hh.next) {
+    if (!p->token_id) {
+      int token_len, token_size;
+      UTF32Char token[TOKEN_CODE_MAX_LEN];
+      char token_8[TOKEN_CODE_MAX_LEN * MAX_UTF8_SIZE + 1];
+
+      token[0] = p->token_code >> 32;
+      token[1] = p->token_code & 0xffffffff;
+      token_len = token[1] == TOKEN_CODE_NO_CHAR ? 1 : 2;
+      utf32toutf8(token, token_len, token_8, &token_size);
+      if (!(p->token_id = get_token_id(env, token_8, token_size))) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
 /**
  * 为构成文档内容的字符串建立倒排列表的集合
  * @param[in] env 存储着应用程序运行环境的结构体
@@ -178,7 +352,8 @@ token_to_postings_list(wiser_env *env,
  * @param[in] n N-gram中N的取值
  * @param[in,out] postings 倒排列表的数组（也可视作是指向小倒排索引的指针）。若传入的指针指向了NULL，
  *                         则表示要新建一个倒排列表的数组（小倒排索引）。若传入的指针指向了之前就已经存在的倒排列表的数组，
- *                         则表示要添加元素
+ *                         则表示要添加元素。文档编号须大于已添加的文档编号
+ * @param[in,out] a 分配新的索引项和倒排列表的内存池。为NULL时用malloc分配
  * @retval 0 成功
  * @retval -1 失败
  */
@@ -186,34 +361,31 @@ int
 text_to_postings_lists(wiser_env *env,
                        const int document_id, const UTF32Char *text,
                        const unsigned int text_len,
-                       const int n, inverted_index_hash **postings)
+                       const int n, inverted_index_hash **postings,
+                       arena *a)
 {
-  /* FIXME: now same document update is broken. */
   int t_len, position = 0;
   const UTF32Char *t = text, *text_end = text + text_len;
 
-  inverted_index_hash *buffer_postings = NULL;
-
   for (; (t_len = ngram_next(t, text_end, n, &t)); t++, position++) {  //通过调用位于 token.c 中的函数 ngram_next() ,从字符串 t 中取出了一个 N-gram ,同时还获取了词元的长度 t_len 和指向其首地址的指针 t
     /* 检索时，忽略掉由t中长度不足N-gram的最后几个字符构成的词元 */
-    if (t_len >= n || document_id) {
+    if (document_id && n <= TOKEN_CODE_MAX_LEN) {
+      /* 构建索引时，直接以由字符拼成的词元编码作为键。词元编号在写入前才分配 */
+      int retval = add_token_position(utf32_to_token_code(t, t_len), 0, 1,
+                                      document_id, position, postings, a);
+      if (retval) { return retval; }
+    } else if (t_len >= n || document_id) {
       int retval, t_8_size;
       char t_8[n * MAX_UTF8_SIZE];
 
       utf32toutf8(t, t_len, t_8, &t_8_size);  //将词元的字符编码由 UTF-32 转换成了 UTF-8
 
       retval = token_to_postings_list(env, document_id, t_8, t_8_size,
-                                      position, &buffer_postings);  //将该词元添加到倒排列表中
+                                      position, postings, a);  //将该词元添加到倒排列表中
       if (retval) { return retval; }
     }
   }
 
-  if (*postings) {  //如果已经存在小倒排索引了
-    merge_inverted_index(*postings, buffer_postings);  //将其与刚刚构建出的倒排索引合并
-  } else {  //如果还没有小倒排索引
-    *postings = buffer_postings;  //将刚刚构建出的倒排索引作为小倒排索引
-  }
-
   return 0;
 }
 
@@ -1,17 +1,24 @@
 #ifndef __TOKEN_H__
 #define __TOKEN_H__
 
+#include "util.h"
 #include "wiser.h"
 
 int text_to_postings_lists(wiser_env *env,
                            const int document_id, const UTF32Char *text,
                            const unsigned int text_len,
-                           const int n, inverted_index_hash **postings);
+                           const int n, inverted_index_hash **postings,
+                           arena *a);
+int get_token_id(wiser_env *env, const char *token,
+                 unsigned int token_size);
+void flush_token_dictionary(wiser_env *env);
+int resolve_token_codes(wiser_env *env, inverted_index_hash *ii);
+void free_token_dictionary(wiser_env *env);
 void dump_token(wiser_env *env, int token_id);
 int token_to_postings_list(wiser_env *env,
                            const int document_id, const char *token,
                            const unsigned int token_size,
                            const int position,
-                           inverted_index_hash **postings);
+                           inverted_index_hash **postings, arena *a);
 
 #endif /* __TOKEN_H__ */
@@ -1,5 +1,7 @@
 #include <time.h>
+#include <errno.h>
 #include <stdio.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <memory.h>
@@ -8,6 +10,7 @@
 #include "util.h"
 
 #define BUFFER_INIT_MIN 32 /* 分配缓冲区时的初始字节数 */
+#define ARENA_ALIGN 8      /* 从内存池中分配的内存的对齐字节数 */
 
 /**
  * 将错误信息输出到标准错误输出
@@ -84,7 +87,7 @@ int
 append_buffer(buffer *buf, const void *data, unsigned int data_size)
 {
   if (buf->bit) { buf->curr++; buf->bit = 0; }
-  if (buf->curr + data_size > buf->tail) {
+  while (buf->curr + data_size > buf->tail) {
     if (enlarge_buffer(buf)) { return 0; }
   }
   if (data && data_size) {
@@ -121,6 +124,134 @@ free_buffer(buffer *buf)
   free(buf);
 }
 
+/**
+ * 分配一个内存池。块在第一次分配内存时才会被分配
+ * @param[in] block_size 块的字节数
+ * @return 分配好的内存池。失败时为NULL
+ */
+arena *
+alloc_arena(size_t block_size)
+{
+  arena *a;
+  if ((a = calloc(1, sizeof(arena)))) {
+    a->block_size = block_size;
+  } else {
+    print_error("cannot allocate memory for an arena.");
+  }
+  return a;
+}
+
+/**
+ * 从内存池中分配内存
+ * @param[in,out] a 内存池。为NULL时用malloc分配
+ * @param[in] size 字节数
+ * @return 分配好的内存。失败时为NULL
+ */
+void *
+arena_alloc(arena *a, size_t size)
+{
+  arena_block *b;
+
+  if (!a) { return malloc(size); }
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (!(b = a->head) || b->used + size > b->size) {
+    size_t block_size = size > a->block_size ? size : a->block_size;
+    if (!(b = malloc(sizeof(arena_block) + block_size))) { return NULL; }
+    b->size = block_size;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
+  }
+  a->last = b->data + b->used;
+  b->used += size;
+  a->size += size;
+  return a->last;
+}
+
+/**
+ * 扩大或缩小从内存池中分配的内存
+ * 若p是最后分配的内存且当前块中有足够的空间，则就地扩展；否则复制到新分配的内存中
+ * @param[in,out] a 内存池。为NULL时用realloc分配
+ * @param[in] p 之前分配的内存
+ * @param[in] old_size 之前分配的字节数
+ * @param[in] new_size 新的字节数
+ * @return 分配好的内存。失败时为NULL
+ */
+void *
+arena_realloc(arena *a, void *p, size_t old_size, size_t new_size)
+{
+  void *q;
+
+  if (!a) { return realloc(p, new_size); }
+  if (p && p == a->last) {
+    arena_block *b = a->head;
+    size_t offset = (char *)p - b->data;
+    size_t size = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (offset + size <= b->size) {
+      a->size += size - (b->used - offset);
+      b->used = offset + size;
+      return p;
+    }
+  }
+  if ((q = arena_alloc(a, new_size)) && p) {
+    memcpy(q, p, old_size < new_size ? old_size : new_size);
+  }
+  return q;
+}
+
+/**
+ * 获取从内存池中分配出去的字节数。为重新分配而废弃的部分也包括在内
+ * @param[in] a 内存池
+ * @return 字节数。重置内存池后为0
+ */
+size_t
+arena_size(const arena *a)
+{
+  return a->size;
+}
+
+/**
+ * 一次性释放从内存池中分配的所有内存。保留1个块以便再次使用
+ * @param[in,out] a 内存池
+ */
+void
+reset_arena(arena *a)
+{
+  arena_block *b, *keep = NULL;
+
+  while ((b = a->head)) {
+    a->head = b->next;
+    if (!keep && b->size == a->block_size) {
+      keep = b;
+    } else {
+      free(b);
+    }
+  }
+  a->size = 0;
+  a->last = NULL;
+  if (keep) {
+    keep->used = 0;
+    keep->next = NULL;
+    a->head = keep;
+  }
+}
+
+/**
+ * 释放内存池及从中分配的所有内存
+ * @param[in] a 内存池
+ */
+void
+free_arena(arena *a)
+{
+  arena_block *b;
+
+  while ((b = a->head)) {
+    a->head = b->next;
+    free(b);
+  }
+  free(a);
+}
+
 /**
  * 计算将字符串的编码由UTF-32转换为UTF-8时所需的字节数
  * @param[in] ustr 输入的字符串（UTF-32）
@@ -318,6 +449,18 @@ timeval_to_double(struct timeval *tv)
   return ((double)(tv->tv_sec) + (double)(tv->tv_usec) * 0.000001);
 }
 
+/**
+ * 获取用于测量经过时间的当前时刻。不受系统时钟调整的影响
+ * @return 从某个固定时刻开始经过的秒数
+ */
+double
+get_monotonic_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 /**
  * 获取当前时间，计算其与上一次获取的当前时间的差值，并输出这两个数据
  */
@@ -340,3 +483,38 @@ print_time_diff(void)
   }
   pre_time = current_time;
 }
+
+/**
+ * 将表示字节数的字符串转换为数值。可以使用K、M、G作为后缀
+ * @param[in] str 表示字节数的字符串。例如"64M"
+ * @return 字节数。字符串不正确时为-1
+ */
+long long
+parse_size(const char *str)
+{
+  char *end;
+  int shift = 0;
+  long long size;
+
+  errno = 0;
+  size = strtoll(str, &end, 10);
+  if (end == str || size < 0 || errno == ERANGE) { return -1; }
+  switch (*end) {
+  case 'k': case 'K':
+    shift = 10;
+    end++;
+    break;
+  case 'm': case 'M':
+    shift = 20;
+    end++;
+    break;
+  case 'g': case 'G':
+    shift = 30;
+    end++;
+    break;
+  }
+  /* 乘以单位后超出long long的范围时视为不正确 */
+  if (size > (LLONG_MAX >> shift)) { return -1; }
+  size <<= shift;
+  return *end ? -1 : size;
+}
@@ -1,6 +1,7 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint32_t
@@ -17,17 +18,41 @@ typedef struct {
 #define BUFFER_PTR(b) ((b)->head) /* 返回指向缓冲区开头的指针 */
 #define BUFFER_SIZE(b) ((b)->curr - (b)->head) /* 返回缓冲区的大小 */
 
+/* 内存池中的1个块 */
+typedef struct _arena_block {
+  struct _arena_block *next; /* 之前分配的块 */
+  size_t size;               /* data的字节数 */
+  size_t used;               /* data中已分配出去的字节数 */
+  char data[];               /* 分配给调用者的内存 */
+} arena_block;
+
+/* 内存池。只能依次分配内存，不能单独释放，只能一次性全部释放 */
+typedef struct _arena {
+  arena_block *head;  /* 当前用于分配内存的块 */
+  size_t block_size;  /* 块的字节数 */
+  size_t size;        /* 分配出去的字节数之和 */
+  void *last;         /* 最后分配的内存。可以就地扩展 */
+} arena;
+
 int print_error(const char *format, ...);
 buffer *alloc_buffer(void);
 int append_buffer(buffer *buf, const void *data,
                   unsigned int data_size);
 void free_buffer(buffer *buf);
+arena *alloc_arena(size_t block_size);
+void *arena_alloc(arena *a, size_t size);
+void *arena_realloc(arena *a, void *p, size_t old_size, size_t new_size);
+size_t arena_size(const arena *a);
+void reset_arena(arena *a);
+void free_arena(arena *a);
 void append_buffer_bit(buffer *buf, int bit);
 int uchar2utf8_size(const UTF32Char *ustr, int ustr_len);
 char *utf32toutf8(const UTF32Char *ustr, int ustr_len, char *str,
                   int *str_size);
 int utf8toutf32(const char *str, int str_size, UTF32Char **ustr,
                 int *ustr_len);
+double get_monotonic_time(void);
 void print_time_diff(void);
+long long parse_size(const char *str);
 
 #endif /* __UTIL_H__ */
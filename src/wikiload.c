@@ -26,6 +26,7 @@ typedef struct {
   int article_count;          /* 经过解析的词条总数 */
   int max_article_count;      /* 最多要解析多少个词条 */
   add_document_callback func; /* 将解析后的文档传递给该函数 */
+  int failed;                 /* 回调函数是否返回了错误。出错后不再传递文档 */
 } wikipedia_parser;
 
 /**
@@ -103,9 +104,10 @@ end(void *user_data, const XML_Char *el)
   case IN_PAGE_REVISION_TEXT:
     if (!strcmp(el, "text")) {
       p->status = IN_PAGE_REVISION;
-      if (p->max_article_count < 0 ||
-          p->article_count < p->max_article_count) {
-        p->func(p->env, utstring_body(p->title), utstring_body(p->body));
+      if (!p->failed && (p->max_article_count < 0 ||
+                         p->article_count < p->max_article_count) &&
+          p->func(p->env, utstring_body(p->title), utstring_body(p->body))) {
+        p->failed = 1;
       }
       utstring_free(p->title);
       utstring_free(p->body);
@@ -146,13 +148,15 @@ element_data(void *user_data, const XML_Char *data, int data_size)
  * 加载Wikipedia的副本（XML文件），并将其内容传递给指定的函数
  * @param[in] env 存储着应用程序运行环境的结构体
  * @param[in] path Wikipedia副本的路径
- * @param[in] func 接收env，词条标题，词条正文3个参数的回调函数（参看wiser.c的223行）
+ * @param[in] func 接收env，词条标题，词条正文3个参数的回调函数（参看wiser.c的add_document）。
+ *                 返回非0值时停止加载
  * @param[in] max_article_count 最多加载多少个词条
  * @retval 0 成功
  * @retval 1 申请内存失败
  * @retval 2 打开文件失败
  * @retval 3 加载文件失败
  * @retval 4 解析XML文件失败
+ * @retval 5 回调函数返回了错误
  */
 int
 load_wikipedia_dump(wiser_env *env,
@@ -169,7 +173,8 @@ load_wikipedia_dump(wiser_env *env,
     NULL,              /* 词条正文的临时存储区 */
     0,                 /* 初始化经过解析的词条总数 */
     max_article_count, /* 最多要解析多少个词条 */
-    func               /* 将解析后的文档传递给该函数 */
+    func,              /* 将解析后的文档传递给该函数 */
+    0                  /* 回调函数尚未返回错误 */
   };
 
   if (!(xp = XML_ParserCreate("UTF-8"))) {
@@ -204,6 +209,10 @@ load_wikipedia_dump(wiser_env *env,
       rc = 4;
       goto exit;
     }
+    if (wp.failed) {
+      rc = 5;
+      goto exit;
+    }
 
     if (done || (max_article_count >= 0 &&
                  max_article_count <= wp.article_count)) { break; }
@@ -1,67 +1,135 @@
 #include <stdio.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "util.h"
+#include "batch.h"
+#include "cache.h"
 #include "token.h"
 #include "search.h"
+#include "segment.h"
+#include "server.h"
+#include "indexer.h"
 #include "postings.h"
 #include "database.h"
 #include "wikiload.h"
 
+/**
+ * 判断是否需要清空缓冲区，同时记录缓冲区所占字节数的峰值
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @retval TRUE 缓冲区中的文档数或字节数达到了阈值
+ * @retval FALSE 不需要清空缓冲区
+ */
+static int
+ii_buffer_is_full(wiser_env *env)
+{
+  size_t size = arena_size(env->ii_buffer_arena) + indexer_buffer_size(env);
+
+  if (size > env->ii_buffer_peak_size) { env->ii_buffer_peak_size = size; }
+  return env->ii_buffer_count > env->ii_buffer_update_threshold ||
+         (env->ii_buffer_size_limit && size >= env->ii_buffer_size_limit);
+}
+
+/**
+ * 用同一标题的文档的新正文替换缓冲区中的倒排项
+ * 新的倒排列表先建在临时的倒排索引中，再按文档编号的顺序合并到缓冲区中
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] document_id 文档编号
+ * @param[in] body 文档正文
+ * @param[in] body_size 文档正文的字节数
+ */
+static void
+replace_buffered_document(wiser_env *env, int document_id,
+                          const char *body, unsigned int body_size)
+{
+  UTF32Char *body32;
+  int body32_len;
+  inverted_index_hash *ii = NULL;
+
+  /* 旧的正文可能还在分词线程中 */
+  if (env->pipeline) { drain_indexer(env); }
+  remove_inverted_index_document(&env->ii_buffer, document_id);
+  if (utf8toutf32(body, body_size, &body32, &body32_len)) { return; }
+  text_to_postings_lists(env, document_id, body32, body32_len,
+                         env->token_len, &ii, env->ii_buffer_arena);
+  free(body32);
+  if (env->ii_buffer) {
+    merge_inverted_index(env->ii_buffer, ii);
+  } else {
+    env->ii_buffer = ii;
+  }
+}
+
 /**
  * 将文档添加到数据库中，建立倒排索引
+ * 同一标题的文档还在缓冲区中时替换其倒排项，已写入存储器时不更新该文档
  * @param[in] env 存储着应用程序运行环境的结构体
  * @param[in] title 文档标题，为NULL时将会清空缓冲区
  * @param[in] body 文档正文
+ * @retval 0 成功
+ * @retval -1 更新倒排索引失败。此后的调用也都会失败，应回滚事务
  * 
  * 作用：为文档的标题和正文构建倒排索引以及用于存储文档的数据库。
  */
-static void
+static int
 add_document(wiser_env *env, const char *title, const char *body)
 {
+  int full;
+
+  if (env->index_failed) { return -1; }
   if (title && body) {
     UTF32Char *body32;
-    int body32_len, document_id;
+    int body32_len, document_id, inserted;
     unsigned int title_size, body_size;
 
     title_size = strlen(title);
     body_size = strlen(body);
 
     /* 将文档存储到数据库中并获取该文档对应的文档编号 */
-    db_add_document(env, title, title_size, body, body_size);  //将标题和正文存储到了用于存储文档的数据库中
+    lock_indexer_db(env);
+    document_id = db_get_document_id(env, title, title_size);
+    if (document_id && (!env->ii_buffer_min_document_id ||
+                        document_id < env->ii_buffer_min_document_id)) {
+      /* 倒排列表中的文档编号必须严格递增，不能替换已写入存储器的倒排项 */
+      unlock_indexer_db(env);
+      print_error("document already indexed. skipped: %s", title);
+      return 0;
+    }
+    db_add_document(env, title, title_size, body, body_size, &inserted);  //将标题和正文存储到了用于存储文档的数据库中
     document_id = db_get_document_id(env, title, title_size);  //由于 SQLite 会自动为存储到数据库中的记录分配 ID ,所以我们就把这个 ID 用作文档编号
+    unlock_indexer_db(env);
 
-    /* 转换文档正文的字符编码 */
-    if (!utf8toutf32(body, body_size, &body32, &body32_len)) {
+    if (!inserted) {
+      replace_buffered_document(env, document_id, body, body_size);
+    } else if (env->pipeline) {
+      /* 交给分词线程转换字符编码并创建倒排列表 */
+      if (!indexer_add_document(env, document_id, body, body_size)) {
+        env->ii_buffer_count++;
+      }
+    } else if (!utf8toutf32(body, body_size, &body32, &body32_len)) {  //转换文档正文的字符编码
       /* 为文档创建倒排列表 */
       text_to_postings_lists(env, document_id, body32, body32_len,
-                             env->token_len, &env->ii_buffer);  //根据文档编号( document_id )和文档内容( body32 ),更新存储在变量 env->ii_buffer 中的小倒排索引
+                             env->token_len, &env->ii_buffer,
+                             env->ii_buffer_arena);  //根据文档编号( document_id )和文档内容( body32 ),更新存储在变量 env->ii_buffer 中的小倒排索引
       env->ii_buffer_count++;
       free(body32);
     }
+    if (inserted) {
+      /* 文档总数在内存中增量地维护，编码倒排列表时不必再统计documents表 */
+      env->stats.documents_count++;
+      if (!env->ii_buffer_min_document_id) {
+        env->ii_buffer_min_document_id = document_id;
+      }
+    }
     env->indexed_count++;
     print_error("count:%d title: %s", env->indexed_count, title);
   }
 
-  /* 存储在缓冲区中的文档数量达到了指定的阈值时，更新存储器上的倒排索引 */
-  if (env->ii_buffer &&
-      (env->ii_buffer_count > env->ii_buffer_update_threshold || !title)) {  //判断是否需要合并索引
-    inverted_index_hash *p;
-
-    print_time_diff();
-
-    /* 更新所有词元对应的倒排项 */
-    for (p = env->ii_buffer; p != NULL; p = p->hh.next) {
-      update_postings(env, p);  //合并倒排索引,并将合并后的结果写入数据库(存储器)中
-    }
-    free_inverted_index(env->ii_buffer);
-    print_error("index flushed.");
-    env->ii_buffer = NULL;
-    env->ii_buffer_count = 0;
-
-    print_time_diff();
-  }
+  /* 存储在缓冲区中的文档数量或字节数达到了指定的阈值时，更新存储器上的倒排索引 */
+  full = !title || ii_buffer_is_full(env);
+  return full ? flush_ii_buffer(env) : 0;
 }
 
 /**
@@ -69,22 +137,31 @@ add_document(wiser_env *env, const char *title, const char *body)
  * @param[in] env 存储着应用程序运行环境的结构体
  * @param[in] ii_buffer_update_threshold 清空（Flush）倒排索引缓冲区的阈值
  * @param[in] enable_phrase_search 是否启用短语检索
+ * @param[in] top_k 输出的检索结果的最大数量。为0时输出全部
  * @param[in] db_path 数据库的路径
+ * @param[in] pragmas sqlite3的PRAGMA的列表。为NULL时不设置
  * @return 错误代码
  * @retval 0 成功
  */
 static int
 init_env(wiser_env *env,
          int ii_buffer_update_threshold, int enable_phrase_search,
-         const char *db_path)
+         int top_k, const char *db_path, const char *pragmas)
 {
   int rc;
   memset(env, 0, sizeof(wiser_env));
-  rc = init_database(env, db_path);
+  rc = init_database(env, db_path, pragmas);
+  if (!rc &&
+      (!(env->ii_buffer_arena = alloc_arena(II_BUFFER_ARENA_BLOCK_SIZE)) ||
+       !(env->query_arena = alloc_arena(QUERY_ARENA_BLOCK_SIZE)))) {
+    rc = -1;
+  }
   if (!rc) {
+    env->db_path = db_path;
     env->token_len = N_GRAM;
     env->ii_buffer_update_threshold = ii_buffer_update_threshold;
     env->enable_phrase_search = enable_phrase_search;
+    env->top_k = top_k;
   }
   return rc;
 }
@@ -96,6 +173,14 @@ init_env(wiser_env *env,
 static void
 fin_env(wiser_env *env)
 {
+  free_token_dictionary(env);
+  if (env->postings_cache) {
+    print_postings_cache_stats(env->postings_cache);
+    free_postings_cache(env->postings_cache);
+  }
+  free_segments(env);
+  if (env->ii_buffer_arena) { free_arena(env->ii_buffer_arena); }
+  if (env->query_arena) { free_arena(env->query_arena); }
   fin_database(env);
 }
 
@@ -118,6 +203,8 @@ parse_compress_method(wiser_env *env, const char *method,
     env->compress = compress_golomb;
   } else if (MEMSTRCMP(method, method_size, "none")) {
     env->compress = compress_none;
+  } else if (MEMSTRCMP(method, method_size, "streamvbyte")) {
+    env->compress = compress_streamvbyte;
   } else {
     print_error("invalid compress method(%.*s). use golomb instead.",
                 method_size, method);
@@ -134,7 +221,166 @@ parse_compress_method(wiser_env *env, const char *method,
                         "compress_method", sizeof("compress_method") - 1,
                         "golomb", sizeof("golomb") - 1);
     break;
+  case compress_streamvbyte:
+    db_replace_settings(env,
+                        "compress_method", sizeof("compress_method") - 1,
+                        "streamvbyte", sizeof("streamvbyte") - 1);
+    break;
+  }
+}
+
+/**
+ * 设定倒排列表中跳表项的间隔
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] interval 跳表项的间隔（字符串）。为NULL时表示使用不带跳表的旧格式
+ * @param[in] interval_size 跳表项的间隔的字节数。为-1时表示interval是以NULL结尾的字符串
+ */
+static void
+parse_skip_interval(wiser_env *env, const char *interval,
+                    int interval_size)
+{
+  char buf[16];
+
+  env->skip_interval = 0;
+  if (interval && interval_size < 0) { interval_size = strlen(interval); }
+  if (interval && interval_size > 0 && interval_size < sizeof(buf)) {
+    memcpy(buf, interval, interval_size);
+    buf[interval_size] = '\0';
+    env->skip_interval = atoi(buf);
+  }
+  if (env->skip_interval < 0) {
+    print_error("invalid skip interval(%.*s). use old format instead.",
+                interval_size, interval);
+    env->skip_interval = 0;
   }
+  snprintf(buf, sizeof(buf), "%d", env->skip_interval);
+  db_replace_settings(env,
+                      "skip_interval", sizeof("skip_interval") - 1,
+                      buf, strlen(buf));
+}
+
+/**
+ * 设定倒排列表的存储格式
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @param[in] format 存储格式的名称。为NULL时使用tokens表
+ * @param[in] format_size 存储格式名称的字节数。为-1时表示format是以NULL结尾的字符串
+ */
+static void
+parse_index_format(wiser_env *env, const char *format, int format_size)
+{
+  if (format && format_size < 0) { format_size = strlen(format); }
+  if (!format || !format_size
+      || MEMSTRCMP(format, format_size, "sqlite")) {
+    env->format = index_format_sqlite;
+  } else if (MEMSTRCMP(format, format_size, "segment")) {
+    env->format = index_format_segment;
+  } else {
+    print_error("invalid index format(%.*s). use sqlite instead.",
+                format_size, format);
+    env->format = index_format_sqlite;
+  }
+  if (env->format == index_format_segment && !env->skip_interval) {
+    print_error("segment format requires skip lists. use sqlite instead.");
+    env->format = index_format_sqlite;
+  }
+  switch (env->format) {
+  case index_format_sqlite:
+    db_replace_settings(env,
+                        "index_format", sizeof("index_format") - 1,
+                        "sqlite", sizeof("sqlite") - 1);
+    break;
+  case index_format_segment:
+    db_replace_settings(env,
+                        "index_format", sizeof("index_format") - 1,
+                        "segment", sizeof("segment") - 1);
+    break;
+  }
+}
+
+/**
+ * 读取检索时所需的、在构建索引时确定的配置
+ * @param[in] env 存储着应用程序运行环境的结构体
+ * @retval 0 成功
+ * @retval -1 无法打开段
+ */
+static int
+load_search_settings(wiser_env *env)
+{
+  int cm_size, si_size = 0, if_size = 0;
+  const char *cm, *si = NULL, *ifmt = NULL;
+  db_get_settings(env,
+                  "compress_method", sizeof("compress_method") - 1,
+                  &cm, &cm_size);
+  parse_compress_method(env, cm, cm_size);
+  db_get_settings(env,
+                  "skip_interval", sizeof("skip_interval") - 1,
+                  &si, &si_size);
+  parse_skip_interval(env, si, si_size);
+  db_get_settings(env,
+                  "index_format", sizeof("index_format") - 1,
+                  &ifmt, &if_size);
+  parse_index_format(env, ifmt, if_size);
+  db_get_corpus_stats(env, &env->stats);
+  if (env->format == index_format_segment && load_segments(env)) {
+    print_error("cannot load segments.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * 批量检索。用多个线程执行查询文件中的查询
+ * 第0个线程使用env，其他线程各自打开数据库，使用专用的运行环境。解码后的倒排列表的缓存由所有线程共享
+ * @param[in] env 已加载了检索设置的运行环境
+ * @param[in] n_threads 执行查询的线程数
+ * @param[in] query_file 查询文件的路径
+ * @param[in] pragmas sqlite3的PRAGMA的列表。为NULL时不设置
+ * @retval 0 成功
+ * @retval -1 失败
+ */
+static int
+run_batch_search(wiser_env *env, int n_threads, const char *query_file,
+                 const char *pragmas)
+{
+  int i, rc, n_envs = 1;
+  wiser_env *workers, **envs;
+
+  if (n_threads < 1) { n_threads = 1; }
+  if (!(workers = calloc(n_threads, sizeof(wiser_env))) ||
+      !(envs = malloc(sizeof(wiser_env *) * n_threads))) {
+    print_error("cannot allocate memory for batch search.");
+    free(workers);
+    return -1;
+  }
+  envs[0] = env;
+  /* 加载检索设置时会写入settings表，所以要先释放其他连接持有的锁 */
+  db_reset_statements(env);
+  for (i = 1; i < n_threads; i++) {
+    wiser_env *w = &workers[i];
+    if (init_env(w, env->ii_buffer_update_threshold,
+                 env->enable_phrase_search, env->top_k, env->db_path,
+                 pragmas)) {
+      break;
+    }
+    if (load_search_settings(w)) {
+      fin_env(w);
+      break;
+    }
+    db_reset_statements(w);
+    w->search_threads = env->search_threads;
+    w->explain = env->explain;
+    w->postings_cache = env->postings_cache;
+    envs[n_envs++] = w;
+  }
+  rc = run_batch(envs, n_envs, query_file);
+  for (i = 1; i < n_envs; i++) {
+    /* 缓存由env负责释放 */
+    envs[i]->postings_cache = NULL;
+    fin_env(envs[i]);
+  }
+  free(envs);
+  free(workers);
+  return rc;
 }
 
 /**
@@ -150,15 +396,24 @@ main(int argc, char *argv[])
   int max_index_count = -1; /* 不限制参与索引构建的文档数量 */
   int ii_buffer_update_threshold = DEFAULT_II_BUFFER_UPDATE_THRESHOLD;
   int enable_phrase_search = TRUE;
+  int n_threads = 1; /* 在当前线程中构建索引 */
+  int search_threads = 1; /* 在当前线程中检索 */
+  int top_k = 0; /* 输出全部检索结果 */
+  int explain = FALSE; /* 不输出查询计划 */
+  int spimi = FALSE; /* 在后台合并段 */
+  long long cache_size = 0; /* 不缓存解码后的倒排列表 */
+  long long ii_buffer_size_limit = 0; /* 只按文档数清空缓冲区 */
+  int threshold_given = FALSE;
   const char *compress_method_str = NULL, *wikipedia_dump_file = NULL,
-              *query = NULL;
+              *query = NULL, *socket_path = NULL, *index_format_str = NULL,
+              *pragmas = NULL, *query_file = NULL;
   /* 解析参数字符串 */
   {
     int ch;
     extern int opterr;
     extern char *optarg;
 
-    while ((ch = getopt(argc, argv, "c:x:q:m:t:s")) != -1) {
+    while ((ch = getopt(argc, argv, "c:x:q:Q:m:t:sj:k:S:C:f:RM:P:T:E")) != -1) {
       switch (ch) {
       case 'c':
         compress_method_str = optarg;
@@ -169,15 +424,55 @@ main(int argc, char *argv[])
       case 'q':
         query = optarg;
         break;
+      case 'Q':
+        query_file = optarg;
+        break;
       case 'm':
         max_index_count = atoi(optarg);
         break;
       case 't':
         ii_buffer_update_threshold = atoi(optarg);
+        threshold_given = TRUE;
         break;
       case 's':
         enable_phrase_search = FALSE;
         break;
+      case 'j':
+        n_threads = atoi(optarg);
+        break;
+      case 'k':
+        top_k = atoi(optarg);
+        break;
+      case 'S':
+        socket_path = optarg;
+        break;
+      case 'C':
+        if ((cache_size = parse_size(optarg)) < 0) {
+          print_error("invalid cache size(%s).", optarg);
+          return -1;
+        }
+        break;
+      case 'f':
+        index_format_str = optarg;
+        break;
+      case 'R':
+        spimi = TRUE;
+        break;
+      case 'M':
+        if ((ii_buffer_size_limit = parse_size(optarg)) <= 0) {
+          print_error("invalid memory budget(%s).", optarg);
+          return -1;
+        }
+        break;
+      case 'P':
+        pragmas = optarg;
+        break;
+      case 'T':
+        search_threads = atoi(optarg);
+        break;
+      case 'E':
+        explain = TRUE;
+        break;
       }
     }
   }
@@ -191,17 +486,59 @@ main(int argc, char *argv[])
       "  -c compress_method            : compress method for postings list\n"
       "  -x wikipedia_dump_xml         : wikipedia dump xml path for indexing\n"
       "  -q search_query               : query for search\n"
+      "  -Q query_file                 : run each line of the file as a query\n"
+      "                                  and report throughput and latency\n"
+      "                                  percentiles (with -j, on that many\n"
+      "                                  threads)\n"
       "  -m max_index_count            : max count for indexing document\n"
       "  -t ii_buffer_update_threshold : inverted index buffer merge threshold\n"
+      "  -M memory_budget              : flush the inverted index buffer when it\n"
+      "                                  holds this many bytes (e.g. 4G). -t is\n"
+      "                                  ignored unless given explicitly\n"
       "  -s                            : don't use tokens' positions for search\n"
+      "  -j threads                    : number of threads for tokenizing documents\n"
+      "                                  or for running queries of -Q\n"
+      "  -k top_k                      : print only top k search results\n"
+      "  -T threads                    : number of threads for searching. the\n"
+      "                                  documents are split into this many\n"
+      "                                  doc id ranges searched in parallel\n"
+      "  -E                            : print the query plan (token order and\n"
+      "                                  intersection method of each postings\n"
+      "                                  list) to stderr\n"
+      "  -S socket_path                : serve queries on a unix domain socket\n"
+      "                                  (one query per line, each response\n"
+      "                                   ends with an empty line)\n"
+      "  -C cache_size                 : bytes of decoded postings to cache\n"
+      "                                  for search (e.g. 64M)\n"
+      "  -f index_format               : storage format for postings lists\n"
+      "  -R                            : write each flush as a sorted run and\n"
+      "                                  merge all runs once at the end\n"
+      "                                  (segment format only)\n"
+      "  -P pragmas                    : comma separated sqlite pragmas to set\n"
+      "                                  (page_size, journal_mode, synchronous,\n"
+      "                                   cache_size, mmap_size). for indexing\n"
+      "                                  the default is\n"
+      "                                  " DEFAULT_INDEX_PRAGMAS_STR "\n"
       "\n"
       "compress_methods:\n"
-      "  none   : don't compress.\n"
-      "  golomb : Golomb-Rice coding(default).\n",
+      "  none        : don't compress.\n"
+      "  golomb      : Golomb-Rice coding(default).\n"
+      "  streamvbyte : Stream VByte coding. faster to decode.\n"
+      "\n"
+      "index_formats:\n"
+      "  segment     : write immutable segment files next to the database,\n"
+      "                merge them in the background and read them through\n"
+      "                mmap(default).\n"
+      "  sqlite      : merge into the tokens table of the database.\n",
       argv[0]);
     return -1;
   }
 
+  /* 按字节数清空缓冲区时，除非明确指定，否则不再按文档数清空 */
+  if (ii_buffer_size_limit && !threshold_given) {
+    ii_buffer_update_threshold = INT_MAX;
+  }
+
   /* 在构建索引时，若指定的数据库已存在则报错 */
   {
     struct stat st;
@@ -211,36 +548,82 @@ main(int argc, char *argv[])
     }
   }
 
+  /* 构建索引时，除非明确指定，否则使用适合批量写入的PRAGMA */
+  if (wikipedia_dump_file && !pragmas) {
+    pragmas = DEFAULT_INDEX_PRAGMAS_STR;
+  }
+
   {
     int rc = init_env(&env, ii_buffer_update_threshold, enable_phrase_search,
-                  argv[optind]);
+                      top_k, argv[optind], pragmas);
     if (!rc) {
       print_time_diff();
 
       /* 加载Wikipedia的词条数据 */
       if (wikipedia_dump_file) {
+        struct rusage ru;
+        env.ii_buffer_size_limit = ii_buffer_size_limit;
         parse_compress_method(&env, compress_method_str, -1);
+        parse_skip_interval(&env, DEFAULT_SKIP_INTERVAL_STR, -1);
+        parse_index_format(&env, index_format_str ? index_format_str
+                                                  : DEFAULT_INDEX_FORMAT_STR,
+                           -1);
+        if (spimi && env.format != index_format_segment) {
+          print_error("-R requires segment format. ignored.");
+        }
+        env.spimi = spimi && env.format == index_format_segment;
+        db_get_corpus_stats(&env, &env.stats);
         begin(&env);
-        if (!load_wikipedia_dump(&env, wikipedia_dump_file, add_document,
-                                 max_index_count)) {
+        if ((n_threads > 1 && start_indexer(&env, n_threads)) ||
+            (env.format == index_format_segment && !env.spimi &&
+             start_segment_merger(&env))) {
+          stop_indexer(&env);
+          rollback(&env);
+        } else if (!load_wikipedia_dump(&env, wikipedia_dump_file,
+                                        add_document, max_index_count)) {
           /* 清空缓冲区 */
           add_document(&env, NULL, NULL);
-          commit(&env);
+          stop_indexer(&env);
+          stop_segment_merger(&env);
+          if (env.index_failed || (env.spimi && merge_runs(&env)) ||
+              db_replace_corpus_stats(&env, &env.stats)) {
+            rollback(&env);
+          } else {
+            commit(&env);
+          }
         } else {
+          stop_indexer(&env);
+          stop_segment_merger(&env);
           rollback(&env);
         }
+        /* ru_maxrss的单位是KB */
+        getrusage(RUSAGE_SELF, &ru);
+        print_error("peak inverted index buffer: %zu bytes, "
+                    "peak resident set size: %ld bytes",
+                    env.ii_buffer_peak_size, ru.ru_maxrss * 1024L);
       }
 
       /* 进行检索 */
+      if ((query || query_file || socket_path) &&
+          load_search_settings(&env)) {
+        query = query_file = socket_path = NULL;
+        rc = -1;
+      }
+      if (query || query_file || socket_path) {
+        env.search_threads = search_threads > 1 ? search_threads : 1;
+        env.explain = explain;
+        if (cache_size > 0) {
+          env.postings_cache = alloc_postings_cache(cache_size);
+        }
+      }
       if (query) {
-        int cm_size;
-        const char *cm;
-        db_get_settings(&env,
-                        "compress_method", sizeof("compress_method") - 1,
-                        &cm, &cm_size);
-        parse_compress_method(&env, cm, cm_size);
-        env.indexed_count = db_get_document_count(&env);
-        search(&env, query);
+        search(&env, query, stdout);
+      }
+      if (query_file) {
+        rc = run_batch_search(&env, n_threads, query_file, pragmas);
+      }
+      if (socket_path) {
+        rc = run_server(&env, socket_path);
       }
       fin_env(&env);
 
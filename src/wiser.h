@@ -1,6 +1,7 @@
 #ifndef __WISER_H__
 #define __WISER_H__
 
+#include <stdint.h>
 #include <utlist.h>
 #include <uthash.h>
 #include <utarray.h>
@@ -9,29 +10,78 @@
 /* bi-gram */
 #define N_GRAM 2
 
-/* 倒排列表（以文档编号和位置信息为元素的链表结构）*/
+/* 可以直接由字符（UTF-32）拼成64位词元编码的N-gram中N的最大值 */
+#define TOKEN_CODE_MAX_LEN 2
+
+/* 倒排列表（将文档编号和位置信息分别存储在连续数组中的结构）*/
 typedef struct _postings_list {
-  int document_id;             /* 文档编号 */
-  UT_array *positions;         /* 位置信息的数组 */
-  int positions_count;         /* 位置信息的条数 */
-  struct _postings_list *next; /* 指向下一个倒排列表的指针 */
+  int *document_ids;      /* 按升序排列的文档编号的数组 */
+  int *positions_offsets; /* 各文档的位置信息在positions中的起始下标。元素数为len + 1 */
+  int *positions;         /* 将各文档的位置信息依次排列而成的数组 */
+  int len;                /* 文档数 */
+  int positions_len;      /* 位置信息的总数 */
+  int capacity;           /* document_ids中可以容纳的文档数 */
+  int positions_capacity; /* positions中可以容纳的位置信息数 */
+  struct _arena *arena;   /* 分配该倒排列表的内存池。为NULL时用malloc分配 */
 } postings_list;
 
+/* 倒排列表中第i个文档的位置信息的条数 */
+#define POSTINGS_POSITIONS_COUNT(pl, i) \
+  ((pl)->positions_offsets[(i) + 1] - (pl)->positions_offsets[i])
+/* 指向倒排列表中第i个文档的位置信息的指针 */
+#define POSTINGS_POSITIONS(pl, i) \
+  ((pl)->positions + (pl)->positions_offsets[i])
+
 /* 倒排索引（以词元编号为键，以倒排列表为值的关联数组） */
 typedef struct {
-  int token_id;                 /* 词元编号（Token ID）*/
+  uint64_t token_code;          /* 哈希表的键。构建索引时为由字符拼成的词元编码，检索时与token_id相同 */
+  int token_id;                 /* 词元编号（Token ID）。按词元编码构建索引时，在写入前才被赋值 */
   postings_list *postings_list; /* 指向包含该词元的倒排列表的指针 */
   int docs_count;               /* 出现过该词元的文档数 */
   int positions_count;          /* 该词元在所有文档中的出现次数之和 */
+  struct _arena *arena;         /* 分配该项的内存池。为NULL时用malloc分配 */
   UT_hash_handle hh;            /* 用于将该结构体转化为哈希表 */
 } inverted_index_hash, inverted_index_value;
 
+/* 以词元编码为键，在倒排索引中查找或添加元素 */
+#define HASH_FIND_TOKEN(head, findcode, out) \
+  HASH_FIND(hh, head, findcode, sizeof(uint64_t), out)
+#define HASH_ADD_TOKEN(head, add) \
+  HASH_ADD(hh, head, token_code, sizeof(uint64_t), add)
+
+/* 词元词典（以词元为键，以词元编号为值的关联数组）中的元素 */
+typedef struct _token_dictionary {
+  int token_id;                       /* 词元编号 */
+  struct _token_dictionary *next_new; /* 下一个尚未写入tokens表的词元 */
+  UT_hash_handle hh;                  /* 用于将该结构体转化为哈希表 */
+  int token_size;                     /* 词元的字节数 */
+  char token[1];                      /* 词元（UTF-8）。实际长度为token_size */
+} token_dictionary;
+
 /* 压缩倒排列表等数据的方法 */
 typedef enum {
-  compress_none,  /* 不压缩 */
-  compress_golomb /* 使用Golomb编码压缩 */
+  compress_none,       /* 不压缩 */
+  compress_golomb,     /* 使用Golomb编码压缩 */
+  compress_streamvbyte /* 使用Stream VByte编码压缩 */
 } compress_method;
 
+/* 倒排列表的存储格式 */
+typedef enum {
+  index_format_sqlite, /* 存储在tokens表中 */
+  index_format_segment /* 存储在用mmap读取的不可变的段文件中 */
+} index_format;
+
+/* 语料库的统计信息。构建索引时增量地维护，提交时保存到settings表中 */
+typedef struct {
+  int documents_count;    /* 文档总数 */
+  long long tokens_count; /* 所有文档中词元的出现次数之和 */
+} corpus_stats;
+
+/* 文档的平均长度（词元数） */
+#define CORPUS_AVERAGE_DOCUMENT_LENGTH(s) \
+  ((s)->documents_count ? \
+   (double)(s)->tokens_count / (s)->documents_count : 0.0)
+
 /* 应用程序的全局配置 */
 typedef struct _wiser_env {
   const char *db_path;            /* 数据库的路径*/
@@ -39,11 +89,36 @@ typedef struct _wiser_env {
   int token_len;                  /* 词元的长度。N-gram中N的取值 */
   compress_method compress;       /* 压缩倒排列表等数据的方法 */
   int enable_phrase_search;       /* 是否进行短语检索 */
+  int top_k;                      /* 只输出得分最高的前top_k个检索结果。为0时输出全部 */
+  int search_threads;             /* 检索时并行处理的分片（文档编号的范围）数。为1时不并行 */
+  int explain;                    /* 是否将检索时的查询计划输出到标准错误输出 */
+  int skip_interval;              /* 倒排列表中跳表项的间隔（文档数）。为0时表示不带跳表的旧格式 */
+  index_format format;            /* 倒排列表的存储格式 */
+  int spimi;                      /* 是否先将缓冲区写成临时的有序段（run），最后一次性归并（SPIMI） */
 
   inverted_index_hash *ii_buffer; /* 用于更新倒排索引的缓冲区（Buffer） */
   int ii_buffer_count;            /* 用于更新倒排索引的缓冲区中的文档数 */
+  int ii_buffer_min_document_id;  /* 缓冲区中最小的文档编号。缓冲区为空时为0 */
   int ii_buffer_update_threshold; /* 缓冲区中文档数的阈值 */
-  int indexed_count;              /* 建立了索引的文档数 */
+  struct _arena *ii_buffer_arena; /* 分配缓冲区中的倒排索引项和倒排列表的内存池。清空缓冲区时重置 */
+  size_t ii_buffer_size_limit;    /* 缓冲区字节数的阈值。为0时只按文档数清空缓冲区 */
+  size_t ii_buffer_peak_size;     /* 缓冲区所占字节数的峰值（包括分词线程中的部分） */
+  int index_failed;               /* 更新倒排索引时是否发生了错误。发生错误后不再添加文档 */
+  int indexed_count;              /* 本次运行中建立了索引的文档数（包括更新的文档） */
+  corpus_stats stats;             /* 语料库的统计信息 */
+  struct _index_pipeline *pipeline; /* 多线程构建索引用的流水线。为NULL时在当前线程中构建索引 */
+  struct _postings_cache *postings_cache; /* 解码后的倒排列表的缓存。为NULL时不使用缓存 */
+  struct _segment **segments;     /* 已打开的段。按文档编号的升序排列 */
+  int n_segments;                 /* 已打开的段的个数 */
+  int max_segment_id;             /* 已分配的段编号的最大值 */
+  struct _segment_merger *merger; /* 在后台合并段的线程。为NULL时不合并段 */
+
+  token_dictionary *token_dict;   /* 词元词典。在首次使用时从tokens表中加载 */
+  token_dictionary *new_tokens;   /* 尚未写入tokens表的词元的链表（写回缓冲） */
+  token_dictionary **new_tokens_tail; /* 指向new_tokens链表末尾的指针 */
+  int token_dict_loaded;          /* 是否已经加载了词元词典 */
+  int max_token_id;               /* 已分配的词元编号的最大值 */
+  struct _arena *query_arena;     /* 分配查询的词元和位置信息的内存池。每次检索后重置 */
 
   /* 与sqlite3相关的配置 */
   sqlite3 *db; /* sqlite3的实例 */
@@ -55,11 +130,14 @@ typedef struct _wiser_env {
   sqlite3_stmt *get_token_id_st;
   sqlite3_stmt *get_token_st;
   sqlite3_stmt *store_token_st;
+  sqlite3_stmt *insert_token_st;
   sqlite3_stmt *get_postings_st;
   sqlite3_stmt *update_postings_st;
   sqlite3_stmt *get_settings_st;
   sqlite3_stmt *replace_settings_st;
   sqlite3_stmt *get_document_count_st;
+  sqlite3_stmt *insert_segment_st;
+  sqlite3_stmt *delete_segment_st;
   sqlite3_stmt *begin_st;
   sqlite3_stmt *commit_st;
   sqlite3_stmt *rollback_st;
@@ -72,5 +150,11 @@ typedef struct _wiser_env {
 #endif
 
 #define DEFAULT_II_BUFFER_UPDATE_THRESHOLD 2048
+#define DEFAULT_SKIP_INTERVAL_STR "128"
+#define DEFAULT_INDEX_FORMAT_STR "segment"
+#define DEFAULT_INDEX_PRAGMAS_STR \
+  "page_size=8192,journal_mode=delete,synchronous=normal,cache_size=-65536"
+#define II_BUFFER_ARENA_BLOCK_SIZE (1 << 20) /* 倒排索引缓冲区的内存池中块的字节数 */
+#define QUERY_ARENA_BLOCK_SIZE (64 << 10)    /* 查询的内存池中块的字节数 */
 
 #endif /* __WISER_H__ */